@@ -0,0 +1,898 @@
+#ifndef BIOS_H
+#define BIOS_H
+
+//
+// BIOS high level emulation
+//
+// Some BIOS functions are serviced natively when the software interrupt is executed, instead of running
+// the routines of the BIOS ROM. The registers are left as the BIOS routine leaves them, and the cycles
+// are an approximation of what the routine takes. Functions that are not implemented here (or inputs
+// the BIOS does not handle, like a division by zero) still go through the BIOS ROM.
+//
+typedef enum BiosFunction {
+    BIOS_HALT               = 0x02,
+    BIOS_INTR_WAIT          = 0x04,
+    BIOS_VBLANK_INTR_WAIT   = 0x05,
+    BIOS_DIV        = 0x06,
+    BIOS_DIV_ARM    = 0x07,
+    BIOS_SQRT       = 0x08,
+    BIOS_ARC_TAN    = 0x09,
+    BIOS_ARC_TAN2   = 0x0A,
+    BIOS_CPU_SET        = 0x0B,
+    BIOS_CPU_FAST_SET   = 0x0C,
+    BIOS_BG_AFFINE_SET  = 0x0E,
+    BIOS_OBJ_AFFINE_SET = 0x0F,
+    BIOS_LZ77_UNCOMP_WRAM       = 0x11,
+    BIOS_LZ77_UNCOMP_VRAM       = 0x12,
+    BIOS_HUFF_UNCOMP            = 0x13,
+    BIOS_RL_UNCOMP_WRAM         = 0x14,
+    BIOS_RL_UNCOMP_VRAM         = 0x15,
+    BIOS_DIFF_8BIT_UNFILTER_WRAM = 0x16,
+    BIOS_DIFF_8BIT_UNFILTER_VRAM = 0x17,
+    BIOS_DIFF_16BIT_UNFILTER    = 0x18,
+} BiosFunction;
+
+// Approximate cycles of each routine (including the BIOS software interrupt handler), on top of the
+// software interrupt instruction itself. Averages of the BIOS routines running in the interpreter.
+#define BIOS_CYCLES_HALT        (20)
+#define BIOS_CYCLES_DIV         (140)
+#define BIOS_CYCLES_SQRT        (720)
+#define BIOS_CYCLES_ARC_TAN     (60)
+#define BIOS_CYCLES_ARC_TAN2    (200)
+#define BIOS_CYCLES_CPU_SET                 (90)
+#define BIOS_CYCLES_CPU_SET_UNIT            (10)    /* Per halfword or word copied */
+#define BIOS_CYCLES_CPU_SET_FILL_UNIT       (8)
+#define BIOS_CYCLES_CPU_FAST_SET            (100)
+#define BIOS_CYCLES_CPU_FAST_SET_BLOCK      (23)    /* Per 8 words copied */
+#define BIOS_CYCLES_CPU_FAST_SET_FILL_BLOCK (13)
+#define BIOS_CYCLES_AFFINE_SET              (50)
+#define BIOS_CYCLES_BG_AFFINE_SET_ENTRY     (60)
+#define BIOS_CYCLES_OBJ_AFFINE_SET_ENTRY    (40)
+#define BIOS_CYCLES_UNCOMP                  (200)
+
+#define BIOS_CPU_SET_COUNT_MASK     (0x1FFFFF)
+#define BIOS_CPU_SET_FIXED_SOURCE   (1 << 24)
+#define BIOS_CPU_SET_32_BIT         (1 << 26)
+
+
+/**
+ * Halt stops the CPU until an interrupt enabled in IE is requested. The CPU is only flagged as halted
+ * here, the cycles are skipped by the main loop.
+ */
+static void
+bios_halt(CPU *cpu)
+{
+    cpu->halted = true;
+    cpu->cycles += BIOS_CYCLES_HALT;
+}
+
+static void
+bios_div(CPU *cpu, s32 numerator, s32 denominator)
+{
+    // NOTE: 0x80000000 / -1 overflows, the result wraps as in the BIOS routine.
+    s32 quotient = (s32)((s64)numerator / denominator);
+    s32 remainder = (s32)((s64)numerator % denominator);
+
+    cpu->r0 = (u32)quotient;
+    cpu->r1 = (u32)remainder;
+    cpu->r3 = (quotient < 0) ? -(u32)quotient : (u32)quotient;
+
+    cpu->cycles += BIOS_CYCLES_DIV;
+}
+
+/**
+ * Same Newton iterations as the BIOS routine, which also leaves the last estimate in r1 and the last
+ * quotient in r3.
+ */
+static void
+bios_sqrt(CPU *cpu)
+{
+    u32 value = cpu->r0;
+
+    // Initial estimate: a power of two close to the square root.
+    u32 halved = value;
+    u32 estimate = 1;
+    while (halved > estimate) {
+        halved >>= 1;
+        estimate <<= 1;
+    }
+
+    u32 previous;
+    u32 quotient;
+    do {
+        // quotient = value / estimate
+        previous = estimate;
+        quotient = 0;
+
+        u32 remainder = value;
+        u32 divisor = estimate;
+        for (;;) {
+            u8 lower = divisor < (remainder >> 1);
+            if (divisor <= (remainder >> 1)) divisor <<= 1;
+            if (!lower) break;
+        }
+        for (;;) {
+            u8 fits = remainder >= divisor;
+            quotient = (quotient << 1) | fits;
+            if (fits) remainder -= divisor;
+
+            if (divisor == estimate) break;
+            divisor >>= 1;
+        }
+
+        estimate = (estimate + quotient) >> 1;
+    } while (estimate < previous);
+
+    cpu->r0 = previous;
+    cpu->r1 = estimate;
+    cpu->r3 = quotient;
+
+    cpu->cycles += BIOS_CYCLES_SQRT;
+}
+
+/**
+ * Polynomial approximation the BIOS uses for the arc tangent of a 1.1.14 fixed point value. The result
+ * is in the range -0x4000 to 0x4000 (-PI/2 to PI/2). r1 and r3 get the values the BIOS leaves there.
+ */
+static s32
+bios_arc_tan(s32 value, u32 *r1, u32 *r3)
+{
+    // NOTE: The products are done as u32 to wrap like the ARM multiplications do.
+    s32 a = -((s32)((u32)value * (u32)value) >> 14);
+    s32 b = ((s32)(0xA9u * (u32)a) >> 14) + 0x390;
+    b = ((s32)((u32)b * (u32)a) >> 14) + 0x91C;
+    b = ((s32)((u32)b * (u32)a) >> 14) + 0xFB6;
+    b = ((s32)((u32)b * (u32)a) >> 14) + 0x16AA;
+    b = ((s32)((u32)b * (u32)a) >> 14) + 0x2081;
+    b = ((s32)((u32)b * (u32)a) >> 14) + 0x3651;
+    b = ((s32)((u32)b * (u32)a) >> 14) + 0xA2F9;
+
+    if (r1) *r1 = (u32)a;
+    if (r3) *r3 = (u32)b;
+
+    return (s32)((u32)value * (u32)b) >> 16;
+}
+
+/**
+ * Quotient of the BIOS Div routine, which ArcTan2 uses.
+ */
+static s32
+bios_quotient(s32 numerator, s32 denominator)
+{
+    return (s32)((s64)numerator / denominator);
+}
+
+/**
+ * Angle of the vector (x, y), with 0x10000 being a full turn. Like the BIOS, it can return 0x10000.
+ */
+static u32
+bios_arc_tan2(s32 x, s32 y, u32 *r1)
+{
+    if (y == 0) return (x >= 0) ? 0 : 0x8000;
+    if (x == 0) return (y >= 0) ? 0x4000 : 0xC000;
+
+    // NOTE: The BIOS shifts the operands as u32 (lsl), so they wrap.
+    s32 x_shifted = (s32)((u32)x << 14);
+    s32 y_shifted = (s32)((u32)y << 14);
+
+    if (y >= 0) {
+        if (x >= 0) {
+            if (x >= y) return (u32)bios_arc_tan(bios_quotient(y_shifted, x), r1, 0);
+        } else if (-x >= y) {
+            return (u32)(bios_arc_tan(bios_quotient(y_shifted, x), r1, 0) + 0x8000);
+        }
+
+        return (u32)(0x4000 - bios_arc_tan(bios_quotient(x_shifted, y), r1, 0));
+    }
+
+    if (x <= 0) {
+        if (-x > -y) return (u32)(bios_arc_tan(bios_quotient(y_shifted, x), r1, 0) + 0x8000);
+    } else if (x >= -y) {
+        return (u32)(bios_arc_tan(bios_quotient(y_shifted, x), r1, 0) + 0x10000);
+    }
+
+    return (u32)(0xC000 - bios_arc_tan(bios_quotient(x_shifted, y), r1, 0));
+}
+
+typedef struct BiosMemoryRegion {
+    u32 address;
+    u32 size;
+    u8 *memory;
+} BiosMemoryRegion;
+
+/**
+ * Finds the linear part of the memory region holding the address. Mirrors and the BIOS are left to the
+ * BIOS routines, and so are the I/O registers, which have to go through their handlers on the bus.
+ */
+static bool
+get_bios_memory_region(GBAMemory *gba_memory, u32 address, bool write, BiosMemoryRegion *region)
+{
+    BiosMemoryRegion regions[] = {
+        { 0x02000000, sizeof(gba_memory->ewram),                gba_memory->ewram },
+        { 0x03000000, sizeof(gba_memory->iwram),                gba_memory->iwram },
+        { 0x05000000, sizeof(gba_memory->bg_obj_palette_ram),   gba_memory->bg_obj_palette_ram },
+        { 0x06000000, 0x18000,                                  gba_memory->vram },
+        { 0x07000000, sizeof(gba_memory->oam_obj_attributes),   gba_memory->oam_obj_attributes },
+        { 0x08000000, gba_memory->game_pak_rom_size,            gba_memory->game_pak_rom },
+    };
+
+    // NOTE: The Game Pak ROM can only be the source.
+    int region_count = (int)(sizeof(regions) / sizeof(regions[0])) - (write ? 1 : 0);
+    for (int i = 0; i < region_count; ++i) {
+        if (address >= regions[i].address && address - regions[i].address < regions[i].size) {
+            *region = regions[i];
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Host memory of a transfer of size bytes from address, or 0 if it does not fit in a single region.
+ */
+static u8 *
+get_bios_transfer_memory(GBAMemory *gba_memory, u32 address, u32 size, bool write)
+{
+    BiosMemoryRegion region;
+    if (!get_bios_memory_region(gba_memory, address, write, &region)) return 0;
+
+    u32 offset = address - region.address;
+    if (size > region.size - offset) return 0;
+
+    return region.memory + offset;
+}
+
+/**
+ * Fills size bytes with a halfword or word pattern. Once the first unit is written, the filled part is
+ * copied over the rest, doubling each time, so long fills are done with wide copies.
+ */
+static void
+bios_fill(u8 *destination, u32 value, u32 unit_size, u32 size)
+{
+    u8 pattern[4];
+    memcpy(pattern, &value, sizeof(pattern));
+
+    bool same_bytes = (pattern[0] == pattern[1]);
+    if (unit_size == 4) same_bytes = same_bytes && pattern[0] == pattern[2] && pattern[0] == pattern[3];
+
+    if (same_bytes) {
+        memset(destination, pattern[0], size);
+        return;
+    }
+
+    if (size == 0) return;
+    memcpy(destination, pattern, unit_size);
+
+    u32 filled = unit_size;
+    while (filled < size) {
+        u32 chunk = (filled < size - filled) ? filled : size - filled;
+        memcpy(destination + filled, destination, chunk);
+        filled += chunk;
+    }
+}
+
+/**
+ * Copies (or fills, with a fixed source) size bytes between two regions in a single pass. Returns false,
+ * so the BIOS routine does it, if either side is not linear memory or the copy would be affected by the
+ * overlap (the BIOS copies forwards).
+ */
+static bool
+bios_transfer(GBAMemory *gba_memory, BlockCache *cache, u32 source, u32 destination, u32 size, u32 unit_size, bool fill)
+{
+    u8 *from = get_bios_transfer_memory(gba_memory, source, fill ? unit_size : size, false);
+    u8 *to = get_bios_transfer_memory(gba_memory, destination, size, true);
+    if (!from || !to) return false;
+
+    if (fill) {
+        u32 value = 0;
+        memcpy(&value, from, unit_size);
+        bios_fill(to, value, unit_size, size);
+    } else {
+        if (to > from && to < from + size) return false;
+        memmove(to, from, size);
+    }
+
+    invalidate_cached_code_range(cache, gba_memory, to, size);
+
+    return true;
+}
+
+/**
+ * CpuSet: copies or fills r2 bits 0-20 halfwords (words if bit 26 is set) from r0 to r1; with bit 24
+ * set the unit at r0 is the fill value.
+ */
+static bool
+bios_cpu_set(CPU *cpu, GBAMemory *gba_memory, BlockCache *cache)
+{
+    u32 source = cpu->r0;
+    u32 destination = cpu->r1;
+    u32 count = cpu->r2 & BIOS_CPU_SET_COUNT_MASK;
+    bool fill = (cpu->r2 & BIOS_CPU_SET_FIXED_SOURCE) != 0;
+    u32 unit_size = (cpu->r2 & BIOS_CPU_SET_32_BIT) ? 4 : 2;
+
+    // The routine returns through r3, which ends up with the return address in the BIOS software
+    // interrupt handler.
+    cpu->r3 = 0x170;
+
+    // NOTE: The BIOS does nothing if the count is 0 or the source (checked as count words long) is in
+    // the BIOS region.
+    if (count == 0 || !(source & 0x0E000000) || !((source + count*4) & 0x0E000000)) {
+        cpu->cycles += BIOS_CYCLES_CPU_SET;
+        return true;
+    }
+
+    if ((source | destination) & (unit_size - 1)) return false;
+
+    u32 size = count*unit_size;
+    if (!bios_transfer(gba_memory, cache, source, destination, size, unit_size, fill)) return false;
+
+    // The word version advances r0 and r1, the halfword one indexes them.
+    if (unit_size == 4) {
+        cpu->r0 = fill ? source + 4 : source + size;
+        cpu->r1 = destination + size;
+    }
+
+    cpu->cycles += BIOS_CYCLES_CPU_SET + count*(fill ? BIOS_CYCLES_CPU_SET_FILL_UNIT : BIOS_CYCLES_CPU_SET_UNIT);
+
+    return true;
+}
+
+/**
+ * CpuFastSet: like CpuSet with words, but in blocks of 8 words (the count is rounded up).
+ */
+static bool
+bios_cpu_fast_set(CPU *cpu, GBAMemory *gba_memory, BlockCache *cache)
+{
+    u32 source = cpu->r0;
+    u32 destination = cpu->r1;
+    u32 count = cpu->r2 & BIOS_CPU_SET_COUNT_MASK;
+    bool fill = (cpu->r2 & BIOS_CPU_SET_FIXED_SOURCE) != 0;
+
+    if (count == 0 || !(source & 0x0E000000) || !((source + count*4) & 0x0E000000)) {
+        cpu->cycles += BIOS_CYCLES_CPU_FAST_SET;
+        return true;
+    }
+
+    if ((source | destination) & 3) return false;
+
+    u32 size = (count*4 + 31) & ~31u;
+    if (!bios_transfer(gba_memory, cache, source, destination, size, 4, fill)) return false;
+
+    // r3 holds the second word of the last block.
+    u8 *last = get_bios_transfer_memory(gba_memory, destination + size - 28, 4, true);
+    cpu->r3 = *(u32 *)last;
+
+    if (!fill) cpu->r0 = source + size;
+    cpu->r1 = destination + size;
+
+    u32 blocks = size / 32;
+    cpu->cycles += BIOS_CYCLES_CPU_FAST_SET + blocks*(fill ? BIOS_CYCLES_CPU_FAST_SET_FILL_BLOCK : BIOS_CYCLES_CPU_FAST_SET_BLOCK);
+
+    return true;
+}
+
+//
+// Affine transformations
+//
+// Sine of angle*2*PI/256 in 1.1.14 fixed point, the table the BIOS uses. The angle of a transformation
+// is the upper byte of its 16 bits angle, and its cosine is the entry 64 after its sine.
+//
+static const s16 bios_sine_table[256] = {
+    0x0000, 0x0192, 0x0323, 0x04B5, 0x0645, 0x07D5, 0x0964, 0x0AF1, 0x0C7C, 0x0E05, 0x0F8C, 0x1111, 0x1294, 0x1413, 0x158F, 0x1708,
+    0x187D, 0x19EF, 0x1B5D, 0x1CC6, 0x1E2B, 0x1F8B, 0x20E7, 0x223D, 0x238E, 0x24DA, 0x261F, 0x275F, 0x2899, 0x29CD, 0x2AFA, 0x2C21,
+    0x2D41, 0x2E5A, 0x2F6B, 0x3076, 0x3179, 0x3274, 0x3367, 0x3453, 0x3536, 0x3612, 0x36E5, 0x37AF, 0x3871, 0x392A, 0x39DA, 0x3A82,
+    0x3B20, 0x3BB6, 0x3C42, 0x3CC5, 0x3D3E, 0x3DAE, 0x3E14, 0x3E71, 0x3EC5, 0x3F0E, 0x3F4E, 0x3F84, 0x3FB1, 0x3FD3, 0x3FEC, 0x3FFB,
+    0x4000, 0x3FFB, 0x3FEC, 0x3FD3, 0x3FB1, 0x3F84, 0x3F4E, 0x3F0E, 0x3EC5, 0x3E71, 0x3E14, 0x3DAE, 0x3D3E, 0x3CC5, 0x3C42, 0x3BB6,
+    0x3B20, 0x3A82, 0x39DA, 0x392A, 0x3871, 0x37AF, 0x36E5, 0x3612, 0x3536, 0x3453, 0x3367, 0x3274, 0x3179, 0x3076, 0x2F6B, 0x2E5A,
+    0x2D41, 0x2C21, 0x2AFA, 0x29CD, 0x2899, 0x275F, 0x261F, 0x24DA, 0x238E, 0x223D, 0x20E7, 0x1F8B, 0x1E2B, 0x1CC6, 0x1B5D, 0x19EF,
+    0x187D, 0x1708, 0x158F, 0x1413, 0x1294, 0x1111, 0x0F8C, 0x0E05, 0x0C7C, 0x0AF1, 0x0964, 0x07D5, 0x0645, 0x04B5, 0x0323, 0x0192,
+    0x0000, -0x0192, -0x0323, -0x04B5, -0x0645, -0x07D5, -0x0964, -0x0AF1, -0x0C7C, -0x0E05, -0x0F8C, -0x1111, -0x1294, -0x1413, -0x158F, -0x1708,
+    -0x187D, -0x19EF, -0x1B5D, -0x1CC6, -0x1E2B, -0x1F8B, -0x20E7, -0x223D, -0x238E, -0x24DA, -0x261F, -0x275F, -0x2899, -0x29CD, -0x2AFA, -0x2C21,
+    -0x2D41, -0x2E5A, -0x2F6B, -0x3076, -0x3179, -0x3274, -0x3367, -0x3453, -0x3536, -0x3612, -0x36E5, -0x37AF, -0x3871, -0x392A, -0x39DA, -0x3A82,
+    -0x3B20, -0x3BB6, -0x3C42, -0x3CC5, -0x3D3E, -0x3DAE, -0x3E14, -0x3E71, -0x3EC5, -0x3F0E, -0x3F4E, -0x3F84, -0x3FB1, -0x3FD3, -0x3FEC, -0x3FFB,
+    -0x4000, -0x3FFB, -0x3FEC, -0x3FD3, -0x3FB1, -0x3F84, -0x3F4E, -0x3F0E, -0x3EC5, -0x3E71, -0x3E14, -0x3DAE, -0x3D3E, -0x3CC5, -0x3C42, -0x3BB6,
+    -0x3B20, -0x3A82, -0x39DA, -0x392A, -0x3871, -0x37AF, -0x36E5, -0x3612, -0x3536, -0x3453, -0x3367, -0x3274, -0x3179, -0x3076, -0x2F6B, -0x2E5A,
+    -0x2D41, -0x2C21, -0x2AFA, -0x29CD, -0x2899, -0x275F, -0x261F, -0x24DA, -0x238E, -0x223D, -0x20E7, -0x1F8B, -0x1E2B, -0x1CC6, -0x1B5D, -0x19EF,
+    -0x187D, -0x1708, -0x158F, -0x1413, -0x1294, -0x1111, -0x0F8C, -0x0E05, -0x0C7C, -0x0AF1, -0x0964, -0x07D5, -0x0645, -0x04B5, -0x0323, -0x0192,
+};
+
+/**
+ * Matrix of a rotation by angle and a scaling by (scale_x, scale_y), all in 8.8 fixed point, as the BIOS
+ * computes it. Only the low halfword of each element is written, but the BIOS uses the whole values to
+ * compute the reference point of BgAffineSet (a scale of -0x8000 gives 0x8000).
+ */
+static void
+bios_affine_matrix(s16 scale_x, s16 scale_y, u16 angle, s32 matrix[4])
+{
+    s32 sine = bios_sine_table[angle >> 8];
+    s32 cosine = bios_sine_table[((angle >> 8) + 64) & 0xFF];
+
+    matrix[0] = (cosine*scale_x) >> 14;
+    matrix[1] = -((sine*scale_x) >> 14);
+    matrix[2] = (sine*scale_y) >> 14;
+    matrix[3] = (cosine*scale_y) >> 14;
+}
+
+/**
+ * BgAffineSet: r2 entries of 20 bytes at r0 (s32 center x and y in the texture, 8.8 fixed point; s16 x
+ * and y of that center on the screen; s16 x and y scale; u16 angle) into r2 entries of 16 bytes at r1
+ * (the pa, pb, pc, pd halfwords and the x, y words of the background reference point).
+ */
+static bool
+bios_bg_affine_set(CPU *cpu, GBAMemory *gba_memory, BlockCache *cache)
+{
+    s32 count = (s32)cpu->r2;
+    if (count <= 0) {
+        cpu->cycles += BIOS_CYCLES_AFFINE_SET;
+        return true;
+    }
+
+    if ((cpu->r0 | cpu->r1) & 3) return false;
+    if ((u32)count > 0x1000000 / 20) return false;
+
+    u8 *source = get_bios_transfer_memory(gba_memory, cpu->r0, (u32)count*20, false);
+    u8 *destination = get_bios_transfer_memory(gba_memory, cpu->r1, (u32)count*16, true);
+    if (!source || !destination) return false;
+
+    s32 matrix[4] = {0};
+    for (s32 i = 0; i < count; ++i) {
+        u8 *entry = source + i*20;
+        u8 *result = destination + i*16;
+
+        bios_affine_matrix(*(s16 *)(entry + 12), *(s16 *)(entry + 14), *(u16 *)(entry + 16), matrix);
+
+        u32 texture_x = *(u32 *)(entry + 0);
+        u32 texture_y = *(u32 *)(entry + 4);
+        u32 screen_x = (u32)*(s16 *)(entry + 8);
+        u32 screen_y = (u32)*(s16 *)(entry + 10);
+
+        // Reference point: where the texture is at the top left corner of the screen.
+        // NOTE: The products are done as u32 to wrap like the ARM multiplications do.
+        *(u32 *)(result + 8) = texture_x - (u32)matrix[0]*screen_x - (u32)matrix[1]*screen_y;
+        *(u32 *)(result + 12) = texture_y - (u32)matrix[2]*screen_x - (u32)matrix[3]*screen_y;
+        for (int j = 0; j < 4; ++j) *(s16 *)(result + j*2) = (s16)matrix[j];
+    }
+
+    invalidate_cached_code_range(cache, gba_memory, destination, (u32)count*16);
+
+    // The BIOS leaves pa of the last entry in r3.
+    cpu->r0 += (u32)count*20;
+    cpu->r1 += (u32)count*16;
+    cpu->r3 = (u32)matrix[0];
+    cpu->cycles += BIOS_CYCLES_AFFINE_SET + (u32)count*BIOS_CYCLES_BG_AFFINE_SET_ENTRY;
+
+    return true;
+}
+
+/**
+ * ObjAffineSet: r2 entries of 8 bytes at r0 (s16 x and y scale, u16 angle, padding) into the pa, pb, pc,
+ * pd halfwords at r1, r3 bytes apart (2 for a plain array, 8 to write in the OAM).
+ */
+static bool
+bios_obj_affine_set(CPU *cpu, GBAMemory *gba_memory, BlockCache *cache)
+{
+    s32 count = (s32)cpu->r2;
+    if (count <= 0) {
+        cpu->cycles += BIOS_CYCLES_AFFINE_SET;
+        return true;
+    }
+
+    u32 stride = cpu->r3;
+    if ((cpu->r0 & 3) || (cpu->r1 & 1) || (stride & 1) || stride == 0) return false;
+    if ((u64)count*4*stride > 0x1000000) return false;
+
+    u32 size = ((u32)count*4 - 1)*stride + 2;
+    u8 *source = get_bios_transfer_memory(gba_memory, cpu->r0, (u32)count*8, false);
+    u8 *destination = get_bios_transfer_memory(gba_memory, cpu->r1, size, true);
+    if (!source || !destination) return false;
+
+    for (s32 i = 0; i < count; ++i) {
+        u8 *entry = source + i*8;
+
+        s32 matrix[4];
+        bios_affine_matrix(*(s16 *)(entry + 0), *(s16 *)(entry + 2), *(u16 *)(entry + 4), matrix);
+
+        for (u32 j = 0; j < 4; ++j) {
+            *(s16 *)(destination + ((u32)i*4 + j)*stride) = (s16)matrix[j];
+        }
+    }
+
+    invalidate_cached_code_range(cache, gba_memory, destination, size);
+
+    cpu->r0 += (u32)count*8;
+    cpu->r1 += (u32)count*4*stride;
+    cpu->cycles += BIOS_CYCLES_AFFINE_SET + (u32)count*BIOS_CYCLES_OBJ_AFFINE_SET_ENTRY;
+
+    return true;
+}
+
+//
+// Decompression
+//
+// The data starts with a header word: the compression type in the low byte and the decompressed size
+// above. The source and the destination are followed as guest addresses inside their memory regions,
+// so the registers can be left as the BIOS leaves them. The VRAM versions only write whole halfwords,
+// like the BIOS routines do (VRAM ignores byte writes).
+//
+
+// Approximate cycles per byte written of each decompression routine, on top of BIOS_CYCLES_UNCOMP.
+static const u8 bios_uncomp_cycles_per_byte[] = {
+    [BIOS_LZ77_UNCOMP_WRAM]         = 12,
+    [BIOS_LZ77_UNCOMP_VRAM]         = 25,
+    [BIOS_HUFF_UNCOMP]              = 100,
+    [BIOS_RL_UNCOMP_WRAM]           = 9,
+    [BIOS_RL_UNCOMP_VRAM]           = 17,
+    [BIOS_DIFF_8BIT_UNFILTER_WRAM]  = 13,
+    [BIOS_DIFF_8BIT_UNFILTER_VRAM]  = 20,
+    [BIOS_DIFF_16BIT_UNFILTER]      = 7,
+};
+
+typedef struct BiosDecompression {
+    u32 source;             // Address of the next byte to read
+    u32 destination;        // Address of the next byte (or halfword) to write
+    BiosMemoryRegion source_region;
+    BiosMemoryRegion destination_region;
+
+    bool halfwords;         // Write whole halfwords only
+    u32 halfword;           // Bytes not written yet
+    u32 halfword_shift;
+
+    bool failed;            // Went outside the regions, the BIOS routine must do it instead
+} BiosDecompression;
+
+static u8
+bios_read_source_at(BiosDecompression *decompression, u32 address)
+{
+    BiosMemoryRegion *region = &decompression->source_region;
+    if (address - region->address >= region->size) {
+        decompression->failed = true;
+        return 0;
+    }
+
+    return region->memory[address - region->address];
+}
+
+static u8
+bios_read_source(BiosDecompression *decompression)
+{
+    return bios_read_source_at(decompression, decompression->source++);
+}
+
+/**
+ * Reads back a byte already decompressed, distance bytes behind the next one. In the VRAM versions a
+ * byte that is still waiting for the other half of its halfword is read from memory, stale, as the BIOS
+ * does.
+ */
+static u8
+bios_read_destination(BiosDecompression *decompression, u32 distance)
+{
+    u32 address = decompression->destination + (decompression->halfword_shift >> 3) - distance;
+
+    BiosMemoryRegion *region = &decompression->destination_region;
+    if (address - region->address >= region->size) {
+        decompression->failed = true;
+        return 0;
+    }
+
+    return region->memory[address - region->address];
+}
+
+static void
+bios_write_destination(BiosDecompression *decompression, u8 value)
+{
+    if (decompression->halfwords) {
+        decompression->halfword |= (u32)value << decompression->halfword_shift;
+        decompression->halfword_shift ^= 8;
+        if (decompression->halfword_shift) return;
+    }
+
+    u32 size = decompression->halfwords ? 2 : 1;
+    BiosMemoryRegion *region = &decompression->destination_region;
+    u32 offset = decompression->destination - region->address;
+    if (offset >= region->size || size > region->size - offset) {
+        decompression->failed = true;
+        return;
+    }
+
+    if (decompression->halfwords) {
+        *(u16 *)(region->memory + offset) = (u16)decompression->halfword;
+        decompression->halfword = 0;
+    } else {
+        region->memory[offset] = value;
+    }
+    decompression->destination += size;
+}
+
+/**
+ * Blocks of 8 flagged as literal bytes (0) or back references (1) of 3-18 bytes from up to 4096 bytes
+ * behind. A back reference is copied whole, even past the decompressed size. Returns what the BIOS
+ * leaves in r3: 0 after a back reference, or the bytes not written in the VRAM version.
+ */
+static u32
+bios_lz77_uncomp(BiosDecompression *decompression, s32 size, u32 r3)
+{
+    while (size > 0 && !decompression->failed) {
+        u32 flags = bios_read_source(decompression);
+        for (int block = 0; block < 8 && size > 0; ++block, flags <<= 1) {
+            if (!(flags & 0x80)) {
+                bios_write_destination(decompression, bios_read_source(decompression));
+                size--;
+                continue;
+            }
+
+            u8 first = bios_read_source(decompression);
+            u8 second = bios_read_source(decompression);
+            s32 length = 3 + (first >> 4);
+            u32 distance = (((u32)(first & 0xF) << 8) | second) + 1;
+
+            size -= length;
+            for (s32 i = 0; i < length; ++i) {
+                bios_write_destination(decompression, bios_read_destination(decompression, distance));
+            }
+            r3 = 0;
+        }
+    }
+
+    return decompression->halfwords ? decompression->halfword : r3;
+}
+
+/**
+ * Blocks of 1-128 literal bytes or runs of 3-130 copies of a byte. A block is written whole, even past
+ * the decompressed size.
+ */
+static void
+bios_rl_uncomp(BiosDecompression *decompression, s32 size)
+{
+    while (size > 0 && !decompression->failed) {
+        u8 flag = bios_read_source(decompression);
+        if (flag & 0x80) {
+            s32 length = (flag & 0x7F) + 3;
+            u8 value = bios_read_source(decompression);
+
+            size -= length;
+            for (s32 i = 0; i < length; ++i) bios_write_destination(decompression, value);
+        } else {
+            s32 length = (flag & 0x7F) + 1;
+
+            size -= length;
+            for (s32 i = 0; i < length; ++i) {
+                bios_write_destination(decompression, bios_read_source(decompression));
+            }
+        }
+    }
+}
+
+/**
+ * Each byte is the difference from the previous one.
+ */
+static void
+bios_diff_8bit_unfilter(BiosDecompression *decompression, s32 size)
+{
+    u8 value = 0;
+    for (s32 i = 0; i < size && !decompression->failed; ++i) {
+        value = (u8)(value + bios_read_source(decompression));
+        bios_write_destination(decompression, value);
+    }
+}
+
+/**
+ * Each halfword is the difference from the previous one. Returns the last difference read after the
+ * first halfword, which the BIOS leaves in r3.
+ */
+static u32
+bios_diff_16bit_unfilter(BiosDecompression *decompression, s32 size, u32 r3)
+{
+    u16 value = 0;
+    for (s32 i = 0; i < size && !decompression->failed; i += 2) {
+        u16 difference = bios_read_source(decompression);
+        difference |= (u16)(bios_read_source(decompression) << 8);
+        if (i > 0) r3 = difference;
+
+        value = (u16)(value + difference);
+        bios_write_destination(decompression, (u8)value);
+        bios_write_destination(decompression, (u8)(value >> 8));
+    }
+
+    return r3;
+}
+
+/**
+ * Data of bits_per_value bits, encoded with the tree that follows the header (its size in halfwords
+ * minus one, then the nodes). Each node holds the offset of its pair of children and, in bits 7 and 6,
+ * whether the left or right child is a leaf with the value. The bit stream comes in words, from the most
+ * significant bit, and the values fill words from the least significant bits. Returns the last word,
+ * which the BIOS leaves in r3.
+ */
+static u32
+bios_huff_uncomp(BiosDecompression *decompression, s32 size, u32 bits_per_value)
+{
+    u32 tree = decompression->source;
+    u32 root = tree + 1;
+    u32 values_per_word = (bits_per_value & 7) + 4;
+
+    decompression->source = tree + ((u32)bios_read_source_at(decompression, tree) + 1)*2;
+
+    u32 node = root;
+    u32 word = 0;
+    u32 value_count = 0;
+    while (size > 0 && !decompression->failed) {
+        // NOTE: The bit stream is only halfword aligned if the tree size is even. Like any unaligned word
+        // load, the aligned word is read and rotated.
+        u32 aligned = decompression->source & ~3u;
+        u32 bits = bios_read_source_at(decompression, aligned);
+        bits |= (u32)bios_read_source_at(decompression, aligned + 1) << 8;
+        bits |= (u32)bios_read_source_at(decompression, aligned + 2) << 16;
+        bits |= (u32)bios_read_source_at(decompression, aligned + 3) << 24;
+        bits = rotate_right(bits, 8*(decompression->source & 3), 32);
+        decompression->source += 4;
+
+        for (int bit_index = 0; bit_index < 32 && size > 0; ++bit_index, bits <<= 1) {
+            u32 bit = bits >> 31;
+            u8 node_value = bios_read_source_at(decompression, node);
+            bool leaf = ((node_value << bit) & 0x80) != 0;
+
+            node = (node & ~1u) + ((u32)(node_value & 0x3F) + 1)*2 + bit;
+            if (!leaf) continue;
+
+            word = (word >> bits_per_value) | ((u32)bios_read_source_at(decompression, node) << (32 - bits_per_value));
+            node = root;
+
+            if (++value_count == values_per_word) {
+                for (int i = 0; i < 4; ++i) bios_write_destination(decompression, (u8)(word >> (8*i)));
+
+                size -= 4;
+                value_count = 0;
+            }
+        }
+    }
+
+    return word;
+}
+
+/**
+ * Runs one of the decompression functions. Returns false if it must run in the BIOS ROM, in which case
+ * anything written is written again the same way by the BIOS routine.
+ */
+static bool
+bios_uncomp(CPU *cpu, GBAMemory *gba_memory, BlockCache *cache, u8 function)
+{
+    BiosDecompression decompression = {0};
+    decompression.source = cpu->r0;
+    decompression.destination = cpu->r1;
+    decompression.halfwords = (function == BIOS_LZ77_UNCOMP_VRAM ||
+                               function == BIOS_RL_UNCOMP_VRAM ||
+                               function == BIOS_DIFF_8BIT_UNFILTER_VRAM ||
+                               function == BIOS_DIFF_16BIT_UNFILTER);
+
+    if (cpu->r0 & 3) return false;
+    if (!get_bios_memory_region(gba_memory, cpu->r0, false, &decompression.source_region)) return false;
+    if (!get_bios_memory_region(gba_memory, cpu->r1, true, &decompression.destination_region)) return false;
+
+    u32 header = bios_read_source(&decompression);
+    header |= (u32)bios_read_source(&decompression) << 8;
+    header |= (u32)bios_read_source(&decompression) << 16;
+    header |= (u32)bios_read_source(&decompression) << 24;
+    if (decompression.failed) return false;
+
+    s32 size = (s32)(header >> 8);
+    u32 bits_per_value = header & 0xF;
+    if (function == BIOS_HUFF_UNCOMP && bits_per_value != 4 && bits_per_value != 8) return false;
+
+    // What each routine leaves in r3 (the thumb ones return through it).
+    u32 r3 = 0x170;
+    if (function == BIOS_LZ77_UNCOMP_WRAM) r3 = cpu->r3;
+    if (function == BIOS_LZ77_UNCOMP_VRAM) r3 = 0;
+    if (function == BIOS_DIFF_16BIT_UNFILTER) r3 = 0xBA4;
+
+    // NOTE: The BIOS does nothing if the size is 0 or the data is in the BIOS region. Huffman only
+    // checks the start of the data.
+    bool valid = (cpu->r0 & 0x0E000000) != 0;
+    if (function != BIOS_HUFF_UNCOMP) {
+        valid = valid && size != 0 && ((cpu->r0 + 4) & 0x0E000000) && ((cpu->r0 + 4 + (u32)size) & 0x0E000000);
+    } else {
+        decompression.source = cpu->r0 + 4;
+    }
+
+    if (valid) {
+        switch (function) {
+            case BIOS_LZ77_UNCOMP_WRAM:
+            case BIOS_LZ77_UNCOMP_VRAM: {
+                r3 = bios_lz77_uncomp(&decompression, size, r3);
+            } break;
+            case BIOS_HUFF_UNCOMP: {
+                r3 = bios_huff_uncomp(&decompression, size, bits_per_value);
+            } break;
+            case BIOS_RL_UNCOMP_WRAM:
+            case BIOS_RL_UNCOMP_VRAM: {
+                bios_rl_uncomp(&decompression, size);
+            } break;
+            case BIOS_DIFF_8BIT_UNFILTER_WRAM:
+            case BIOS_DIFF_8BIT_UNFILTER_VRAM: {
+                bios_diff_8bit_unfilter(&decompression, size);
+            } break;
+            case BIOS_DIFF_16BIT_UNFILTER: {
+                r3 = bios_diff_16bit_unfilter(&decompression, size, r3);
+            } break;
+        }
+    }
+    if (decompression.failed) return false;
+
+    u32 written = decompression.destination - cpu->r1;
+    invalidate_cached_code_range(cache, gba_memory, get_bios_transfer_memory(gba_memory, cpu->r1, 0, true), written);
+
+    cpu->r0 = decompression.source;
+    cpu->r1 = decompression.destination;
+    cpu->r3 = r3;
+    cpu->cycles += BIOS_CYCLES_UNCOMP + written*bios_uncomp_cycles_per_byte[function];
+
+    return true;
+}
+
+/**
+ * Services the BIOS function natively. Returns false if it must run in the BIOS ROM instead.
+ */
+static bool
+hle_bios_call(CPU *cpu, GBAMemory *gba_memory, BlockCache *cache, u8 function)
+{
+    switch (function) {
+        case BIOS_HALT: {
+            bios_halt(cpu);
+        } break;
+        case BIOS_INTR_WAIT:
+        case BIOS_VBLANK_INTR_WAIT: {
+            // NOTE: The interrupt handler of the game has to run between the halts of the wait, and the
+            // routine sets IME, so IntrWait always runs in the BIOS ROM.
+            return false;
+        }
+        case BIOS_DIV: {
+            if (cpu->r1 == 0) return false;
+            bios_div(cpu, (s32)cpu->r0, (s32)cpu->r1);
+        } break;
+        case BIOS_DIV_ARM: {
+            if (cpu->r0 == 0) return false;
+            bios_div(cpu, (s32)cpu->r1, (s32)cpu->r0);
+        } break;
+        case BIOS_SQRT: {
+            bios_sqrt(cpu);
+        } break;
+        case BIOS_ARC_TAN: {
+            cpu->r0 = (u32)bios_arc_tan((s32)cpu->r0, &cpu->r1, &cpu->r3);
+            cpu->cycles += BIOS_CYCLES_ARC_TAN;
+        } break;
+        case BIOS_ARC_TAN2: {
+            cpu->r0 = bios_arc_tan2((s32)cpu->r0, (s32)cpu->r1, &cpu->r1);
+            cpu->r3 = 0x170; // Return address in the BIOS software interrupt handler
+            cpu->cycles += BIOS_CYCLES_ARC_TAN2;
+        } break;
+        case BIOS_CPU_SET: {
+            return bios_cpu_set(cpu, gba_memory, cache);
+        }
+        case BIOS_CPU_FAST_SET: {
+            return bios_cpu_fast_set(cpu, gba_memory, cache);
+        }
+        case BIOS_BG_AFFINE_SET: {
+            return bios_bg_affine_set(cpu, gba_memory, cache);
+        }
+        case BIOS_OBJ_AFFINE_SET: {
+            return bios_obj_affine_set(cpu, gba_memory, cache);
+        }
+        case BIOS_LZ77_UNCOMP_WRAM:
+        case BIOS_LZ77_UNCOMP_VRAM:
+        case BIOS_HUFF_UNCOMP:
+        case BIOS_RL_UNCOMP_WRAM:
+        case BIOS_RL_UNCOMP_VRAM:
+        case BIOS_DIFF_8BIT_UNFILTER_WRAM:
+        case BIOS_DIFF_8BIT_UNFILTER_VRAM:
+        case BIOS_DIFF_16BIT_UNFILTER: {
+            return bios_uncomp(cpu, gba_memory, cache, function);
+        }
+        default: {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+#endif // BIOS_H
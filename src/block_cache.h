@@ -0,0 +1,212 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+//
+// Basic block cache
+//
+// Sequences of already decoded instructions, keyed by the address of the first instruction and the CPU
+// state (ARM/Thumb). A block ends at the first instruction that can change the PC or the CPU state.
+//
+// Code can only be rewritten in EWRAM and IWRAM, so those regions are split in pages, each with the list
+// of the blocks that cover it. A write only walks the list of its page, and invalidates the blocks whose
+// instructions it overlaps (data written next to the code of a block leaves it alone).
+//
+#define BLOCK_CACHE_SIZE            (1024)      /* Number of blocks, direct mapped by address */
+#define BLOCK_MAX_INSTRUCTIONS      (32)
+#define BLOCK_CACHE_PAGE_SHIFT      (8)         /* 256 bytes pages */
+#define BLOCK_CACHE_EWRAM_PAGES     ((256*KILOBYTE) >> BLOCK_CACHE_PAGE_SHIFT)
+#define BLOCK_CACHE_IWRAM_PAGES     ((32*KILOBYTE) >> BLOCK_CACHE_PAGE_SHIFT)
+#define BLOCK_CACHE_PAGE_COUNT      (BLOCK_CACHE_EWRAM_PAGES + BLOCK_CACHE_IWRAM_PAGES)
+#define BLOCK_CACHE_NO_PAGE         (-1)
+#define BLOCK_CACHE_NO_LINK         (0)         /* Links are block index + 1, so a zeroed cache is empty */
+
+typedef struct BasicBlock {
+    u32 address;            // Address of the first instruction
+    u32 end_address;        // Address of the last instruction
+    u8 thumb;
+    u8 valid;               // Valid blocks of writable memory are linked in the lists of their pages
+    u16 instruction_count;
+    u8 idle_loop;           // Branches back to its start without writing memory (see run_idle_loop())
+    Instruction instructions[BLOCK_MAX_INSTRUCTIONS];
+
+    // Native code (see jit_x64.h)
+    u32 execution_count;
+    void *native_code;              // Translation of the first native_instruction_count instructions
+    u16 native_instruction_count;
+    u8 native_tried;
+    u32 native_cycles;
+
+    // Next block in the list of the first and of the last page of the block (a block is shorter than
+    // a page, so it covers at most two).
+    u16 next_in_page[2];
+} BasicBlock;
+
+typedef struct BlockCache {
+    BasicBlock blocks[BLOCK_CACHE_SIZE];
+    u16 page_blocks[BLOCK_CACHE_PAGE_COUNT]; // First block of the list of each page
+} BlockCache;
+
+
+/**
+ * Returns the page of the writable memory holding the address, or BLOCK_CACHE_NO_PAGE if code on that
+ * address can not be modified.
+ */
+static int
+get_code_page(u32 address)
+{
+    u32 region = address >> 24;
+    if (region == 0x02) return (int)((address & 0x3FFFF) >> BLOCK_CACHE_PAGE_SHIFT);
+    if (region == 0x03) return (int)(BLOCK_CACHE_EWRAM_PAGES + ((address & 0x7FFF) >> BLOCK_CACHE_PAGE_SHIFT));
+
+    return BLOCK_CACHE_NO_PAGE;
+}
+
+/**
+ * Only code from memory that is accessed linearly (BIOS, work RAMs and the Game Pak ROM) is cached.
+ */
+static bool
+is_cacheable_code_address(u32 address)
+{
+    if (address <= 0x00003FFF) return true;
+    if (address >= 0x02000000 && address <= 0x0203FFFF) return true;
+    if (address >= 0x03000000 && address <= 0x03007FFF) return true;
+    if (address >= 0x08000000 && address <= 0x0DFFFFFF) return true;
+
+    return false;
+}
+
+static BasicBlock *
+get_block_slot(BlockCache *cache, u32 address)
+{
+    return cache->blocks + ((address >> 1) & (BLOCK_CACHE_SIZE - 1));
+}
+
+static BasicBlock *
+find_cached_block(BlockCache *cache, u32 address, u8 thumb)
+{
+    BasicBlock *block = get_block_slot(cache, address);
+    if (block->valid && block->address == address && block->thumb == thumb) {
+        return block;
+    }
+
+    return 0;
+}
+
+static u16
+get_block_link(BlockCache *cache, BasicBlock *block)
+{
+    return (u16)(block - cache->blocks + 1);
+}
+
+/**
+ * The link of the block in the list of the page: the first or the last page of the block.
+ */
+static u16 *
+get_next_in_page(BasicBlock *block, int page)
+{
+    return block->next_in_page + (page == get_code_page(block->address) ? 0 : 1);
+}
+
+/**
+ * Adds a block that was just built to the lists of the pages it covers.
+ */
+static void
+link_block_code_pages(BlockCache *cache, BasicBlock *block)
+{
+    int first_page = get_code_page(block->address);
+    if (first_page == BLOCK_CACHE_NO_PAGE) return;
+
+    int last_page = get_code_page(block->end_address);
+    for (int page = first_page; page <= last_page; ++page) {
+        *get_next_in_page(block, page) = cache->page_blocks[page];
+        cache->page_blocks[page] = get_block_link(cache, block);
+    }
+}
+
+static void
+unlink_block_code_pages(BlockCache *cache, BasicBlock *block)
+{
+    int first_page = get_code_page(block->address);
+    if (first_page == BLOCK_CACHE_NO_PAGE) return;
+
+    u16 link = get_block_link(cache, block);
+    int last_page = get_code_page(block->end_address);
+    for (int page = first_page; page <= last_page; ++page) {
+        u16 *at = cache->page_blocks + page;
+        while (*at != link && *at != BLOCK_CACHE_NO_LINK) {
+            at = get_next_in_page(cache->blocks + (*at - 1), page);
+        }
+        if (*at == link) *at = *get_next_in_page(block, page);
+    }
+}
+
+/**
+ * Must be called before the slot of a block is reused or its code is no longer valid.
+ */
+static void
+discard_cached_block(BlockCache *cache, BasicBlock *block)
+{
+    if (!block->valid) return;
+
+    unlink_block_code_pages(cache, block);
+    block->valid = false;
+}
+
+/**
+ * Invalidates the blocks of the page with instructions in [start, end) (addresses).
+ */
+static void
+invalidate_code_page_range(BlockCache *cache, int page, u32 start, u32 end)
+{
+    u16 link = cache->page_blocks[page];
+    while (link != BLOCK_CACHE_NO_LINK) {
+        BasicBlock *block = cache->blocks + (link - 1);
+        link = *get_next_in_page(block, page);
+
+        u32 block_end = block->end_address + (block->thumb ? 2 : 4);
+        if (start < block_end && block->address < end) {
+            discard_cached_block(cache, block);
+        }
+    }
+}
+
+/**
+ * Must be called after every write of size bytes to memory (with the address that was written), so
+ * blocks built from that memory are decoded again.
+ */
+static void
+invalidate_cached_code_at(BlockCache *cache, u32 address, u32 size)
+{
+    int first_page = get_code_page(address);
+    if (first_page == BLOCK_CACHE_NO_PAGE) return;
+
+    // NOTE: Blocks are only built from the first copy of the work RAMs, so writes to the mirrors are
+    // compared with the address they alias.
+    address = (address >> 24 == 0x02) ? 0x02000000 | (address & 0x3FFFF) : 0x03000000 | (address & 0x7FFF);
+
+    int last_page = get_code_page(address + size - 1);
+    for (int page = first_page; page <= last_page; ++page) {
+        if (cache->page_blocks[page] == BLOCK_CACHE_NO_LINK) continue;
+
+        invalidate_code_page_range(cache, page, address, address + size);
+    }
+}
+
+/**
+ * Same as invalidate_cached_code_at(), from the host memory that was written, for a write that stays in
+ * one memory region.
+ */
+static void
+invalidate_cached_code_range(BlockCache *cache, GBAMemory *gba_memory, void *written, u32 size)
+{
+    if (size == 0) return;
+
+    u8 *at = (u8 *)written;
+    if (at >= gba_memory->ewram && at < gba_memory->ewram + sizeof(gba_memory->ewram)) {
+        invalidate_cached_code_at(cache, 0x02000000 + (u32)(at - gba_memory->ewram), size);
+    } else if (at >= gba_memory->iwram && at < gba_memory->iwram + sizeof(gba_memory->iwram)) {
+        invalidate_cached_code_at(cache, 0x03000000 + (u32)(at - gba_memory->iwram), size);
+    }
+}
+
+#endif // BLOCK_CACHE_H
@@ -14,7 +14,7 @@ typedef struct CPU {
             u32 r6;
             u32 r7;
             
-            // Banked registers
+            // Banked registers (always the ones of the current mode, see switch_register_bank())
             u32 r8;
             u32 r9;
             u32 r10;
@@ -38,6 +38,9 @@ typedef struct CPU {
         u32 r[16];
     };
 
+    // User and System registers r8-r14, while another mode is active
+    u32 r_usr[7]; // Get using r_usr[r_number - 8] to get the correct offset.
+
     // FIQ Banked registers
     union {
         struct {
@@ -98,9 +101,94 @@ typedef struct CPU {
     u32 spsr_abt;
     u32 spsr_und;
 
+    // Lazy condition flags: the last flag setting operation, its operands and result. The NZCV bits of
+    // cpsr are only valid after materialize_flags().
+    u8 flags_operation;
+    u8 flags_carry;
+    u32 flags_a;
+    u32 flags_b;
+    u32 flags_result;
+
+    // Halted until an interrupt enabled in IE is requested, see run_halted().
+    u8 halted;
+
+    // IRQ line: an interrupt enabled in IE is requested in IF, with IME set (see update_irq_line()). The
+    // IRQ is only taken while the I bit of the cpsr is clear, which irq_pending adds.
+    u8 irq_line;
+    u8 irq_pending;
+
     u64 cycles;
 } CPU;
 
+typedef enum FlagsOperation {
+    FLAGS_OPERATION_NONE,       // cpsr holds the flags
+    FLAGS_OPERATION_NZ,         // N, Z from the result
+    FLAGS_OPERATION_LOGICAL,    // N, Z from the result, C from the shifter carry
+    FLAGS_OPERATION_ADD,        // N, Z, C, V of result = a + b
+    FLAGS_OPERATION_SUB,        // N, Z, C, V of result = a - b
+    FLAGS_OPERATION_COUNT
+} FlagsOperation;
+
+// NZCV bits written by each operation.
+static const u32 flags_operation_mask[FLAGS_OPERATION_COUNT] = {
+    [FLAGS_OPERATION_NONE]      = 0,
+    [FLAGS_OPERATION_NZ]        = 0xC0000000,
+    [FLAGS_OPERATION_LOGICAL]   = 0xE0000000,
+    [FLAGS_OPERATION_ADD]       = 0xF0000000,
+    [FLAGS_OPERATION_SUB]       = 0xF0000000,
+};
+
+/**
+ * Writes the flags of the pending operation to the cpsr. Must be called before anything reads the
+ * condition flags from cpu->cpsr.
+ */
+static void
+materialize_flags(CPU *cpu)
+{
+    if (cpu->flags_operation == FLAGS_OPERATION_NONE) return;
+
+    u32 a = cpu->flags_a;
+    u32 b = cpu->flags_b;
+    u32 result = cpu->flags_result;
+
+    u32 flags = (result & 0x80000000) | ((u32)(result == 0) << 30);
+    switch (cpu->flags_operation) {
+        case FLAGS_OPERATION_LOGICAL: {
+            flags |= (u32)cpu->flags_carry << 29;
+        } break;
+        case FLAGS_OPERATION_ADD: {
+            flags |= (u32)(result < b) << 29;
+            flags |= (((a ^ result) & (b ^ result)) >> 31) << 28;
+        } break;
+        case FLAGS_OPERATION_SUB: {
+            flags |= (u32)(b <= a) << 29;
+            flags |= (((a ^ b) & (a ^ result)) >> 31) << 28;
+        } break;
+    }
+
+    u32 mask = flags_operation_mask[cpu->flags_operation];
+    cpu->cpsr = (cpu->cpsr & ~mask) | (flags & mask);
+    cpu->flags_operation = FLAGS_OPERATION_NONE;
+}
+
+/**
+ * Records a flag setting operation instead of computing its flags. The pending one is only written
+ * first if it sets flags the new operation leaves untouched.
+ */
+static void
+set_flags_lazy(CPU *cpu, FlagsOperation operation, u32 a, u32 b, u32 result, u8 carry)
+{
+    if (flags_operation_mask[cpu->flags_operation] & ~flags_operation_mask[operation]) {
+        materialize_flags(cpu);
+    }
+
+    cpu->flags_operation = (u8)operation;
+    cpu->flags_carry = carry;
+    cpu->flags_a = a;
+    cpu->flags_b = b;
+    cpu->flags_result = result;
+}
+
 
 #define MODE_USER       (0b10000)
 #define MODE_FIQ        (0b10001)
@@ -123,6 +211,8 @@ char *psr_mode[] = {
 void
 print_cpu_state(CPU *cpu)
 {
+    materialize_flags(cpu);
+
     printf("----------------\n");
     printf("Registers:\n");
     for (int i = 0; i < 16; i++) {
@@ -216,57 +306,75 @@ get_spsr_current_mode(CPU *cpu)
     return 0;
 }
 
-u32 *
-get_register(CPU *cpu, u8 rn)
+/**
+ * Where r13 and r14 of the mode are kept while the mode is not active.
+ */
+static u32 *
+get_banked_sp_lr(CPU *cpu, u8 mode)
 {
-    u8 mode = (cpu->cpsr & 0b11111);
     switch (mode) {
         case MODE_USER:
-        case MODE_SYSTEM:
-        {
-            return cpu->r + rn;
-        } break;
-        case MODE_FIQ: {
-            if (rn <= 7 || rn == 15) {
-                return cpu->r + rn;
-            }
-
-            return cpu->r_fiq + (rn - 8);
-        } break;
-        case MODE_SUPERVISOR: {
-            if (rn <= 12 || rn == 15) {
-                return cpu->r + rn;
-            }
-
-            return cpu->r_svc + (rn - 13);
-        } break;
-        case MODE_ABORT: {
-            if (rn <= 12 || rn == 15) {
-                return cpu->r + rn;
-            }
-
-            return cpu->r_abt + (rn - 13);
-        } break;
-        case MODE_IRQ: {
-            if (rn <= 12 || rn == 15) {
-                return cpu->r + rn;
-            }
+        case MODE_SYSTEM:       return cpu->r_usr + (13 - 8);
+        case MODE_SUPERVISOR:   return cpu->r_svc;
+        case MODE_ABORT:        return cpu->r_abt;
+        case MODE_IRQ:          return cpu->r_irq;
+        case MODE_UNDEFINED:    return cpu->r_und;
+        default: assert(!"Invalid mode");
+    }
 
-            return cpu->r_irq + (rn - 13);
-        } break;
-        case MODE_UNDEFINED: {
-            if (rn <= 12 || rn == 15) {
-                return cpu->r + rn;
-            }
+    return cpu->r_usr + (13 - 8);
+}
 
-            return cpu->r_und + (rn - 13);
-        } break;
+/**
+ * The registers of the current mode always live in cpu->r, so the banked registers are swapped only when
+ * the mode changes: the ones of the mode being left are saved and the ones of the new mode loaded.
+ */
+void
+switch_register_bank(CPU *cpu, u8 old_mode, u8 new_mode)
+{
+    if (old_mode == new_mode) return;
+
+    // User and System modes share all the registers.
+    u8 old_is_user = (old_mode == MODE_USER || old_mode == MODE_SYSTEM);
+    u8 new_is_user = (new_mode == MODE_USER || new_mode == MODE_SYSTEM);
+    if (old_is_user && new_is_user) return;
+
+    if (old_mode == MODE_FIQ) {
+        memcpy(cpu->r_fiq, cpu->r + 8, 7*sizeof(u32));
+    } else {
+        memcpy(cpu->r_usr, cpu->r + 8, 5*sizeof(u32));
+        memcpy(get_banked_sp_lr(cpu, old_mode), cpu->r + 13, 2*sizeof(u32));
+    }
 
-        default: assert(!"Invalid mode");
+    if (new_mode == MODE_FIQ) {
+        memcpy(cpu->r + 8, cpu->r_fiq, 7*sizeof(u32));
+    } else {
+        memcpy(cpu->r + 8, cpu->r_usr, 5*sizeof(u32));
+        memcpy(cpu->r + 13, get_banked_sp_lr(cpu, new_mode), 2*sizeof(u32));
     }
+}
 
-    assert(!"Invalid register number");
-    return 0;
+/**
+ * Must be called whenever the IRQ line or the I bit of the cpsr change, so the run loop only has to test
+ * irq_pending between instructions.
+ */
+static void
+update_irq_pending(CPU *cpu)
+{
+    cpu->irq_pending = cpu->irq_line && !((cpu->cpsr >> 7) & 1);
+}
+
+/**
+ * Every write to the CPSR that can change the mode or the I bit must go through here. The value replaces
+ * any pending lazy flags, so callers that build it from cpu->cpsr must materialize_flags() first.
+ */
+void
+set_cpsr(CPU *cpu, u32 value)
+{
+    cpu->flags_operation = FLAGS_OPERATION_NONE;
+    switch_register_bank(cpu, (u8)(cpu->cpsr & 0b11111), (u8)(value & 0b11111));
+    cpu->cpsr = value;
+    update_irq_pending(cpu);
 }
 
 #endif // CPU_H
\ No newline at end of file
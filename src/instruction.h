@@ -50,6 +50,21 @@ typedef enum ShiftType {
     SHIFT_TYPE_ROTATE_RIGHT     = 0b11,
 } ShiftType;
 
+// Forms of the second operand of the data processing instructions (see shift_operand_*() in main.c).
+typedef enum ShifterForm {
+    SHIFTER_FORM_IMMEDIATE,         // 8-bit immediate rotated right
+    SHIFTER_FORM_LSL_IMMEDIATE,     // Register shifted by a 5-bit immediate, in ShiftType order
+    SHIFTER_FORM_LSR_IMMEDIATE,
+    SHIFTER_FORM_ASR_IMMEDIATE,
+    SHIFTER_FORM_ROR_IMMEDIATE,
+    SHIFTER_FORM_LSL_REGISTER,      // Register shifted by a register, in ShiftType order
+    SHIFTER_FORM_LSR_REGISTER,
+    SHIFTER_FORM_ASR_REGISTER,
+    SHIFTER_FORM_ROR_REGISTER,
+
+    SHIFTER_FORM_COUNT,
+} ShifterForm;
+
 typedef enum ThumbShiftType {
     THUMB_SHIFT_TYPE_LOGICAL_LEFT       = 0,
     THUMB_SHIFT_TYPE_LOGICAL_RIGHT      = 1,
@@ -172,6 +187,8 @@ typedef enum InstructionType {
     INSTRUCTION_SOFTWARE_INTERRUPT,
     INSTRUCTION_UNCONDITIONAL_BRANCH,
     INSTRUCTION_LONG_BRANCH_WITH_LINK,
+
+    INSTRUCTION_TYPE_COUNT,
 } InstructionType;
 
 char *
@@ -241,6 +258,8 @@ get_instruction_type_string(InstructionType type)
         case INSTRUCTION_SOFTWARE_INTERRUPT: return "INSTRUCTION_SOFTWARE_INTERRUPT";
         case INSTRUCTION_UNCONDITIONAL_BRANCH: return "INSTRUCTION_UNCONDITIONAL_BRANCH";
         case INSTRUCTION_LONG_BRANCH_WITH_LINK: return "INSTRUCTION_LONG_BRANCH_WITH_LINK";
+
+        case INSTRUCTION_TYPE_COUNT: break;
     }
 
     return "UNKNOWN";
@@ -344,6 +363,8 @@ InstructionCategory instruction_categories[] = {
     [INSTRUCTION_MRC] = INSTRUCTION_CATEGORY_COPROCESSOR_REGISTER_TRANSFERS,
 };
 
+typedef void (*DataProcessingHandler)(void);
+
 typedef struct Instruction {
     InstructionType type;
     Condition condition;
@@ -378,6 +399,8 @@ typedef struct Instruction {
     u8 op;
     u32 mask;
 
+    DataProcessingHandler data_processing_handler; // Variant for the opcode, operand form and S bit
+
     u32 address;
     u32 encoding;
 } Instruction;
@@ -386,10 +409,12 @@ typedef struct Instruction {
 void fetch();
 void decode();
 void execute();
+void init_arm_decode_table();
 
 void thumb_fetch();
 void thumb_decode();
 void thumb_execute();
+void init_thumb_decode_table();
 
 
 
@@ -0,0 +1,927 @@
+#ifndef JIT_X64_H
+#define JIT_X64_H
+
+//
+// x86-64 dynamic recompiler
+//
+// Translates the leading run of supported instructions of a hot basic block into host code. Only
+// register-to-register ALU instructions are translated (no memory accesses, no branches), so the rest
+// of the block keeps running in the interpreter, which is the reference implementation.
+//
+// Guest registers live in host registers for the whole translated run:
+//   rdi        CPU *
+//   r8d        CPSR
+//   rbx, rbp, r9-r15   guest registers
+//   rax, rcx, rdx, rsi scratch
+//
+#if defined(__x86_64__) || defined(_M_X64)
+#define JIT_AVAILABLE 1
+#else
+#define JIT_AVAILABLE 0
+#endif
+
+#define JIT_CODE_BUFFER_SIZE        (4*MEGABYTE)
+#define JIT_MAX_BLOCK_CODE_SIZE     (4*KILOBYTE)    /* Worst case size of a translated block */
+#define JIT_HOT_BLOCK_THRESHOLD     (16)            /* Executions of a block before translating it */
+#define JIT_MAX_GUEST_REGISTERS     (9)
+
+typedef void (*JitBlockFunction)(CPU *cpu);
+
+typedef struct JitCodeBuffer {
+    u8 *memory;
+    u32 used;
+} JitCodeBuffer;
+
+// Host registers
+#define X64_RAX     (0)
+#define X64_RCX     (1)
+#define X64_RDX     (2)
+#define X64_RBX     (3)
+#define X64_RSP     (4)
+#define X64_RBP     (5)
+#define X64_RSI     (6)
+#define X64_RDI     (7)
+#define X64_R8      (8)
+#define X64_R9      (9)
+#define X64_R10     (10)
+#define X64_R11     (11)
+#define X64_R12     (12)
+#define X64_R13     (13)
+#define X64_R14     (14)
+#define X64_R15     (15)
+
+#define X64_CPU_REGISTER    X64_RDI
+#define X64_CPSR_REGISTER   X64_R8
+
+// Condition codes for SETcc
+#define X64_CONDITION_O     (0x0)
+#define X64_CONDITION_B     (0x2)   /* Carry set */
+#define X64_CONDITION_AE    (0x3)   /* Carry clear */
+#define X64_CONDITION_E     (0x4)
+#define X64_CONDITION_S     (0x8)
+
+// Opcodes of the "op r/m32, r32" forms and the /digit of the "op r/m32, imm32" forms.
+typedef enum X64AluOperation {
+    X64_ALU_ADD,
+    X64_ALU_OR,
+    X64_ALU_AND,
+    X64_ALU_SUB,
+    X64_ALU_XOR,
+    X64_ALU_CMP,
+} X64AluOperation;
+
+static u8 x64_alu_register_opcodes[] = {
+    [X64_ALU_ADD] = 0x01,
+    [X64_ALU_OR]  = 0x09,
+    [X64_ALU_AND] = 0x21,
+    [X64_ALU_SUB] = 0x29,
+    [X64_ALU_XOR] = 0x31,
+    [X64_ALU_CMP] = 0x39,
+};
+
+static u8 x64_alu_immediate_digits[] = {
+    [X64_ALU_ADD] = 0,
+    [X64_ALU_OR]  = 1,
+    [X64_ALU_AND] = 4,
+    [X64_ALU_SUB] = 5,
+    [X64_ALU_XOR] = 6,
+    [X64_ALU_CMP] = 7,
+};
+
+// Host registers available to hold guest registers.
+static u8 jit_guest_host_registers[JIT_MAX_GUEST_REGISTERS] = {
+    X64_RBX, X64_RBP, X64_R9, X64_R10, X64_R11, X64_R12, X64_R13, X64_R14, X64_R15,
+};
+
+
+//
+// Emitter
+//
+typedef struct X64Emitter {
+    u8 *code;
+    u32 size;
+} X64Emitter;
+
+static void
+emit_u8(X64Emitter *emitter, u8 value)
+{
+    emitter->code[emitter->size++] = value;
+}
+
+static void
+emit_u32(X64Emitter *emitter, u32 value)
+{
+    emit_u8(emitter, (u8)(value >> 0));
+    emit_u8(emitter, (u8)(value >> 8));
+    emit_u8(emitter, (u8)(value >> 16));
+    emit_u8(emitter, (u8)(value >> 24));
+}
+
+/**
+ * REX prefix for a 32-bit operation (W = 0). `force` is needed to address spl, bpl, sil and dil.
+ */
+static void
+emit_rex(X64Emitter *emitter, u8 w, u8 reg, u8 rm, u8 force)
+{
+    u8 rex = (u8)(0x40 | (w << 3) | (((reg >> 3) & 1) << 2) | ((rm >> 3) & 1));
+    if (rex != 0x40 || force) {
+        emit_u8(emitter, rex);
+    }
+}
+
+static void
+emit_modrm(X64Emitter *emitter, u8 mod, u8 reg, u8 rm)
+{
+    emit_u8(emitter, (u8)((mod << 6) | ((reg & 7) << 3) | (rm & 7)));
+}
+
+// push r64
+static void
+emit_push(X64Emitter *emitter, u8 reg)
+{
+    emit_rex(emitter, 0, 0, reg, false);
+    emit_u8(emitter, (u8)(0x50 + (reg & 7)));
+}
+
+// pop r64
+static void
+emit_pop(X64Emitter *emitter, u8 reg)
+{
+    emit_rex(emitter, 0, 0, reg, false);
+    emit_u8(emitter, (u8)(0x58 + (reg & 7)));
+}
+
+// mov r32, [rdi + offset]
+static void
+emit_load_cpu_field(X64Emitter *emitter, u8 reg, u32 offset)
+{
+    emit_rex(emitter, 0, reg, X64_CPU_REGISTER, false);
+    emit_u8(emitter, 0x8B);
+    emit_modrm(emitter, 0b10, reg, X64_CPU_REGISTER);
+    emit_u32(emitter, offset);
+}
+
+// mov [rdi + offset], r32
+static void
+emit_store_cpu_field(X64Emitter *emitter, u8 reg, u32 offset)
+{
+    emit_rex(emitter, 0, reg, X64_CPU_REGISTER, false);
+    emit_u8(emitter, 0x89);
+    emit_modrm(emitter, 0b10, reg, X64_CPU_REGISTER);
+    emit_u32(emitter, offset);
+}
+
+// add qword [rdi + offset], imm32
+static void
+emit_add_cpu_field_64(X64Emitter *emitter, u32 offset, u32 value)
+{
+    emit_rex(emitter, 1, 0, X64_CPU_REGISTER, false);
+    emit_u8(emitter, 0x81);
+    emit_modrm(emitter, 0b10, 0, X64_CPU_REGISTER);
+    emit_u32(emitter, offset);
+    emit_u32(emitter, value);
+}
+
+// mov dst32, src32
+static void
+emit_mov(X64Emitter *emitter, u8 dst, u8 src)
+{
+    emit_rex(emitter, 0, src, dst, false);
+    emit_u8(emitter, 0x89);
+    emit_modrm(emitter, 0b11, src, dst);
+}
+
+// mov dst32, imm32
+static void
+emit_mov_immediate(X64Emitter *emitter, u8 dst, u32 value)
+{
+    emit_rex(emitter, 0, 0, dst, false);
+    emit_u8(emitter, (u8)(0xB8 + (dst & 7)));
+    emit_u32(emitter, value);
+}
+
+// op dst32, src32
+static void
+emit_alu(X64Emitter *emitter, X64AluOperation operation, u8 dst, u8 src)
+{
+    emit_rex(emitter, 0, src, dst, false);
+    emit_u8(emitter, x64_alu_register_opcodes[operation]);
+    emit_modrm(emitter, 0b11, src, dst);
+}
+
+// op dst32, imm32
+static void
+emit_alu_immediate(X64Emitter *emitter, X64AluOperation operation, u8 dst, u32 value)
+{
+    emit_rex(emitter, 0, 0, dst, false);
+    emit_u8(emitter, 0x81);
+    emit_modrm(emitter, 0b11, x64_alu_immediate_digits[operation], dst);
+    emit_u32(emitter, value);
+}
+
+// test dst32, src32
+static void
+emit_test(X64Emitter *emitter, u8 dst, u8 src)
+{
+    emit_rex(emitter, 0, src, dst, false);
+    emit_u8(emitter, 0x85);
+    emit_modrm(emitter, 0b11, src, dst);
+}
+
+// not dst32
+static void
+emit_not(X64Emitter *emitter, u8 dst)
+{
+    emit_rex(emitter, 0, 0, dst, false);
+    emit_u8(emitter, 0xF7);
+    emit_modrm(emitter, 0b11, 2, dst);
+}
+
+// imul dst32, src32
+static void
+emit_imul(X64Emitter *emitter, u8 dst, u8 src)
+{
+    emit_rex(emitter, 0, dst, src, false);
+    emit_u8(emitter, 0x0F);
+    emit_u8(emitter, 0xAF);
+    emit_modrm(emitter, 0b11, dst, src);
+}
+
+// shl/shr/sar dst32, imm8
+static void
+emit_shift(X64Emitter *emitter, ShiftType shift_type, u8 dst, u8 shift)
+{
+    u8 digit = 0;
+    switch (shift_type) {
+        case SHIFT_TYPE_LOGICAL_LEFT:       digit = 4; break;
+        case SHIFT_TYPE_LOGICAL_RIGHT:      digit = 5; break;
+        case SHIFT_TYPE_ARITHMETIC_RIGHT:   digit = 7; break;
+        case SHIFT_TYPE_ROTATE_RIGHT:       digit = 1; break;
+    }
+
+    emit_rex(emitter, 0, 0, dst, false);
+    emit_u8(emitter, 0xC1);
+    emit_modrm(emitter, 0b11, digit, dst);
+    emit_u8(emitter, shift);
+}
+
+// setcc dst8
+static void
+emit_setcc(X64Emitter *emitter, u8 condition, u8 dst)
+{
+    emit_rex(emitter, 0, 0, dst, dst >= 4);
+    emit_u8(emitter, 0x0F);
+    emit_u8(emitter, (u8)(0x90 + condition));
+    emit_modrm(emitter, 0b11, 0, dst);
+}
+
+// movzx dst32, src8
+static void
+emit_movzx_8(X64Emitter *emitter, u8 dst, u8 src)
+{
+    emit_rex(emitter, 0, dst, src, src >= 4);
+    emit_u8(emitter, 0x0F);
+    emit_u8(emitter, 0xB6);
+    emit_modrm(emitter, 0b11, dst, src);
+}
+
+
+//
+// Translation
+//
+
+// How an operation updates the condition flags.
+typedef enum JitFlags {
+    JIT_FLAGS_NONE,
+    JIT_FLAGS_NZ,               // N and Z from the result, C and V unchanged
+    JIT_FLAGS_NZ_C,             // N and Z from the result, C from the shifter (in dl), V unchanged
+    JIT_FLAGS_NZ_C_SET,         // N and Z from the result, C set, V unchanged
+    JIT_FLAGS_NZ_C_CLEAR,       // N and Z from the result, C cleared, V unchanged
+    JIT_FLAGS_ADD,              // NZCV of an addition
+    JIT_FLAGS_SUB,              // NZCV of a subtraction (C is NOT borrow)
+} JitFlags;
+
+typedef enum JitOperation {
+    JIT_OPERATION_AND,
+    JIT_OPERATION_EOR,
+    JIT_OPERATION_SUB,
+    JIT_OPERATION_RSB,
+    JIT_OPERATION_ADD,
+    JIT_OPERATION_ORR,
+    JIT_OPERATION_MOV,
+    JIT_OPERATION_BIC,
+    JIT_OPERATION_MVN,
+    JIT_OPERATION_MUL,
+} JitOperation;
+
+typedef struct JitOperand {
+    u8 is_immediate;
+    u8 reg;         // Host register
+    u32 value;
+} JitOperand;
+
+typedef struct JitTranslation {
+    X64Emitter emitter;
+    CPU *cpu;
+
+    u32 guest_offsets[JIT_MAX_GUEST_REGISTERS];     // Offset in CPU of each allocated guest register
+    u8 guest_count;
+    u32 cycles;
+} JitTranslation;
+
+static int
+jit_find_guest_register(JitTranslation *translation, u32 offset)
+{
+    for (int i = 0; i < translation->guest_count; ++i) {
+        if (translation->guest_offsets[i] == offset) return i;
+    }
+
+    return -1;
+}
+
+/**
+ * Allocates the guest registers (as offsets in CPU) an instruction uses. Returns false if there are not
+ * enough host registers, so the translation stops before that instruction.
+ */
+static bool
+jit_allocate_guest_registers(JitTranslation *translation, u32 *offsets, int count)
+{
+    int needed = 0;
+    for (int i = 0; i < count; ++i) {
+        if (jit_find_guest_register(translation, offsets[i]) != -1) continue;
+
+        bool repeated = false;
+        for (int j = 0; j < i; ++j) {
+            if (offsets[j] == offsets[i]) repeated = true;
+        }
+        if (!repeated) needed++;
+    }
+
+    if (translation->guest_count + needed > JIT_MAX_GUEST_REGISTERS) return false;
+
+    for (int i = 0; i < count; ++i) {
+        if (jit_find_guest_register(translation, offsets[i]) == -1) {
+            translation->guest_offsets[translation->guest_count++] = offsets[i];
+        }
+    }
+
+    return true;
+}
+
+static u8
+jit_host_register(JitTranslation *translation, u32 offset)
+{
+    // NOTE: The register was allocated with jit_allocate_guest_registers().
+    int index = jit_find_guest_register(translation, offset);
+
+    return jit_guest_host_registers[index];
+}
+
+static u32
+jit_register_offset(u8 rn)
+{
+    return (u32)(offsetof(CPU, r) + rn*sizeof(u32));
+}
+
+static JitOperand
+jit_register_operand(JitTranslation *translation, u32 offset)
+{
+    return (JitOperand) { .is_immediate = false, .reg = jit_host_register(translation, offset) };
+}
+
+static JitOperand
+jit_immediate_operand(u32 value)
+{
+    return (JitOperand) { .is_immediate = true, .value = value };
+}
+
+static void
+emit_load_operand(X64Emitter *emitter, u8 dst, JitOperand operand)
+{
+    if (operand.is_immediate) {
+        emit_mov_immediate(emitter, dst, operand.value);
+    } else {
+        emit_mov(emitter, dst, operand.reg);
+    }
+}
+
+static void
+emit_alu_operand(X64Emitter *emitter, X64AluOperation operation, u8 dst, JitOperand operand)
+{
+    if (operand.is_immediate) {
+        emit_alu_immediate(emitter, operation, dst, operand.value);
+    } else {
+        emit_alu(emitter, operation, dst, operand.reg);
+    }
+}
+
+/**
+ * Merges the host flags of the last operation into the CPSR register.
+ */
+static void
+emit_update_flags(X64Emitter *emitter, JitFlags flags)
+{
+    if (flags == JIT_FLAGS_NONE) return;
+
+    // NOTE: dl already holds the shifter carry for JIT_FLAGS_NZ_C.
+    u32 mask = (1u << 31) | (1u << 30);
+    emit_setcc(emitter, X64_CONDITION_S, X64_RAX);
+    emit_setcc(emitter, X64_CONDITION_E, X64_RCX);
+
+    if (flags == JIT_FLAGS_ADD || flags == JIT_FLAGS_SUB) {
+        emit_setcc(emitter, (flags == JIT_FLAGS_ADD) ? X64_CONDITION_B : X64_CONDITION_AE, X64_RDX);
+        emit_setcc(emitter, X64_CONDITION_O, X64_RSI);
+        mask |= (1u << 29) | (1u << 28);
+    } else if (flags != JIT_FLAGS_NZ) {
+        mask |= (1u << 29);
+    }
+
+    emit_alu_immediate(emitter, X64_ALU_AND, X64_CPSR_REGISTER, ~mask);
+
+    emit_movzx_8(emitter, X64_RAX, X64_RAX);
+    emit_shift(emitter, SHIFT_TYPE_LOGICAL_LEFT, X64_RAX, 31);
+    emit_alu(emitter, X64_ALU_OR, X64_CPSR_REGISTER, X64_RAX);
+
+    emit_movzx_8(emitter, X64_RAX, X64_RCX);
+    emit_shift(emitter, SHIFT_TYPE_LOGICAL_LEFT, X64_RAX, 30);
+    emit_alu(emitter, X64_ALU_OR, X64_CPSR_REGISTER, X64_RAX);
+
+    if (flags == JIT_FLAGS_NZ_C || flags == JIT_FLAGS_ADD || flags == JIT_FLAGS_SUB) {
+        emit_movzx_8(emitter, X64_RAX, X64_RDX);
+        emit_shift(emitter, SHIFT_TYPE_LOGICAL_LEFT, X64_RAX, 29);
+        emit_alu(emitter, X64_ALU_OR, X64_CPSR_REGISTER, X64_RAX);
+    } else if (flags == JIT_FLAGS_NZ_C_SET) {
+        emit_alu_immediate(emitter, X64_ALU_OR, X64_CPSR_REGISTER, 1u << 29);
+    }
+
+    if (flags == JIT_FLAGS_ADD || flags == JIT_FLAGS_SUB) {
+        emit_movzx_8(emitter, X64_RAX, X64_RSI);
+        emit_shift(emitter, SHIFT_TYPE_LOGICAL_LEFT, X64_RAX, 28);
+        emit_alu(emitter, X64_ALU_OR, X64_CPSR_REGISTER, X64_RAX);
+    }
+}
+
+/**
+ * result = a <operation> b, stored in `dst` (unless dst is 0xFF), with the given flags.
+ * The result is computed in eax, so operands can alias the destination.
+ */
+static void
+emit_operation(JitTranslation *translation, JitOperation operation, u8 dst, JitOperand a, JitOperand b, JitFlags flags)
+{
+    X64Emitter *emitter = &translation->emitter;
+    u8 needs_test = (flags != JIT_FLAGS_NONE && flags != JIT_FLAGS_ADD && flags != JIT_FLAGS_SUB);
+
+    switch (operation) {
+        case JIT_OPERATION_AND: emit_load_operand(emitter, X64_RAX, a); emit_alu_operand(emitter, X64_ALU_AND, X64_RAX, b); break;
+        case JIT_OPERATION_EOR: emit_load_operand(emitter, X64_RAX, a); emit_alu_operand(emitter, X64_ALU_XOR, X64_RAX, b); break;
+        case JIT_OPERATION_ORR: emit_load_operand(emitter, X64_RAX, a); emit_alu_operand(emitter, X64_ALU_OR, X64_RAX, b); break;
+        case JIT_OPERATION_ADD: emit_load_operand(emitter, X64_RAX, a); emit_alu_operand(emitter, X64_ALU_ADD, X64_RAX, b); break;
+        case JIT_OPERATION_SUB: emit_load_operand(emitter, X64_RAX, a); emit_alu_operand(emitter, X64_ALU_SUB, X64_RAX, b); break;
+        case JIT_OPERATION_RSB: emit_load_operand(emitter, X64_RAX, b); emit_alu_operand(emitter, X64_ALU_SUB, X64_RAX, a); break;
+        case JIT_OPERATION_MOV: emit_load_operand(emitter, X64_RAX, b); break;
+        case JIT_OPERATION_MVN: emit_load_operand(emitter, X64_RAX, b); emit_not(emitter, X64_RAX); break;
+        case JIT_OPERATION_BIC: {
+            emit_load_operand(emitter, X64_RAX, b);
+            emit_not(emitter, X64_RAX);
+            emit_alu_operand(emitter, X64_ALU_AND, X64_RAX, a);
+        } break;
+        case JIT_OPERATION_MUL: {
+            // NOTE: Both operands are registers.
+            emit_load_operand(emitter, X64_RAX, a);
+            emit_imul(emitter, X64_RAX, b.reg);
+        } break;
+    }
+
+    if (needs_test) {
+        emit_test(emitter, X64_RAX, X64_RAX);
+    }
+
+    // NOTE: mov does not change the host flags.
+    if (dst != 0xFF) {
+        emit_mov(emitter, dst, X64_RAX);
+    }
+
+    emit_update_flags(emitter, flags);
+}
+
+/**
+ * Shifts `source` by an immediate into ecx, keeping the carry out in dl.
+ */
+static void
+emit_shift_immediate_with_carry(X64Emitter *emitter, ShiftType shift_type, u8 source, u8 shift)
+{
+    emit_mov(emitter, X64_RCX, source);
+    emit_shift(emitter, shift_type, X64_RCX, shift);
+    emit_setcc(emitter, X64_CONDITION_B, X64_RDX);
+}
+
+static bool
+jit_translate_thumb_instruction(JitTranslation *translation, Instruction *instruction)
+{
+    X64Emitter *emitter = &translation->emitter;
+
+    switch (instruction->type) {
+        case INSTRUCTION_MOVE_SHIFTED_REGISTER: {
+            u32 offsets[] = { jit_register_offset(instruction->rs), jit_register_offset(instruction->rd) };
+            if (!jit_allocate_guest_registers(translation, offsets, 2)) return false;
+
+            u8 rs = jit_host_register(translation, offsets[0]);
+            u8 rd = jit_host_register(translation, offsets[1]);
+            u8 shift = (u8)instruction->offset;
+
+            switch (instruction->op) {
+                case THUMB_SHIFT_TYPE_LOGICAL_LEFT: {
+                    if (shift == 0) {
+                        emit_operation(translation, JIT_OPERATION_MOV, rd, jit_immediate_operand(0), jit_register_operand(translation, offsets[0]), JIT_FLAGS_NZ);
+                    } else {
+                        emit_shift_immediate_with_carry(emitter, SHIFT_TYPE_LOGICAL_LEFT, rs, shift);
+                        emit_operation(translation, JIT_OPERATION_MOV, rd, jit_immediate_operand(0), (JitOperand) { .reg = X64_RCX }, JIT_FLAGS_NZ_C);
+                    }
+                } break;
+                case THUMB_SHIFT_TYPE_LOGICAL_RIGHT: {
+                    if (shift == 0) {
+                        // LSR #32: carry is bit 31, result is 0.
+                        emit_shift_immediate_with_carry(emitter, SHIFT_TYPE_LOGICAL_LEFT, rs, 1);
+                        emit_operation(translation, JIT_OPERATION_MOV, rd, jit_immediate_operand(0), jit_immediate_operand(0), JIT_FLAGS_NZ_C);
+                    } else {
+                        emit_shift_immediate_with_carry(emitter, SHIFT_TYPE_LOGICAL_RIGHT, rs, shift);
+                        emit_operation(translation, JIT_OPERATION_MOV, rd, jit_immediate_operand(0), (JitOperand) { .reg = X64_RCX }, JIT_FLAGS_NZ_C);
+                    }
+                } break;
+                case THUMB_SHIFT_TYPE_ARITHMETIC_RIGHT: {
+                    if (shift == 0) {
+                        // ASR #32: carry is bit 31, result is bit 31 replicated.
+                        emit_mov(emitter, X64_RCX, rs);
+                        emit_shift(emitter, SHIFT_TYPE_ARITHMETIC_RIGHT, X64_RCX, 31);
+                        emit_mov(emitter, X64_RDX, X64_RCX);
+                        emit_alu_immediate(emitter, X64_ALU_AND, X64_RDX, 1);
+                    } else {
+                        emit_shift_immediate_with_carry(emitter, SHIFT_TYPE_ARITHMETIC_RIGHT, rs, shift);
+                    }
+                    emit_operation(translation, JIT_OPERATION_MOV, rd, jit_immediate_operand(0), (JitOperand) { .reg = X64_RCX }, JIT_FLAGS_NZ_C);
+                } break;
+                default: {
+                    return false;
+                }
+            }
+
+            translation->cycles++;
+        } break;
+
+        case INSTRUCTION_ADD_SUBTRACT: {
+            u32 offsets[] = { jit_register_offset(instruction->rs), jit_register_offset(instruction->rd), jit_register_offset(instruction->rn) };
+            if (!jit_allocate_guest_registers(translation, offsets, instruction->I ? 2 : 3)) return false;
+
+            JitOperand first = jit_register_operand(translation, offsets[0]);
+            JitOperand second = instruction->I ? jit_immediate_operand(instruction->rn) : jit_register_operand(translation, offsets[2]);
+            u8 rd = jit_host_register(translation, offsets[1]);
+
+            if (instruction->op) {
+                emit_operation(translation, JIT_OPERATION_SUB, rd, first, second, JIT_FLAGS_SUB);
+            } else {
+                emit_operation(translation, JIT_OPERATION_ADD, rd, first, second, JIT_FLAGS_ADD);
+            }
+
+            translation->cycles++;
+        } break;
+
+        case INSTRUCTION_MOVE_COMPARE_ADD_SUBTRACT_IMMEDIATE: {
+            u32 offsets[] = { jit_register_offset(instruction->rd) };
+            if (!jit_allocate_guest_registers(translation, offsets, 1)) return false;
+
+            u8 rd = jit_host_register(translation, offsets[0]);
+            JitOperand value = jit_immediate_operand((u32)instruction->offset);
+            JitOperand rd_operand = jit_register_operand(translation, offsets[0]);
+
+            switch (instruction->op) {
+                case 0: emit_operation(translation, JIT_OPERATION_MOV, rd, rd_operand, value, JIT_FLAGS_NZ); break;
+                case 1: emit_operation(translation, JIT_OPERATION_SUB, 0xFF, rd_operand, value, JIT_FLAGS_SUB); break;
+                case 2: emit_operation(translation, JIT_OPERATION_ADD, rd, rd_operand, value, JIT_FLAGS_ADD); break;
+                case 3: emit_operation(translation, JIT_OPERATION_SUB, rd, rd_operand, value, JIT_FLAGS_SUB); break;
+            }
+
+            translation->cycles++;
+        } break;
+
+        case INSTRUCTION_ALU_OPERATIONS: {
+            u32 offsets[] = { jit_register_offset(instruction->rd), jit_register_offset(instruction->rs) };
+
+            // NOTE: Shifts by register, ADC, SBC and NEG are left to the interpreter.
+            JitOperation operation;
+            JitFlags flags = JIT_FLAGS_NZ;
+            u8 store_result = true;
+            u8 cycles = 1;
+            switch (instruction->op) {
+                case 0:  operation = JIT_OPERATION_AND; break;
+                case 1:  operation = JIT_OPERATION_EOR; break;
+                case 8:  operation = JIT_OPERATION_AND; store_result = false; break;            // TST
+                case 10: operation = JIT_OPERATION_SUB; store_result = false; flags = JIT_FLAGS_SUB; break; // CMP
+                case 11: operation = JIT_OPERATION_ADD; store_result = false; flags = JIT_FLAGS_ADD; break; // CMN
+                case 12: operation = JIT_OPERATION_ORR; break;
+                case 13: operation = JIT_OPERATION_MUL; cycles = 2; break;
+                case 14: operation = JIT_OPERATION_BIC; break;
+                case 15: operation = JIT_OPERATION_MVN; break;
+                default: return false;
+            }
+
+            if (!jit_allocate_guest_registers(translation, offsets, 2)) return false;
+
+            u8 rd = jit_host_register(translation, offsets[0]);
+            emit_operation(translation, operation, store_result ? rd : 0xFF,
+                           jit_register_operand(translation, offsets[0]), jit_register_operand(translation, offsets[1]), flags);
+
+            translation->cycles += cycles;
+        } break;
+
+        case INSTRUCTION_HI_REGISTER_OPERATIONS_BRANCH_EXCHANGE: {
+            u8 rs_n = instruction->rs + (instruction->H2 * 8);
+            u8 rd_n = instruction->rd + (instruction->H1 * 8);
+            if (rs_n == 15 || rd_n == 15) return false;
+            if (instruction->op != 0 && instruction->op != 2) return false; // Only ADD and MOV
+            if (instruction->H1 == 0 && instruction->H2 == 0) return false; // Undefined, the interpreter asserts
+
+            u32 offsets[] = { jit_register_offset(rd_n), jit_register_offset(rs_n) };
+            if (!jit_allocate_guest_registers(translation, offsets, 2)) return false;
+
+            u8 rd = jit_host_register(translation, offsets[0]);
+            JitOperation operation = (instruction->op == 0) ? JIT_OPERATION_ADD : JIT_OPERATION_MOV;
+            emit_operation(translation, operation, rd, jit_register_operand(translation, offsets[0]), jit_register_operand(translation, offsets[1]), JIT_FLAGS_NONE);
+
+            translation->cycles++;
+        } break;
+
+        case INSTRUCTION_LOAD_ADDRESS: {
+            if (instruction->rd == 15) return false;
+
+            // NOTE: SP is read straight from CPU, as the interpreter does.
+            u32 offsets[] = { jit_register_offset(instruction->rd), (u32)offsetof(CPU, sp) };
+            if (!jit_allocate_guest_registers(translation, offsets, instruction->S ? 2 : 1)) return false;
+
+            u8 rd = jit_host_register(translation, offsets[0]);
+            u32 value = (u32)instruction->value_8 << 2;
+            if (instruction->S) {
+                emit_operation(translation, JIT_OPERATION_ADD, rd, jit_register_operand(translation, offsets[1]), jit_immediate_operand(value), JIT_FLAGS_NONE);
+            } else {
+                u32 pc = instruction->address + 4;
+                emit_operation(translation, JIT_OPERATION_MOV, rd, jit_immediate_operand(0), jit_immediate_operand((pc & 0xFFFFFFFC) + value), JIT_FLAGS_NONE);
+            }
+
+            translation->cycles++;
+        } break;
+
+        case INSTRUCTION_ADD_OFFSET_TO_STACK_POINTER: {
+            u32 offsets[] = { (u32)offsetof(CPU, sp) };
+            if (!jit_allocate_guest_registers(translation, offsets, 1)) return false;
+
+            s8 sign = instruction->S ? -1 : 1;
+            int offset = sign * (instruction->offset << 2);
+
+            u8 sp = jit_host_register(translation, offsets[0]);
+            emit_operation(translation, JIT_OPERATION_ADD, sp, jit_register_operand(translation, offsets[0]), jit_immediate_operand((u32)offset), JIT_FLAGS_NONE);
+
+            translation->cycles++;
+        } break;
+
+        default: {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool
+jit_translate_arm_instruction(JitTranslation *translation, Instruction *instruction)
+{
+    X64Emitter *emitter = &translation->emitter;
+
+    // NOTE: Only unconditional data processing that does not involve the PC.
+    if (instruction->condition != CONDITION_AL) return false;
+    if (instruction_categories[instruction->type] != INSTRUCTION_CATEGORY_DATA_PROCESSING) return false;
+    if (instruction->rd == 15) return false;
+
+    JitOperation operation;
+    JitFlags flags = instruction->S ? JIT_FLAGS_NZ : JIT_FLAGS_NONE;
+    u8 store_result = true;
+    u8 uses_rn = true;
+    switch (instruction->type) {
+        case INSTRUCTION_AND: operation = JIT_OPERATION_AND; break;
+        case INSTRUCTION_EOR: operation = JIT_OPERATION_EOR; break;
+        case INSTRUCTION_ORR: operation = JIT_OPERATION_ORR; break;
+        case INSTRUCTION_BIC: operation = JIT_OPERATION_BIC; break;
+        case INSTRUCTION_TST: operation = JIT_OPERATION_AND; store_result = false; break;
+        case INSTRUCTION_TEQ: operation = JIT_OPERATION_EOR; store_result = false; break;
+        case INSTRUCTION_MOV: operation = JIT_OPERATION_MOV; uses_rn = false; break;
+        case INSTRUCTION_MVN: operation = JIT_OPERATION_MVN; uses_rn = false; break;
+        case INSTRUCTION_ADD: operation = JIT_OPERATION_ADD; if (instruction->S) flags = JIT_FLAGS_ADD; break;
+        case INSTRUCTION_CMN: operation = JIT_OPERATION_ADD; store_result = false; flags = JIT_FLAGS_ADD; break;
+        case INSTRUCTION_SUB: operation = JIT_OPERATION_SUB; if (instruction->S) flags = JIT_FLAGS_SUB; break;
+        case INSTRUCTION_CMP: operation = JIT_OPERATION_SUB; store_result = false; flags = JIT_FLAGS_SUB; break;
+        case INSTRUCTION_RSB: {
+            // NOTE: The interpreter computes the carry of RSB as for SUB, leave it there.
+            if (instruction->S) return false;
+            operation = JIT_OPERATION_RSB;
+        } break;
+        default: {
+            // ADC, SBC and RSC
+            return false;
+        }
+    }
+
+    if (uses_rn && instruction->rn == 15) return false;
+
+    u32 offsets[3];
+    int offset_count = 0;
+    offsets[offset_count++] = jit_register_offset(instruction->rd);
+    if (uses_rn) offsets[offset_count++] = jit_register_offset(instruction->rn);
+
+    // Second operand
+    JitOperand second_operand;
+    u8 shifter_carry_in_dl = false;
+    if (instruction->I) {
+        u8 imm = instruction->second_operand & 0xFF;
+        u32 rotate = ((instruction->second_operand >> 8) & 0xF) * 2;
+        u32 value = rotate_right(imm, rotate, 32);
+
+        second_operand = jit_immediate_operand(value);
+        if (flags == JIT_FLAGS_NZ && rotate != 0) {
+            flags = ((value >> 31) & 1) ? JIT_FLAGS_NZ_C_SET : JIT_FLAGS_NZ_C_CLEAR;
+        }
+
+        if (!jit_allocate_guest_registers(translation, offsets, offset_count)) return false;
+    } else {
+        u8 rm_n = instruction->second_operand & 0xF;
+        u8 shift = (instruction->second_operand >> 4) & 0xFF;
+        ShiftType shift_type = (ShiftType)((shift >> 1) & 0b11);
+        u8 shift_value = (shift >> 3) & 0b11111;
+
+        // NOTE: Shifts by register, RRX and the #32 encodings of LSR/ASR stay in the interpreter.
+        if (rm_n == 15) return false;
+        if (shift & 1) return false;
+        if (shift_type == SHIFT_TYPE_ROTATE_RIGHT) return false;
+        if (shift_type != SHIFT_TYPE_LOGICAL_LEFT && shift_value == 0) return false;
+
+        offsets[offset_count++] = jit_register_offset(rm_n);
+        if (!jit_allocate_guest_registers(translation, offsets, offset_count)) return false;
+
+        u8 rm = jit_host_register(translation, offsets[offset_count - 1]);
+        if (shift_value == 0) {
+            second_operand = jit_register_operand(translation, offsets[offset_count - 1]);
+        } else {
+            emit_shift_immediate_with_carry(emitter, shift_type, rm, shift_value);
+            second_operand = (JitOperand) { .reg = X64_RCX };
+            shifter_carry_in_dl = true;
+        }
+    }
+
+    if (flags == JIT_FLAGS_NZ && shifter_carry_in_dl) {
+        flags = JIT_FLAGS_NZ_C;
+    }
+
+    JitOperand first_operand = uses_rn ? jit_register_operand(translation, jit_register_offset(instruction->rn)) : jit_immediate_operand(0);
+    u8 rd = jit_host_register(translation, offsets[0]);
+    emit_operation(translation, operation, store_result ? rd : 0xFF, first_operand, second_operand, flags);
+
+    translation->cycles++;
+
+    return true;
+}
+
+#if JIT_AVAILABLE
+
+#ifdef _LINUX
+#include <sys/mman.h>
+#else
+__declspec(dllimport) void * __stdcall VirtualAlloc(void *address, size_t size, unsigned long allocation_type, unsigned long protect);
+#define JIT_MEM_COMMIT              (0x00001000)
+#define JIT_MEM_RESERVE             (0x00002000)
+#define JIT_PAGE_EXECUTE_READWRITE  (0x40)
+#endif
+
+static bool
+init_jit_code_buffer(JitCodeBuffer *buffer)
+{
+    if (buffer->memory) return true;
+
+#ifdef _LINUX
+    void *memory = mmap(0, JIT_CODE_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) return false;
+#else
+    void *memory = VirtualAlloc(0, JIT_CODE_BUFFER_SIZE, JIT_MEM_COMMIT | JIT_MEM_RESERVE, JIT_PAGE_EXECUTE_READWRITE);
+    if (memory == 0) return false;
+#endif
+
+    buffer->memory = (u8 *)memory;
+    buffer->used = 0;
+
+    return true;
+}
+
+#else
+
+static bool
+init_jit_code_buffer(JitCodeBuffer *buffer)
+{
+    (void)buffer;
+
+    return false;
+}
+
+#endif // JIT_AVAILABLE
+
+/**
+ * Translates the leading supported instructions of the block.
+ * Returns the number of translated instructions (0 if none); the code and its cycles are returned in
+ * `code` and `cycles`.
+ */
+static int
+jit_translate_block(JitCodeBuffer *buffer, CPU *cpu, BasicBlock *block, JitBlockFunction *code, u32 *cycles)
+{
+    if (!init_jit_code_buffer(buffer)) return 0;
+    if (buffer->used + JIT_MAX_BLOCK_CODE_SIZE > JIT_CODE_BUFFER_SIZE) return 0;
+
+    JitTranslation translation = {0};
+    translation.cpu = cpu;
+
+    // Translate the body into a temporary buffer first: the prologue needs the guest registers used.
+    u8 body[JIT_MAX_BLOCK_CODE_SIZE];
+    translation.emitter = (X64Emitter) { .code = body };
+
+    // NOTE: Leave room for the prologue and the epilogue.
+    u32 max_body_size = JIT_MAX_BLOCK_CODE_SIZE - 256;
+
+    int translated = 0;
+    for (; translated < block->instruction_count; ++translated) {
+        Instruction *instruction = block->instructions + translated;
+        if (translation.emitter.size + 128 > max_body_size) break;
+
+        // A failed translation may have allocated registers; that is fine, they are just written back.
+        u32 size = translation.emitter.size;
+        bool ok = block->thumb ? jit_translate_thumb_instruction(&translation, instruction)
+                               : jit_translate_arm_instruction(&translation, instruction);
+        if (!ok) {
+            translation.emitter.size = size;
+            break;
+        }
+    }
+
+    if (translated == 0) return 0;
+
+    X64Emitter emitter = { .code = buffer->memory + buffer->used };
+
+    // Prologue
+#ifndef _LINUX
+    // NOTE: Windows x64 passes the first argument in rcx, and rdi/rsi are callee-saved.
+    emit_push(&emitter, X64_RDI);
+    emit_push(&emitter, X64_RSI);
+    emit_u8(&emitter, 0x48); emit_u8(&emitter, 0x89); emit_u8(&emitter, 0xCF); // mov rdi, rcx
+#endif
+    emit_push(&emitter, X64_RBX);
+    emit_push(&emitter, X64_RBP);
+    emit_push(&emitter, X64_R12);
+    emit_push(&emitter, X64_R13);
+    emit_push(&emitter, X64_R14);
+    emit_push(&emitter, X64_R15);
+
+    emit_load_cpu_field(&emitter, X64_CPSR_REGISTER, (u32)offsetof(CPU, cpsr));
+    for (int i = 0; i < translation.guest_count; ++i) {
+        emit_load_cpu_field(&emitter, jit_guest_host_registers[i], translation.guest_offsets[i]);
+    }
+
+    // Body
+    memcpy(emitter.code + emitter.size, body, translation.emitter.size);
+    emitter.size += translation.emitter.size;
+
+    // Epilogue
+    for (int i = 0; i < translation.guest_count; ++i) {
+        emit_store_cpu_field(&emitter, jit_guest_host_registers[i], translation.guest_offsets[i]);
+    }
+    emit_store_cpu_field(&emitter, X64_CPSR_REGISTER, (u32)offsetof(CPU, cpsr));
+    emit_add_cpu_field_64(&emitter, (u32)offsetof(CPU, cycles), translation.cycles);
+
+    emit_pop(&emitter, X64_R15);
+    emit_pop(&emitter, X64_R14);
+    emit_pop(&emitter, X64_R13);
+    emit_pop(&emitter, X64_R12);
+    emit_pop(&emitter, X64_RBP);
+    emit_pop(&emitter, X64_RBX);
+#ifndef _LINUX
+    emit_pop(&emitter, X64_RSI);
+    emit_pop(&emitter, X64_RDI);
+#endif
+    emit_u8(&emitter, 0xC3); // ret
+
+    *code = (JitBlockFunction)(void *)emitter.code;
+    *cycles = translation.cycles;
+    buffer->used += emitter.size;
+
+    return translated;
+}
+
+static void
+reset_jit_code_buffer(JitCodeBuffer *buffer)
+{
+    buffer->used = 0;
+}
+
+#endif // JIT_X64_H
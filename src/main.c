@@ -1,14 +1,26 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 
 #include <math.h>
 #include "../include/raylib.h"
 
+#ifdef _LINUX
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #include "types.h"
 #include "cpu.h"
 #include "memory.h"
 #include "instruction.h"
+#include "block_cache.h"
+#include "jit_x64.h"
+#include "bios.h"
+#include "scheduler.h"
 
 
 #ifdef _DEBUG_PRINT
@@ -22,11 +34,38 @@
 #endif
 
 
+//
+// Threaded dispatch
+//
+// With GCC, the handler of each instruction type is reached with a single computed goto (labels as
+// values) indexed by the decoded instruction type, instead of going through the switch statements. The
+// switch statements stay as the portable fallback (MSVC, or building with -DNO_THREADED_DISPATCH).
+// HANDLER() names the case of a switch so it can be used as a jump target.
+//
+#if defined(__GNUC__) && !defined(NO_THREADED_DISPATCH)
+#define THREADED_DISPATCH
+#define HANDLER(label) label:
+#else
+#define HANDLER(label)
+#endif
+
+
 CPU gba_cpu = {0};
 CPU *cpu = &gba_cpu;
 
 GBAMemory memory = {0};
 
+BlockCache block_cache = {0};
+static u8 use_block_cache = true;
+
+Scheduler scheduler = {0};
+
+JitCodeBuffer jit_code_buffer = {0};
+static u8 use_jit = false; // Enabled with --jit
+
+static u8 use_hle_bios = true; // Disabled with --lle-bios (see bios.h)
+static u8 use_direct_boot = false; // Enabled with --direct-boot (see direct_boot())
+
 u32 current_instruction;
 Instruction decoded_instruction;
 
@@ -48,7 +87,8 @@ static u8 paused = 0;
 static void
 set_mode(u8 bits)
 {
-    cpu->cpsr = (cpu->cpsr & ((u32)~(0b11111))) | ((bits) & 0b11111);
+    materialize_flags(cpu);
+    set_cpsr(cpu, (cpu->cpsr & ((u32)~(0b11111))) | ((bits) & 0b11111));
 }
 
 static void
@@ -75,38 +115,46 @@ static void
 set_control_bit_I(u8 bit)
 {
     cpu->cpsr = ((cpu->cpsr & ~(1 << 7)) | ((bit) & 1) << 7);
+    update_irq_pending(cpu);
 }
 
 
 //
 // Codition Code Flags
 //
-#define CONDITION_V             ((cpu->cpsr >> 28) & 1)     /* Overflow */
-#define CONDITION_C             ((cpu->cpsr >> 29) & 1)     /* Carry or borrow extended */
-#define CONDITION_Z             ((cpu->cpsr >> 30) & 1)     /* Zero */
-#define CONDITION_N             ((cpu->cpsr >> 31) & 1)     /* Negative or less than */
+// NOTE: Data processing and Thumb ALU operations record their flags lazily (see set_flags_lazy()), so
+// reading them from the cpsr must go through these macros or materialize_flags().
+//
+#define CONDITION_V             ((materialize_flags(cpu), cpu->cpsr >> 28) & 1)     /* Overflow */
+#define CONDITION_C             ((materialize_flags(cpu), cpu->cpsr >> 29) & 1)     /* Carry or borrow extended */
+#define CONDITION_Z             ((materialize_flags(cpu), cpu->cpsr >> 30) & 1)     /* Zero */
+#define CONDITION_N             ((materialize_flags(cpu), cpu->cpsr >> 31) & 1)     /* Negative or less than */
 
 static void
 set_condition_V(u8 bit)
 {
+    materialize_flags(cpu);
     cpu->cpsr = ((cpu->cpsr & ~(1 << 28)) | ((bit) & 1) << 28);
 }
 
 static void
 set_condition_C(u8 bit)
 {
+    materialize_flags(cpu);
     cpu->cpsr = ((cpu->cpsr & ~(1 << 29)) | ((bit) & 1) << 29);
 }
 
 static void
 set_condition_Z(u8 bit)
 {
+    materialize_flags(cpu);
     cpu->cpsr = ((cpu->cpsr & ~(1 << 30)) | ((bit) & 1) << 30);
 }
 
 static void
 set_condition_N(u8 bit)
 {
+    materialize_flags(cpu);
     cpu->cpsr = ((cpu->cpsr & ~(1 << 31)) | ((bit) & 1) << 31);
 }
 
@@ -126,9 +174,65 @@ set_overflow_subtract(u32 a, u32 b, u32 result)
     set_condition_V(bit);
 }
 
+static void
+free_cartridge_memory()
+{
+#ifdef _LINUX
+    if (memory.game_pak_rom) munmap(memory.game_pak_rom, memory.game_pak_rom_size);
+#else
+    free(memory.game_pak_rom);
+#endif
+
+    memory.game_pak_rom = 0;
+    memory.game_pak_rom_size = 0;
+}
+
+/**
+ * The ROM takes whole pages, so the page table maps all of it; the padding reads as 0. On Linux the file
+ * is mapped instead of read: its pages are loaded when they are first read, and they are shared through
+ * the page cache by every process running the same ROM. The mapping is read-only, the bus drops the
+ * writes to the Game Pak ROM (see get_writable_memory_at()).
+ */
 static int
 load_cartridge_into_memory(char *filename)
 {
+    free_cartridge_memory();
+
+#ifdef _LINUX
+    int file = open(filename, O_RDONLY);
+    if (file < 0) {
+        fprintf(stderr, "[ERROR]: Could not load file \"%s\"\n", filename);
+        return 1;
+    } else {
+        struct stat file_stat;
+        if (fstat(file, &file_stat) != 0) {
+            fprintf(stderr, "[ERROR]: Could not load file \"%s\"\n", filename);
+            close(file);
+            return 1;
+        }
+        u32 size = (u32)file_stat.st_size;
+
+        assert(size <= 32*MEGABYTE);
+
+        // NOTE: The pages are reserved first and the file mapped over their start, so the padding after
+        // the end of the file is backed by memory too.
+        u32 rom_size = (size + MEMORY_PAGE_MASK) & ~(u32)MEMORY_PAGE_MASK;
+        u8 *rom = mmap(0, rom_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (rom != MAP_FAILED && size > 0 && mmap(rom, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, file, 0) == MAP_FAILED) {
+            munmap(rom, rom_size);
+            rom = MAP_FAILED;
+        }
+        close(file);
+
+        if (rom == MAP_FAILED) {
+            fprintf(stderr, "[ERROR]: Could not map file \"%s\"\n", filename);
+            return 1;
+        }
+
+        memory.game_pak_rom = rom;
+        memory.game_pak_rom_size = rom_size;
+    }
+#else
     FILE *file = fopen(filename, "rb");
     if (file == NULL) {
         fprintf(stderr, "[ERROR]: Could not load file \"%s\"\n", filename);
@@ -139,11 +243,23 @@ load_cartridge_into_memory(char *filename)
         fseek(file, 0, SEEK_SET);
         
         assert(size <= 32*MEGABYTE);
-        
+
+        u32 rom_size = ((u32)size + MEMORY_PAGE_MASK) & ~(u32)MEMORY_PAGE_MASK;
+        memory.game_pak_rom = calloc(rom_size, 1);
+        if (memory.game_pak_rom == NULL) {
+            fprintf(stderr, "[ERROR]: Could not allocate %d bytes for \"%s\"\n", size, filename);
+            fclose(file);
+            return 1;
+        }
+        memory.game_pak_rom_size = rom_size;
+
         fread(memory.game_pak_rom, size, 1, file);
 
         fclose(file);
     }
+#endif
+
+    init_memory_pages(&memory);
 
     return 0;
 }
@@ -214,296 +330,1102 @@ load_bios_into_memory()
 #define REG_KEYINPUT    ((u16 *)get_memory_at(cpu, &memory, 0x4000130))
 #define REG_KEYCNT      ((u16 *)get_memory_at(cpu, &memory, 0x4000132))
 
+#define REG_IE          ((u16 *)get_memory_at(cpu, &memory, 0x4000200))
+#define REG_IF          ((u16 *)get_memory_at(cpu, &memory, 0x4000202))
+#define REG_IME         ((u16 *)get_memory_at(cpu, &memory, 0x4000208))
+
 #define VRAM            ((u16 *)get_memory_at(cpu, &memory, 0x6000000))
 
 
-typedef struct DisplayControlRegister {
-    u8 video_mode;
-    u8 gbc_mode;
-    u8 bitmap_address;
-    u8 hblank_processing;
-    u8 sprite_dimension;
-    u8 force_blank;
-    u8 enable_bg0;
-    u8 enable_bg1;
-    u8 enable_bg2;
-    u8 enable_bg3;
-    u8 enable_oam;
-    u8 enable_window_0;
-    u8 enable_window_1;
-    u8 enable_sprite_windows;
-} DisplayControlRegister;
+//
+// I/O register handlers
+//
+// The registers with side effects have handlers, called by the bus (see io_read_handlers and
+// io_write_handlers) with the offset of the halfword accessed in the I/O registers region.
+//
+#define IO_REGISTERS_START      (0x04000000)
+#define IO_REGISTERS_END        (0x040003FF)
 
-static void
-parse_display_control_register(DisplayControlRegister *display_control_register, u16 reg)
+typedef u16 (*IOReadHandler)(u32 offset);
+
+/**
+ * mask: bits of the register being written (a byte write only writes half of it). value is already
+ * shifted to the position of the byte.
+ */
+typedef void (*IOWriteHandler)(u32 offset, u16 value, u16 mask);
+
+static u16 *
+get_io_register(u32 offset)
 {
-    display_control_register->video_mode            = (reg >> 0) & 0b111;
-    display_control_register->gbc_mode              = (reg >> 3) & 1;
-    display_control_register->bitmap_address        = (reg >> 4) & 1;
-    display_control_register->hblank_processing     = (reg >> 5) & 1;
-    display_control_register->sprite_dimension      = (reg >> 6) & 1;
-    display_control_register->force_blank           = (reg >> 7) & 1;
-    display_control_register->enable_bg0            = (reg >> 8) & 1;
-    display_control_register->enable_bg1            = (reg >> 9) & 1;
-    display_control_register->enable_bg2            = (reg >> 10) & 1;
-    display_control_register->enable_bg3            = (reg >> 11) & 1;
-    display_control_register->enable_oam            = (reg >> 12) & 1;
-    display_control_register->enable_window_0       = (reg >> 13) & 1;
-    display_control_register->enable_window_1       = (reg >> 14) & 1;
-    display_control_register->enable_sprite_windows = (reg >> 15) & 1;
+    return (u16 *)(memory.io_registers + offset);
 }
 
-typedef struct BackgroundControl {
-    u8 priority;
-    u8 address_character_tile_data;
-    u8 mosaic_effect;
-    u8 color_palette;
-    u8 address_character_tile_map;
-    u8 screen_over;
-    u8 tile_map_size;
-} BackgroundControl;
-
-static void
-parse_background_layer_configuration(BackgroundControl *background_control, u16 reg_io_background_control)
+static u32
+get_io_register_32(u32 offset)
 {
-    background_control->priority                    = (reg_io_background_control >> 0) & 0b11;
-    background_control->address_character_tile_data = (reg_io_background_control >> 2) & 0b11;
-    background_control->mosaic_effect               = (reg_io_background_control >> 6) & 1;
-    background_control->color_palette               = (reg_io_background_control >> 7) & 1;
-    background_control->address_character_tile_map  = (reg_io_background_control >> 8) & 0b11111;
-    background_control->screen_over                 = (reg_io_background_control >> 13) & 1;
-    background_control->tile_map_size               = (reg_io_background_control >> 14) & 0b11;
+    return (u32)*get_io_register(offset) | ((u32)*get_io_register(offset + 2) << 16);
 }
 
 static void
-print_background_control(BackgroundControl *background_control, char *name)
+store_io_register(u32 offset, u16 value, u16 mask)
 {
-    printf("%s:\n", name);
-    printf("  priority = 0x%08X\n", background_control->priority);
-    printf("  address_character_tile_data = 0x%08X\n", background_control->address_character_tile_data);
-    printf("  mosaic_effect = 0x%08X\n", background_control->mosaic_effect);
-    printf("  color_palette = 0x%08X\n", background_control->color_palette);
-    printf("  address_character_tile_map = 0x%08X\n", background_control->address_character_tile_map);
-    printf("  screen_over = 0x%08X\n", background_control->screen_over);
-    printf("  tile_map_size = 0x%08X\n", background_control->tile_map_size);
+    u16 *reg = get_io_register(offset);
+    *reg = (u16)((*reg & ~mask) | (value & mask));
 }
 
+// For the handlers that access memory (see run_dma_transfer()).
+static u16 bus_read16(u32 address);
+static u32 bus_read32(u32 address);
+static void bus_write16(u32 address, u16 value);
+static void bus_write32(u32 address, u32 value);
 
-static void
-init_gba()
-{
-    memset(&gba_cpu, 0, sizeof(CPU));
-    memset(&memory, 0, sizeof(GBAMemory));
 
-    cpu->sp = 0x03007F00;
-    cpu->cpsr = 0x1F;
-    cpu->pc = 0;
+//
+// Interrupts
+//
+// The hardware requests an interrupt by setting its bit in IF (see request_interrupt()). The CPU takes it
+// when it is also enabled in IE, with IME set and the I bit of the cpsr clear. None of those change
+// between the writes to IE, IF, IME and the cpsr, so the IRQ line is only computed on those writes
+// instead of on every instruction (see update_irq_line() and update_irq_pending()).
+//
+#define INTERRUPT_VBLANK        (1 << 0)
+#define INTERRUPT_HBLANK        (1 << 1)
+#define INTERRUPT_VCOUNT        (1 << 2)
+#define INTERRUPT_TIMER0        (1 << 3)    /* INTERRUPT_TIMER0 << timer index */
+#define INTERRUPT_DMA0          (1 << 8)    /* INTERRUPT_DMA0 << channel index */
+#define INTERRUPT_KEYPAD        (1 << 12)
 
-    load_bios_into_memory();
+#define KEYCNT_KEYS             (0x03FF)
+#define KEYCNT_IRQ              (1 << 14)
+#define KEYCNT_AND              (1 << 15)   /* All the selected keys must be pressed, instead of any */
 
 
-    //
-    // Set default values for IO registers
-    //
+static void
+update_irq_line()
+{
+    cpu->irq_line = (*REG_IME & 1) && (*REG_IE & *REG_IF);
+    update_irq_pending(cpu);
+}
 
-    // SOUNDBIAS - Sound PWM Control
-    // This register controls the final sound output. The default setting is 0200h
-    *(u16 *)get_memory_at(cpu, &memory, 0x04000088) = 0x0200;
+static void
+request_interrupt(u16 interrupt)
+{
+    *REG_IF |= interrupt;
+    update_irq_line();
 }
 
-/*
- * Example for rom_entry_point:
- * cond branch_instruction L                     offset
- * 1110                101 0   000000000000000000101110
+/**
+ * Requests the keypad interrupt if the keys pressed match the condition of KEYCNT. Must be called whenever
+ * KEYINPUT or KEYCNT change.
  */
-typedef struct CartridgeHeader {
-    u32 rom_entry_point;    // Where the entry point is. Usually is a branch instruction ("B <label>")
-    u8 nintendo_logo[156];
-    char game_title[12];
-    char game_code[4];      // Short-name for the game
-    char marker_code[2];
-    u8 fixed_value;         // must be 96h, required!
-    u8 main_unit_code;      // 00h for current GBA models
-    u8 device_type;         // usually 00h
-    u8 reserved_1[7];
-    u8 software_version;    // usually 00h
-    u8 complement_check;
-    u8 reserved_2[2];
-    
-    // Additional Multiboot Header Entries
-    u32 ram_entry_point;
-    u8 boot_mode;
-    u8 slave_id_number;
-    u8 not_used[26];
-    u32 joybus_entry_point;
-} CartridgeHeader;
+static void
+check_keypad_interrupt()
+{
+    u16 keycnt = *REG_KEYCNT;
+    if (!(keycnt & KEYCNT_IRQ)) return;
 
+    u16 selected = keycnt & KEYCNT_KEYS;
+    u16 pressed = (u16)~*REG_KEYINPUT & selected; // NOTE: 0 is pressed in KEYINPUT.
+    bool match = (keycnt & KEYCNT_AND) ? (selected && pressed == selected) : (pressed != 0);
+    if (match) request_interrupt(INTERRUPT_KEYPAD);
+}
 
-static int
-should_execute_instruction(Condition condition)
+static void
+write_ie_ime(u32 offset, u16 value, u16 mask)
 {
-    switch (condition) {
-        case CONDITION_EQ: return (CONDITION_Z == 1);
-        case CONDITION_NE: return (CONDITION_Z == 0);
-        case CONDITION_CS: return (CONDITION_C == 1);
-        case CONDITION_CC: return (CONDITION_C == 0);
-        case CONDITION_MI: return (CONDITION_N == 1);
-        case CONDITION_PL: return (CONDITION_N == 0);
-        case CONDITION_VS: return (CONDITION_V == 1);
-        case CONDITION_VC: return (CONDITION_V == 0);
-        case CONDITION_HI: return (CONDITION_C == 1 && CONDITION_Z == 0);
-        case CONDITION_LS: return (CONDITION_C == 0 || CONDITION_Z == 1);
-        case CONDITION_GE: return (CONDITION_N == CONDITION_V);
-        case CONDITION_LT: return (CONDITION_N != CONDITION_V);
-        case CONDITION_GT: return (CONDITION_Z == 0 && CONDITION_N == CONDITION_V);
-        case CONDITION_LE: return (CONDITION_Z == 1 || CONDITION_N != CONDITION_V);
-        case CONDITION_AL: return true; // Always
-        default: {
-            fprintf(stderr, "Unexpected condition: %08X\n", condition);
-            char *type_name = get_instruction_type_string(decoded_instruction.type);
-            fprintf(stderr, "Address: 0x%08X, Current instruction: 0x%08X -> type = %s\n", decoded_instruction.address, current_instruction, type_name);
+    store_io_register(offset, value, mask);
+    update_irq_line();
+}
 
-            print_cpu_state(cpu);
+static void
+write_if(u32 offset, u16 value, u16 mask)
+{
+    // Writing 1 to a bit acknowledges the interrupt.
+    *get_io_register(offset) &= (u16)~(value & mask);
+    update_irq_line();
+}
 
-            exit(1);
-        }
-    }
+static void
+write_keycnt(u32 offset, u16 value, u16 mask)
+{
+    store_io_register(offset, value, mask);
+    check_keypad_interrupt();
 }
 
 
-void
-thumb_execute()
+//
+// DMA
+//
+// The four channels copy memory without the CPU. A channel starts when it is enabled (immediate timing),
+// at the start of VBlank or of each visible HBlank, or, for the sound channels 1 and 2, when the sound
+// FIFO they feed runs low. Copies between linear memory with both addresses incrementing (or with a fixed
+// source, a fill) are done at once by bios_transfer(); anything else (the I/O registers, decrementing or
+// fixed destinations) unit by unit through the bus.
+//
+#define DMA_CHANNEL_COUNT       (4)
+#define DMA_DESTINATION_CONTROL (0b11 << 5)
+#define DMA_SOURCE_CONTROL      (0b11 << 7)
+#define DMA_REPEAT              (1 << 9)
+#define DMA_32_BIT              (1 << 10)
+#define DMA_TIMING              (0b11 << 12)
+#define DMA_IRQ                 (1 << 14)
+#define DMA_ENABLE              (1 << 15)
+
+#define DMA_ADDRESS_INCREMENT   (0)
+#define DMA_ADDRESS_DECREMENT   (1)
+#define DMA_ADDRESS_FIXED       (2)
+#define DMA_ADDRESS_RELOAD      (3)     /* Incremented, and reloaded on each repeat (destination only) */
+
+#define DMA_TIMING_IMMEDIATE    (0)
+#define DMA_TIMING_VBLANK       (1)
+#define DMA_TIMING_HBLANK       (2)
+#define DMA_TIMING_SPECIAL      (3)     /* Sound FIFO (channels 1, 2). Video capture (channel 3) is not emulated. */
+
+#define DMA_CYCLES              (4)
+#define DMA_CYCLES_UNIT         (2)
+
+#define SOUND_FIFO_COUNT        (2)
+#define SOUND_FIFO_SAMPLES      (32)
+
+typedef struct DMAChannel {
+    u32 source;         // Latched when the channel is enabled, then advanced by each transfer
+    u32 destination;
+} DMAChannel;
+
+static DMAChannel dma_channels[DMA_CHANNEL_COUNT];
+
+// Valid address bits and maximum count of each channel.
+static const u32 dma_source_mask[DMA_CHANNEL_COUNT]        = { 0x07FFFFFF, 0x0FFFFFFF, 0x0FFFFFFF, 0x0FFFFFFF };
+static const u32 dma_destination_mask[DMA_CHANNEL_COUNT]   = { 0x07FFFFFF, 0x07FFFFFF, 0x07FFFFFF, 0x0FFFFFFF };
+static const u32 dma_max_count[DMA_CHANNEL_COUNT]          = { 0x4000, 0x4000, 0x4000, 0x10000 };
+
+// Samples left in the sound FIFOs A and B (see trigger_sound_fifo_dma()).
+static u32 sound_fifo_samples[SOUND_FIFO_COUNT];
+static const u32 sound_fifo_address[SOUND_FIFO_COUNT] = { 0x040000A0, 0x040000A4 };
+
+static u32
+get_dma_registers(int index)
 {
-    DEBUG_PRINT("0x%08X: 0x%08X %s, cpsr = 0x%08X, cycles = %lld\n", decoded_instruction.address, decoded_instruction.encoding, get_instruction_type_string(decoded_instruction.type), cpu->cpsr, cpu->cycles);
+    return 0xB0 + 12*(u32)index;
+}
 
-    switch (decoded_instruction.type) {
-        case INSTRUCTION_MOVE_SHIFTED_REGISTER: {
-            u32 shift = decoded_instruction.offset;
-            u32 value = *get_register(cpu, decoded_instruction.rs);
-            u32 *rd = get_register(cpu, decoded_instruction.rd);
-            
-            switch (decoded_instruction.op) {
-                case THUMB_SHIFT_TYPE_LOGICAL_LEFT: { // LSL
-                    if (shift == 0) {
-                        *rd = value;
-                    } else {
-                        set_condition_C((value >> (32 - shift)) & 1);
-                        *rd = value << shift;
-                    }
+static u16
+get_dma_control(int index)
+{
+    return *get_io_register(get_dma_registers(index) + 10);
+}
 
-                    set_condition_Z(*rd == 0);
-                    set_condition_N((*rd >> 31) & 1);
-                } break;
+static u32
+get_dma_count(int index)
+{
+    u32 count = *get_io_register(get_dma_registers(index) + 8) & (dma_max_count[index] - 1);
+    return count ? count : dma_max_count[index];
+}
 
-                case THUMB_SHIFT_TYPE_LOGICAL_RIGHT: { // LSR
-                    if (shift == 0) {
-                        set_condition_C((value >> 31) & 1);
-                        *rd = 0;
-                    } else {
-                        set_condition_C((value >> (shift - 1)) & 1);
-                        *rd = value >> shift;
-                    }
-                    
-                    set_condition_Z(*rd == 0);
-                    set_condition_N((*rd >> 31) & 1);
-                } break;
+static u32
+get_dma_address_step(u32 address_control, u32 unit_size)
+{
+    switch (address_control) {
+        case DMA_ADDRESS_DECREMENT: return (u32)-(s32)unit_size;
+        case DMA_ADDRESS_FIXED:     return 0;
+        default:                    return unit_size;
+    }
+}
 
-                case THUMB_SHIFT_TYPE_ARITHMETIC_RIGHT: { // ASR
-                    if (shift == 0) {
-                        u8 msb = (value >> 31) & 1;
-                        set_condition_C(msb);
+/**
+ * Transfers count units of the channel. A sound FIFO transfer always writes words to the same address.
+ */
+static void
+run_dma_transfer(int index, u32 count, bool sound_fifo)
+{
+    DMAChannel *channel = dma_channels + index;
+    u16 control = get_dma_control(index);
 
-                        if (msb == 0) {
-                            *rd = 0;
-                        } else {
-                            *rd = 0xFFFFFFFF;
-                        }
-                    } else {
-                        set_condition_C((value >> (shift - 1)) & 1);
+    u32 unit_size = (sound_fifo || (control & DMA_32_BIT)) ? 4 : 2;
+    u32 source_control = (control & DMA_SOURCE_CONTROL) >> 7;
+    u32 destination_control = sound_fifo ? DMA_ADDRESS_FIXED : (control & DMA_DESTINATION_CONTROL) >> 5;
+    u32 source_step = get_dma_address_step(source_control, unit_size);
+    u32 destination_step = get_dma_address_step(destination_control, unit_size);
 
-                        u8 msb = (value >> 31) & 1;
-                        u32 msb_replicated = (-msb << (32 - shift));
-                        *rd = (value >> shift) | msb_replicated;
-                    }
+    u32 source = channel->source & ~(unit_size - 1);
+    u32 destination = channel->destination & ~(unit_size - 1);
 
-                    set_condition_Z(*rd == 0);
-                    set_condition_N((*rd >> 31) & 1);
-                } break;
-            }
+    bool transferred = false;
+    if (destination_step == unit_size && (source_step == unit_size || source_step == 0)) {
+        transferred = bios_transfer(&memory, &block_cache, source, destination, count*unit_size, unit_size, source_step == 0);
+    }
 
-            cpu->cycles++;
-        } break;
-        case INSTRUCTION_ADD_SUBTRACT: {
-            u32 first_value = *get_register(cpu, decoded_instruction.rs);
-            u32 second_value = (decoded_instruction.I) ? decoded_instruction.rn : *get_register(cpu, decoded_instruction.rn);
-            u32 result = 0;
+    if (!transferred) {
+        u32 from = source;
+        u32 to = destination;
+        for (u32 i = 0; i < count; ++i) {
+            if (unit_size == 4) {
+                bus_write32(to, bus_read32(from));
+            } else {
+                bus_write16(to, bus_read16(from));
+            }
 
-            u32 *rd = get_register(cpu, decoded_instruction.rd);
+            from += source_step;
+            to += destination_step;
+        }
+    }
 
-            if (decoded_instruction.op) { // SUB
-                result = first_value - second_value;
+    channel->source = source + count*source_step;
+    channel->destination = destination + count*destination_step;
 
-                set_condition_C(second_value <= first_value ? 1 : 0);
-                set_overflow_subtract(first_value, second_value, result);
-            } else { // ADD
-                result = first_value + second_value;
+    cpu->cycles += DMA_CYCLES + count*DMA_CYCLES_UNIT;
+}
 
-                set_condition_C((result < second_value) ? 1 : 0);
-                set_overflow_addition(first_value, second_value, result);
-            }
+static void
+finish_dma(int index)
+{
+    u16 control = get_dma_control(index);
+    if (control & DMA_IRQ) {
+        request_interrupt((u16)(INTERRUPT_DMA0 << index));
+    }
 
-            *rd = result;
-            
-            set_condition_Z(result == 0);
-            set_condition_N((result >> 31) & 1);
+    u32 timing = (control & DMA_TIMING) >> 12;
+    if ((control & DMA_REPEAT) && timing != DMA_TIMING_IMMEDIATE) {
+        if (((control & DMA_DESTINATION_CONTROL) >> 5) == DMA_ADDRESS_RELOAD) {
+            dma_channels[index].destination = get_io_register_32(get_dma_registers(index) + 4) & dma_destination_mask[index];
+        }
+    } else {
+        *get_io_register(get_dma_registers(index) + 10) &= (u16)~DMA_ENABLE;
+    }
+}
 
-            cpu->cycles++;
-        } break;
-        case INSTRUCTION_MOVE_COMPARE_ADD_SUBTRACT_IMMEDIATE: {
-            u32 result = 0;
-            u32 *rd = get_register(cpu, decoded_instruction.rd);
+static void
+run_dma(int index)
+{
+    run_dma_transfer(index, get_dma_count(index), false);
+    finish_dma(index);
+}
 
-            switch (decoded_instruction.op) {
+/**
+ * Starts the enabled channels waiting for the timing (VBlank or HBlank).
+ */
+static void
+trigger_dma(u32 timing)
+{
+    for (int i = 0; i < DMA_CHANNEL_COUNT; ++i) {
+        u16 control = get_dma_control(i);
+        if ((control & DMA_ENABLE) && ((control & DMA_TIMING) >> 12) == timing) {
+            run_dma(i);
+        }
+    }
+}
+
+/**
+ * Each overflow of the timer of a sound FIFO (selected in SOUNDCNT_H) plays one of its samples. Once half
+ * of them are left, the FIFO asks the sound DMA channel writing to it for 4 more words (16 samples).
+ */
+static void
+trigger_sound_fifo_dma(int timer)
+{
+    u16 soundcnt_h = *get_io_register(0x082);
+
+    for (int fifo = 0; fifo < SOUND_FIFO_COUNT; ++fifo) {
+        int fifo_timer = (soundcnt_h >> (10 + 4*fifo)) & 1;
+        if (fifo_timer != timer) continue;
+
+        if (sound_fifo_samples[fifo] > 0) sound_fifo_samples[fifo]--;
+        if (sound_fifo_samples[fifo] > SOUND_FIFO_SAMPLES / 2) continue;
+
+        for (int i = 1; i <= 2; ++i) {
+            u16 control = get_dma_control(i);
+            if (!(control & DMA_ENABLE) || ((control & DMA_TIMING) >> 12) != DMA_TIMING_SPECIAL) continue;
+            if (dma_channels[i].destination != sound_fifo_address[fifo]) continue;
+
+            run_dma_transfer(i, 4, true);
+            finish_dma(i);
+            sound_fifo_samples[fifo] += 16;
+            break;
+        }
+    }
+}
+
+static void
+write_dma_control(u32 offset, u16 value, u16 mask)
+{
+    int index = (int)((offset - 0xBA) / 12);
+    u16 old_control = *get_io_register(offset);
+
+    store_io_register(offset, value, mask);
+    u16 control = *get_io_register(offset);
+
+    if ((old_control & DMA_ENABLE) || !(control & DMA_ENABLE)) return;
+
+    u32 registers = get_dma_registers(index);
+    dma_channels[index].source = get_io_register_32(registers) & dma_source_mask[index];
+    dma_channels[index].destination = get_io_register_32(registers + 4) & dma_destination_mask[index];
+
+    if (((control & DMA_TIMING) >> 12) == DMA_TIMING_IMMEDIATE) {
+        run_dma(index);
+    }
+}
+
+//
+// LCD
+//
+// The LCD draws 160 visible scanlines and 68 of VBlank, each one of 960 cycles of HDraw and 272 of
+// HBlank. VCOUNT and the flags of DISPSTAT change, and the LCD interrupts enabled in DISPSTAT are
+// requested, at the events of the scheduler, in start_scanline() and start_hblank().
+//
+#define CYCLES_HDRAW            960
+#define CYCLES_HBLANK           272
+#define CYCLES_SCANLINE         (CYCLES_HDRAW + CYCLES_HBLANK)
+#define CYCLES_VDRAW            160*CYCLES_SCANLINE
+#define CYCLES_VBLANK           68*CYCLES_SCANLINE
+#define MAX_SCANLINE            228
+#define CPU_CYCLES_PER_FRAME    (280896)
+
+#define DISPSTAT_VBLANK         (1 << 0)
+#define DISPSTAT_HBLANK         (1 << 1)
+#define DISPSTAT_VCOUNT         (1 << 2)
+#define DISPSTAT_VBLANK_IRQ     (1 << 3)
+#define DISPSTAT_HBLANK_IRQ     (1 << 4)
+#define DISPSTAT_VCOUNT_IRQ     (1 << 5)
+
+static void
+start_scanline(u64 cycles)
+{
+    u16 vcount = (u16)((*IO_VCOUNT + 1) % MAX_SCANLINE);
+    *IO_VCOUNT = vcount;
+
+    u16 dispstat = *IO_DISPSTAT & (u16)~(DISPSTAT_HBLANK | DISPSTAT_VCOUNT);
+    if (vcount == 160) dispstat |= DISPSTAT_VBLANK;
+    if (vcount == MAX_SCANLINE - 1) dispstat &= (u16)~DISPSTAT_VBLANK; // NOTE: Not set on the last scanline.
+    if (vcount == (dispstat >> 8)) dispstat |= DISPSTAT_VCOUNT;
+    *IO_DISPSTAT = dispstat;
+
+    if (vcount == 160) {
+        if (dispstat & DISPSTAT_VBLANK_IRQ) request_interrupt(INTERRUPT_VBLANK);
+        trigger_dma(DMA_TIMING_VBLANK);
+    }
+    if ((dispstat & DISPSTAT_VCOUNT) && (dispstat & DISPSTAT_VCOUNT_IRQ)) request_interrupt(INTERRUPT_VCOUNT);
+
+    schedule_event(&scheduler, EVENT_HBLANK, cycles + CYCLES_HDRAW);
+    schedule_event(&scheduler, EVENT_SCANLINE, cycles + CYCLES_SCANLINE);
+}
+
+static void
+start_hblank()
+{
+    *IO_DISPSTAT |= DISPSTAT_HBLANK;
+    if (*IO_DISPSTAT & DISPSTAT_HBLANK_IRQ) request_interrupt(INTERRUPT_HBLANK);
+
+    // NOTE: The HBlanks of the VBlank scanlines do not start HBlank DMA.
+    if (*IO_VCOUNT < 160) trigger_dma(DMA_TIMING_HBLANK);
+}
+
+/**
+ * Starts the LCD on the first scanline, cycles being the cycle it starts at.
+ */
+static void
+init_lcd(u64 cycles)
+{
+    *IO_VCOUNT = 0;
+    *IO_DISPSTAT &= (u16)~(DISPSTAT_VBLANK | DISPSTAT_HBLANK | DISPSTAT_VCOUNT);
+    if ((*IO_DISPSTAT >> 8) == 0) *IO_DISPSTAT |= DISPSTAT_VCOUNT;
+
+    schedule_event(&scheduler, EVENT_HBLANK, cycles + CYCLES_HDRAW);
+    schedule_event(&scheduler, EVENT_SCANLINE, cycles + CYCLES_SCANLINE);
+}
+
+
+//
+// Timers
+//
+// A timer counting cycles is not incremented every cycle: its counter is computed when it is read, from
+// the cycle it started counting at. Only the overflow is an event of the scheduler. A cascade (count-up)
+// timer counts the overflows of the previous timer instead.
+//
+#define TIMER_COUNT             (4)
+#define TIMER_PRESCALER         (0b11)
+#define TIMER_CASCADE           (1 << 2)
+#define TIMER_IRQ               (1 << 6)
+#define TIMER_START             (1 << 7)
+
+typedef struct Timer {
+    u16 reload;
+    u16 counter;        // For a timer counting cycles, the counter at start_cycles
+    u64 start_cycles;
+} Timer;
+
+static Timer timers[TIMER_COUNT];
+static u8 timer_counter_read; // Set on every read of a counter (see run_idle_loop())
+
+// log2 of the cycles of each increment, by prescaler setting (1, 64, 256 and 1024 cycles).
+static const u8 timer_prescaler_shift[4] = { 0, 6, 8, 10 };
+
+static u16
+get_timer_control(int index)
+{
+    return *get_io_register(0x102 + 4*(u32)index);
+}
+
+static bool
+is_timer_counting_cycles(int index, u16 control)
+{
+    return (control & TIMER_START) && !(index > 0 && (control & TIMER_CASCADE));
+}
+
+static u16
+get_timer_counter(int index, u16 control)
+{
+    Timer *timer = timers + index;
+    if (!is_timer_counting_cycles(index, control)) return timer->counter;
+
+    u64 increments = (cpu->cycles - timer->start_cycles) >> timer_prescaler_shift[control & TIMER_PRESCALER];
+
+    // NOTE: The overflow event runs after the instruction, the counter can be read past it.
+    u64 until_overflow = 0x10000 - (u64)timer->counter;
+    if (increments >= until_overflow) {
+        return (u16)(timer->reload + (increments - until_overflow) % (0x10000 - (u64)timer->reload));
+    }
+
+    return (u16)(timer->counter + increments);
+}
+
+static void
+schedule_timer_overflow(int index)
+{
+    Timer *timer = timers + index;
+    u16 control = get_timer_control(index);
+    EventType event = (EventType)(EVENT_TIMER0 + index);
+
+    if (is_timer_counting_cycles(index, control)) {
+        u64 cycles = (0x10000 - (u64)timer->counter) << timer_prescaler_shift[control & TIMER_PRESCALER];
+        schedule_event(&scheduler, event, timer->start_cycles + cycles);
+    } else {
+        cancel_event(&scheduler, event);
+    }
+}
+
+static void
+overflow_timer(int index, u64 cycles)
+{
+    Timer *timer = timers + index;
+    timer->counter = timer->reload;
+    timer->start_cycles = cycles;
+    schedule_timer_overflow(index);
+
+    if (get_timer_control(index) & TIMER_IRQ) {
+        request_interrupt((u16)(INTERRUPT_TIMER0 << index));
+    }
+
+    if (index < 2) trigger_sound_fifo_dma(index);
+
+    if (index + 1 < TIMER_COUNT) {
+        u16 next_control = get_timer_control(index + 1);
+        if ((next_control & TIMER_START) && (next_control & TIMER_CASCADE)) {
+            if (timers[index + 1].counter == 0xFFFF) {
+                overflow_timer(index + 1, cycles);
+            } else {
+                timers[index + 1].counter++;
+            }
+        }
+    }
+}
+
+static u16
+read_timer_counter(u32 offset)
+{
+    int index = (int)((offset - 0x100) >> 2);
+    timer_counter_read = true;
+
+    return get_timer_counter(index, get_timer_control(index));
+}
+
+static void
+write_timer_reload(u32 offset, u16 value, u16 mask)
+{
+    Timer *timer = timers + ((offset - 0x100) >> 2);
+    timer->reload = (u16)((timer->reload & ~mask) | (value & mask));
+}
+
+static void
+write_timer_control(u32 offset, u16 value, u16 mask)
+{
+    int index = (int)((offset - 0x100) >> 2);
+    Timer *timer = timers + index;
+    u16 old_control = get_timer_control(index);
+    u16 counter = get_timer_counter(index, old_control);
+
+    store_io_register(offset, value, mask);
+    u16 control = get_timer_control(index);
+
+    // NOTE: Only restart the count when the way it counts changes, so the cycles towards the next
+    // increment are kept otherwise.
+    u16 counting_bits = TIMER_START | TIMER_CASCADE | TIMER_PRESCALER;
+    if (((old_control ^ control) & counting_bits) == 0) return;
+
+    timer->counter = counter;
+    if (!(old_control & TIMER_START) && (control & TIMER_START)) {
+        timer->counter = timer->reload;
+    }
+    timer->start_cycles = cpu->cycles;
+
+    schedule_timer_overflow(index);
+}
+
+
+/**
+ * Runs the events that are due, in order, each one at the cycle it was scheduled at (the ones it
+ * schedules included). Must be called whenever cpu->cycles advances.
+ */
+static void
+run_events()
+{
+    u64 event_cycles;
+    EventType type;
+    while ((type = pop_due_event(&scheduler, cpu->cycles, &event_cycles)) != EVENT_COUNT) {
+        switch (type) {
+            case EVENT_HBLANK:      start_hblank(); break;
+            case EVENT_SCANLINE:    start_scanline(event_cycles); break;
+            case EVENT_TIMER0:
+            case EVENT_TIMER1:
+            case EVENT_TIMER2:
+            case EVENT_TIMER3:      overflow_timer((int)(type - EVENT_TIMER0), event_cycles); break;
+            default:                assert(!"Invalid event");
+        }
+    }
+}
+
+
+//
+// Bus
+//
+// Every load and store of the CPU goes through the bus_read/bus_write functions. Memory is reached
+// through the page table (see get_memory_at()), and writes invalidate the cached code they overwrite.
+// Accesses to the I/O registers are dispatched per halfword to io_read_handlers and io_write_handlers,
+// so the registers with side effects act when they are accessed instead of being polled.
+//
+static void
+write_read_only_io_register(u32 offset, u16 value, u16 mask)
+{
+    (void)offset; (void)value; (void)mask;
+}
+
+static void
+write_dispstat(u32 offset, u16 value, u16 mask)
+{
+    // NOTE: The VBlank, HBlank and VCount flags are set by the LCD (see start_scanline()).
+    store_io_register(offset, value, mask & 0xFFF8);
+}
+
+static void
+write_postflg_haltcnt(u32 offset, u16 value, u16 mask)
+{
+    store_io_register(offset, value, mask);
+
+    // HALTCNT is the high byte. Bit 7 selects Stop mode instead, which is not emulated.
+    if ((mask & 0xFF00) && !(value & 0x8000)) {
+        cpu->halted = true;
+    }
+}
+
+// Registers without a handler are read as they were stored.
+static const IOReadHandler io_read_handlers[sizeof(memory.io_registers) / 2] = {
+    [0x100 >> 1] = read_timer_counter,              // TM0CNT_L
+    [0x104 >> 1] = read_timer_counter,              // TM1CNT_L
+    [0x108 >> 1] = read_timer_counter,              // TM2CNT_L
+    [0x10C >> 1] = read_timer_counter,              // TM3CNT_L
+};
+
+// Registers without a handler are stored as they are written.
+static const IOWriteHandler io_write_handlers[sizeof(memory.io_registers) / 2] = {
+    [0x004 >> 1] = write_dispstat,                  // DISPSTAT
+    [0x006 >> 1] = write_read_only_io_register,     // VCOUNT
+    [0x0BA >> 1] = write_dma_control,               // DMA0CNT_H
+    [0x0C6 >> 1] = write_dma_control,               // DMA1CNT_H
+    [0x0D2 >> 1] = write_dma_control,               // DMA2CNT_H
+    [0x0DE >> 1] = write_dma_control,               // DMA3CNT_H
+    [0x100 >> 1] = write_timer_reload,              // TM0CNT_L
+    [0x102 >> 1] = write_timer_control,             // TM0CNT_H
+    [0x104 >> 1] = write_timer_reload,              // TM1CNT_L
+    [0x106 >> 1] = write_timer_control,             // TM1CNT_H
+    [0x108 >> 1] = write_timer_reload,              // TM2CNT_L
+    [0x10A >> 1] = write_timer_control,             // TM2CNT_H
+    [0x10C >> 1] = write_timer_reload,              // TM3CNT_L
+    [0x10E >> 1] = write_timer_control,             // TM3CNT_H
+    [0x130 >> 1] = write_read_only_io_register,     // KEYINPUT
+    [0x132 >> 1] = write_keycnt,                    // KEYCNT
+    [0x200 >> 1] = write_ie_ime,                    // IE
+    [0x202 >> 1] = write_if,                        // IF
+    [0x208 >> 1] = write_ie_ime,                    // IME
+    [0x300 >> 1] = write_postflg_haltcnt,           // POSTFLG, HALTCNT
+};
+
+static void
+write_io_register(u32 offset, u16 value, u16 mask)
+{
+    IOWriteHandler handler = io_write_handlers[offset >> 1];
+    if (handler) {
+        handler(offset, value, mask);
+    } else {
+        store_io_register(offset, value, mask);
+    }
+}
+
+static u16
+read_io_register(u32 offset)
+{
+    IOReadHandler handler = io_read_handlers[offset >> 1];
+    if (handler) return handler(offset);
+
+    return *get_io_register(offset);
+}
+
+static u8
+bus_read8(u32 address)
+{
+    if (address >= IO_REGISTERS_START && address <= IO_REGISTERS_END) {
+        return (u8)(read_io_register(address & 0x3FE) >> ((address & 1) * 8));
+    }
+
+    u8 *at = get_memory_at(cpu, &memory, address);
+    return at ? *at : 0;
+}
+
+static u16
+bus_read16(u32 address)
+{
+    if (address >= IO_REGISTERS_START && address <= IO_REGISTERS_END) {
+        return read_io_register(address & 0x3FE);
+    }
+
+    u8 *at = get_memory_at(cpu, &memory, address);
+    return at ? *(u16 *)at : 0;
+}
+
+static u32
+bus_read32(u32 address)
+{
+    if (address >= IO_REGISTERS_START && address <= IO_REGISTERS_END) {
+        return (u32)read_io_register(address & 0x3FC) | ((u32)read_io_register((address & 0x3FC) + 2) << 16);
+    }
+
+    u8 *at = get_memory_at(cpu, &memory, address);
+    return at ? *(u32 *)at : 0;
+}
+
+/**
+ * Host memory a store writes to, or 0 if the address can not be written: the Game Pak ROM is mapped
+ * read-only (see load_cartridge_into_memory()).
+ */
+static u8 *
+get_writable_memory_at(u32 address)
+{
+    if (address >= 0x08000000 && address <= 0x0DFFFFFF) return 0;
+
+    return get_memory_at(cpu, &memory, address);
+}
+
+static void
+bus_write8(u32 address, u8 value)
+{
+    if (address >= IO_REGISTERS_START && address <= IO_REGISTERS_END) {
+        u32 shift = (address & 1) * 8;
+        write_io_register((address & 0x3FE), (u16)(value << shift), (u16)(0xFF << shift));
+        return;
+    }
+
+    u8 *at = get_writable_memory_at(address);
+    if (at == 0) return;
+
+    *at = value;
+    invalidate_cached_code_at(&block_cache, address, 1);
+}
+
+static void
+bus_write16(u32 address, u16 value)
+{
+    if (address >= IO_REGISTERS_START && address <= IO_REGISTERS_END) {
+        write_io_register((address & 0x3FE), value, 0xFFFF);
+        return;
+    }
+
+    u8 *at = get_writable_memory_at(address);
+    if (at == 0) return;
+
+    *(u16 *)at = value;
+    invalidate_cached_code_at(&block_cache, address, 2);
+}
+
+static void
+bus_write32(u32 address, u32 value)
+{
+    if (address >= IO_REGISTERS_START && address <= IO_REGISTERS_END) {
+        write_io_register((address & 0x3FC), (u16)value, 0xFFFF);
+        write_io_register((address & 0x3FC) + 2, (u16)(value >> 16), 0xFFFF);
+        return;
+    }
+
+    u8 *at = get_writable_memory_at(address);
+    if (at == 0) return;
+
+    *(u32 *)at = value;
+    invalidate_cached_code_at(&block_cache, address, 4);
+}
+
+
+typedef struct DisplayControlRegister {
+    u8 video_mode;
+    u8 gbc_mode;
+    u8 bitmap_address;
+    u8 hblank_processing;
+    u8 sprite_dimension;
+    u8 force_blank;
+    u8 enable_bg0;
+    u8 enable_bg1;
+    u8 enable_bg2;
+    u8 enable_bg3;
+    u8 enable_oam;
+    u8 enable_window_0;
+    u8 enable_window_1;
+    u8 enable_sprite_windows;
+} DisplayControlRegister;
+
+static void
+parse_display_control_register(DisplayControlRegister *display_control_register, u16 reg)
+{
+    display_control_register->video_mode            = (reg >> 0) & 0b111;
+    display_control_register->gbc_mode              = (reg >> 3) & 1;
+    display_control_register->bitmap_address        = (reg >> 4) & 1;
+    display_control_register->hblank_processing     = (reg >> 5) & 1;
+    display_control_register->sprite_dimension      = (reg >> 6) & 1;
+    display_control_register->force_blank           = (reg >> 7) & 1;
+    display_control_register->enable_bg0            = (reg >> 8) & 1;
+    display_control_register->enable_bg1            = (reg >> 9) & 1;
+    display_control_register->enable_bg2            = (reg >> 10) & 1;
+    display_control_register->enable_bg3            = (reg >> 11) & 1;
+    display_control_register->enable_oam            = (reg >> 12) & 1;
+    display_control_register->enable_window_0       = (reg >> 13) & 1;
+    display_control_register->enable_window_1       = (reg >> 14) & 1;
+    display_control_register->enable_sprite_windows = (reg >> 15) & 1;
+}
+
+typedef struct BackgroundControl {
+    u8 priority;
+    u8 address_character_tile_data;
+    u8 mosaic_effect;
+    u8 color_palette;
+    u8 address_character_tile_map;
+    u8 screen_over;
+    u8 tile_map_size;
+} BackgroundControl;
+
+static void
+parse_background_layer_configuration(BackgroundControl *background_control, u16 reg_io_background_control)
+{
+    background_control->priority                    = (reg_io_background_control >> 0) & 0b11;
+    background_control->address_character_tile_data = (reg_io_background_control >> 2) & 0b11;
+    background_control->mosaic_effect               = (reg_io_background_control >> 6) & 1;
+    background_control->color_palette               = (reg_io_background_control >> 7) & 1;
+    background_control->address_character_tile_map  = (reg_io_background_control >> 8) & 0b11111;
+    background_control->screen_over                 = (reg_io_background_control >> 13) & 1;
+    background_control->tile_map_size               = (reg_io_background_control >> 14) & 0b11;
+}
+
+static void
+print_background_control(BackgroundControl *background_control, char *name)
+{
+    printf("%s:\n", name);
+    printf("  priority = 0x%08X\n", background_control->priority);
+    printf("  address_character_tile_data = 0x%08X\n", background_control->address_character_tile_data);
+    printf("  mosaic_effect = 0x%08X\n", background_control->mosaic_effect);
+    printf("  color_palette = 0x%08X\n", background_control->color_palette);
+    printf("  address_character_tile_map = 0x%08X\n", background_control->address_character_tile_map);
+    printf("  screen_over = 0x%08X\n", background_control->screen_over);
+    printf("  tile_map_size = 0x%08X\n", background_control->tile_map_size);
+}
+
+
+static void
+init_gba()
+{
+    memset(&gba_cpu, 0, sizeof(CPU));
+    free_cartridge_memory();
+    memset(&memory, 0, sizeof(GBAMemory));
+    init_memory_pages(&memory);
+
+    cpu->sp = 0x03007F00;
+    cpu->cpsr = 0x1F;
+    cpu->pc = 0;
+
+    init_scheduler(&scheduler);
+    init_lcd(cpu->cycles);
+    memset(timers, 0, sizeof(timers));
+    memset(dma_channels, 0, sizeof(dma_channels));
+    memset(sound_fifo_samples, 0, sizeof(sound_fifo_samples));
+
+    load_bios_into_memory();
+
+    init_arm_decode_table();
+    init_thumb_decode_table();
+
+
+    //
+    // Set default values for IO registers
+    //
+
+    // SOUNDBIAS - Sound PWM Control
+    // This register controls the final sound output. The default setting is 0200h
+    *(u16 *)get_memory_at(cpu, &memory, 0x04000088) = 0x0200;
+}
+
+/*
+ * Example for rom_entry_point:
+ * cond branch_instruction L                     offset
+ * 1110                101 0   000000000000000000101110
+ */
+typedef struct CartridgeHeader {
+    u32 rom_entry_point;    // Where the entry point is. Usually is a branch instruction ("B <label>")
+    u8 nintendo_logo[156];
+    char game_title[12];
+    char game_code[4];      // Short-name for the game
+    char marker_code[2];
+    u8 fixed_value;         // must be 96h, required!
+    u8 main_unit_code;      // 00h for current GBA models
+    u8 device_type;         // usually 00h
+    u8 reserved_1[7];
+    u8 software_version;    // usually 00h
+    u8 complement_check;
+    u8 reserved_2[2];
+    
+    // Additional Multiboot Header Entries
+    u32 ram_entry_point;
+    u8 boot_mode;
+    u8 slave_id_number;
+    u8 not_used[26];
+    u32 joybus_entry_point;
+} CartridgeHeader;
+
+static bool first_instruction_cartridge_executed = false;
+
+/**
+ * Starts the game without running the BIOS boot (the logo animation), leaving the state the BIOS leaves
+ * when it jumps to the cartridge: System mode with the stacks of the System, IRQ and Supervisor modes
+ * set, and no keys pressed. Must be called once the cartridge is loaded.
+ */
+static void
+direct_boot()
+{
+    cpu->sp = 0x03007F00;
+    cpu->r13_irq = 0x03007FA0;
+    cpu->r13_svc = 0x03007FE0;
+    set_cpsr(cpu, MODE_SYSTEM);
+
+    *REG_KEYINPUT = 0x03FF;
+    first_instruction_cartridge_executed = true;
+
+    // POSTFLG: set once the BIOS boot is done.
+    *(u8 *)get_memory_at(cpu, &memory, 0x04000300) = 1;
+
+    // NOTE: The entry point is a branch, usually over the rest of the header, so the game starts at its
+    // target. Anything else is executed from the start of the ROM.
+    CartridgeHeader *header = (CartridgeHeader *)memory.game_pak_rom;
+    u32 entry_point = 0x08000000;
+    if ((header->rom_entry_point & 0xFF000000) == 0xEA000000) {
+        entry_point += 8 + left_shift_sign_extended(header->rom_entry_point & 0xFFFFFF, 24, 2);
+    }
+
+    cpu->pc = entry_point;
+    current_instruction = 0;
+    decoded_instruction = (Instruction){0};
+}
+
+
+//
+// Condition pass table
+//
+// One bit per value of the NZCV flags (N is bit 3 of the index, V bit 0) for each condition code, so
+// checking a condition is a single lookup. The reserved condition 0b1111 never passes.
+//
+static const u16 condition_pass_table[16] = {
+    [CONDITION_EQ] = 0xF0F0,    // Z
+    [CONDITION_NE] = 0x0F0F,    // !Z
+    [CONDITION_CS] = 0xCCCC,    // C
+    [CONDITION_CC] = 0x3333,    // !C
+    [CONDITION_MI] = 0xFF00,    // N
+    [CONDITION_PL] = 0x00FF,    // !N
+    [CONDITION_VS] = 0xAAAA,    // V
+    [CONDITION_VC] = 0x5555,    // !V
+    [CONDITION_HI] = 0x0C0C,    // C && !Z
+    [CONDITION_LS] = 0xF3F3,    // !C || Z
+    [CONDITION_GE] = 0xAA55,    // N == V
+    [CONDITION_LT] = 0x55AA,    // N != V
+    [CONDITION_GT] = 0x0A05,    // !Z && N == V
+    [CONDITION_LE] = 0xF5FA,    // Z || N != V
+    [CONDITION_AL] = 0xFFFF,    // Always
+};
+
+static int
+should_execute_instruction(Condition condition)
+{
+    if (condition == CONDITION_AL) return true;
+
+    materialize_flags(cpu);
+    return (condition_pass_table[condition & 0xF] >> (cpu->cpsr >> 28)) & 1;
+}
+
+
+void
+thumb_execute()
+{
+    DEBUG_PRINT("0x%08X: 0x%08X %s, cpsr = 0x%08X, cycles = %lld\n", decoded_instruction.address, decoded_instruction.encoding, get_instruction_type_string(decoded_instruction.type), cpu->cpsr, cpu->cycles);
+
+#ifdef THREADED_DISPATCH
+    // NOTE: Every slot defaults to the exit label, then the handled types override it.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init"
+    static void *handlers[INSTRUCTION_TYPE_COUNT] = {
+        [0 ... INSTRUCTION_TYPE_COUNT - 1] = &&exit_thumb_execute,
+        [INSTRUCTION_MOVE_SHIFTED_REGISTER]                  = &&thumb_move_shifted_register,
+        [INSTRUCTION_ADD_SUBTRACT]                           = &&thumb_add_subtract,
+        [INSTRUCTION_MOVE_COMPARE_ADD_SUBTRACT_IMMEDIATE]    = &&thumb_move_compare_add_subtract_immediate,
+        [INSTRUCTION_ALU_OPERATIONS]                         = &&thumb_alu_operations,
+        [INSTRUCTION_HI_REGISTER_OPERATIONS_BRANCH_EXCHANGE] = &&thumb_hi_register_operations_branch_exchange,
+        [INSTRUCTION_PC_RELATIVE_LOAD]                       = &&thumb_pc_relative_load,
+        [INSTRUCTION_LOAD_STORE_WITH_REGISTER_OFFSET]        = &&thumb_load_store_with_register_offset,
+        [INSTRUCTION_LOAD_STORE_SIGN_EXTENDED_BYTE_HALFWORD] = &&thumb_load_store_sign_extended_byte_halfword,
+        [INSTRUCTION_LOAD_STORE_WITH_IMMEDIATE_OFFSET]       = &&thumb_load_store_with_immediate_offset,
+        [INSTRUCTION_LOAD_STORE_HALFWORD]                    = &&thumb_load_store_halfword,
+        [INSTRUCTION_SP_RELATIVE_LOAD_STORE]                 = &&thumb_sp_relative_load_store,
+        [INSTRUCTION_LOAD_ADDRESS]                           = &&thumb_load_address,
+        [INSTRUCTION_ADD_OFFSET_TO_STACK_POINTER]            = &&thumb_add_offset_to_stack_pointer,
+        [INSTRUCTION_PUSH_POP_REGISTERS]                     = &&thumb_push_pop_registers,
+        [INSTRUCTION_MULTIPLE_LOAD_STORE]                    = &&thumb_multiple_load_store,
+        [INSTRUCTION_CONDITIONAL_BRANCH]                     = &&thumb_conditional_branch,
+        [INSTRUCTION_SOFTWARE_INTERRUPT]                     = &&thumb_software_interrupt,
+        [INSTRUCTION_UNCONDITIONAL_BRANCH]                   = &&thumb_unconditional_branch,
+        [INSTRUCTION_LONG_BRANCH_WITH_LINK]                  = &&thumb_long_branch_with_link,
+    };
+#pragma GCC diagnostic pop
+
+    goto *handlers[decoded_instruction.type];
+#endif
+
+    switch (decoded_instruction.type) {
+        case INSTRUCTION_MOVE_SHIFTED_REGISTER: HANDLER(thumb_move_shifted_register) {
+            u32 shift = decoded_instruction.offset;
+            u32 value = cpu->r[decoded_instruction.rs];
+            u32 *rd = &cpu->r[decoded_instruction.rd];
+            
+            switch (decoded_instruction.op) {
+                case THUMB_SHIFT_TYPE_LOGICAL_LEFT: { // LSL
+                    if (shift == 0) {
+                        *rd = value;
+                        set_flags_lazy(cpu, FLAGS_OPERATION_NZ, 0, 0, *rd, 0);
+                    } else {
+                        *rd = value << shift;
+                        set_flags_lazy(cpu, FLAGS_OPERATION_LOGICAL, 0, 0, *rd, (value >> (32 - shift)) & 1);
+                    }
+                } break;
+
+                case THUMB_SHIFT_TYPE_LOGICAL_RIGHT: { // LSR
+                    u8 carry;
+                    if (shift == 0) {
+                        carry = (value >> 31) & 1;
+                        *rd = 0;
+                    } else {
+                        carry = (value >> (shift - 1)) & 1;
+                        *rd = value >> shift;
+                    }
+                    
+                    set_flags_lazy(cpu, FLAGS_OPERATION_LOGICAL, 0, 0, *rd, carry);
+                } break;
+
+                case THUMB_SHIFT_TYPE_ARITHMETIC_RIGHT: { // ASR
+                    u8 carry;
+                    if (shift == 0) {
+                        u8 msb = (value >> 31) & 1;
+                        carry = msb;
+
+                        if (msb == 0) {
+                            *rd = 0;
+                        } else {
+                            *rd = 0xFFFFFFFF;
+                        }
+                    } else {
+                        carry = (value >> (shift - 1)) & 1;
+
+                        u8 msb = (value >> 31) & 1;
+                        u32 msb_replicated = (-msb << (32 - shift));
+                        *rd = (value >> shift) | msb_replicated;
+                    }
+
+                    set_flags_lazy(cpu, FLAGS_OPERATION_LOGICAL, 0, 0, *rd, carry);
+                } break;
+            }
+
+            cpu->cycles++;
+        } break;
+        case INSTRUCTION_ADD_SUBTRACT: HANDLER(thumb_add_subtract) {
+            u32 first_value = cpu->r[decoded_instruction.rs];
+            u32 second_value = (decoded_instruction.I) ? decoded_instruction.rn : cpu->r[decoded_instruction.rn];
+            u32 result = 0;
+
+            u32 *rd = &cpu->r[decoded_instruction.rd];
+
+            if (decoded_instruction.op) { // SUB
+                result = first_value - second_value;
+                set_flags_lazy(cpu, FLAGS_OPERATION_SUB, first_value, second_value, result, 0);
+            } else { // ADD
+                result = first_value + second_value;
+                set_flags_lazy(cpu, FLAGS_OPERATION_ADD, first_value, second_value, result, 0);
+            }
+
+            *rd = result;
+
+            cpu->cycles++;
+        } break;
+        case INSTRUCTION_MOVE_COMPARE_ADD_SUBTRACT_IMMEDIATE: HANDLER(thumb_move_compare_add_subtract_immediate) {
+            u32 result = 0;
+            u32 *rd = &cpu->r[decoded_instruction.rd];
+
+            switch (decoded_instruction.op) {
                 case 0: { // MOV
                     result = decoded_instruction.offset;
                     *rd = result;
+
+                    set_flags_lazy(cpu, FLAGS_OPERATION_NZ, 0, 0, result, 0);
                 } break;
                 case 1: { // CMP
                     result = *rd - decoded_instruction.offset;
 
-                    set_condition_C((u32)decoded_instruction.offset <= *rd ? 1 : 0);
-                    set_overflow_subtract(*rd, decoded_instruction.offset, result);
+                    set_flags_lazy(cpu, FLAGS_OPERATION_SUB, *rd, decoded_instruction.offset, result, 0);
                 } break;
                 case 2: { // ADD
                     result = *rd + decoded_instruction.offset;
 
-                    set_condition_C((result < (u32)decoded_instruction.offset) ? 1 : 0);
-                    set_overflow_addition(*rd, decoded_instruction.offset, result);
+                    set_flags_lazy(cpu, FLAGS_OPERATION_ADD, *rd, decoded_instruction.offset, result, 0);
                     
                     *rd = result;
                 } break;
                 case 3: { // SUB
                     result = *rd - decoded_instruction.offset;
 
-                    set_condition_C((u32)decoded_instruction.offset <= *rd ? 1 : 0);
-                    set_overflow_subtract(*rd, decoded_instruction.offset, result);
+                    set_flags_lazy(cpu, FLAGS_OPERATION_SUB, *rd, decoded_instruction.offset, result, 0);
                     
                     *rd = result;
                 } break;
             }
 
-            set_condition_Z(result == 0);
-            set_condition_N((result >> 31) & 1);
-
             cpu->cycles++;
         } break;
-        case INSTRUCTION_ALU_OPERATIONS: {
-            u32 *rd = get_register(cpu, decoded_instruction.rd);
-            u32 *rs = get_register(cpu, decoded_instruction.rs);
+        case INSTRUCTION_ALU_OPERATIONS: HANDLER(thumb_alu_operations) {
+            u32 *rd = &cpu->r[decoded_instruction.rd];
+            u32 *rs = &cpu->r[decoded_instruction.rs];
 
             u32 result = 0;
             int store_result = false;
 
+            // Flags of the result, recorded lazily after the operation
+            FlagsOperation flags_operation = FLAGS_OPERATION_NZ;
+            u8 carry = 0;
+
             switch (decoded_instruction.op) {
                 case 0: { // AND
                     result = *rd & *rs;
@@ -520,15 +1442,18 @@ thumb_execute()
                     if (rs_value == 0) {
                         store_result = false;
                     } else if (rs_value < 32) {
-                        set_condition_C((*rd >> (32 - rs_value)) & 1);
+                        carry = (*rd >> (32 - rs_value)) & 1;
+                        flags_operation = FLAGS_OPERATION_LOGICAL;
                         result = *rd << *rs;
                         store_result = true;
                     } else if (rs_value == 32) {
-                        set_condition_C(*rd & 1);
+                        carry = *rd & 1;
+                        flags_operation = FLAGS_OPERATION_LOGICAL;
                         result = 0;
                         store_result = true;
                     } else {
-                        set_condition_C(0);
+                        carry = 0;
+                        flags_operation = FLAGS_OPERATION_LOGICAL;
                         result = 0;
                         store_result = true;
                     }
@@ -539,15 +1464,18 @@ thumb_execute()
                     if (rs_value == 0) {
                         store_result = false;
                     } else if (rs_value < 32) {
-                        set_condition_C((*rd >> (rs_value - 1)) & 1);
+                        carry = (*rd >> (rs_value - 1)) & 1;
+                        flags_operation = FLAGS_OPERATION_LOGICAL;
                         result = *rd >> rs_value;
                         store_result = true;
                     } else if (rs_value == 32) {
-                        set_condition_C((*rd >> 31) & 1);
+                        carry = (*rd >> 31) & 1;
+                        flags_operation = FLAGS_OPERATION_LOGICAL;
                         result = 0;
                         store_result = true;
                     } else {
-                        set_condition_C(0);
+                        carry = 0;
+                        flags_operation = FLAGS_OPERATION_LOGICAL;
                         result = 0;
                         store_result = true;
                     }
@@ -558,7 +1486,8 @@ thumb_execute()
                     if (rs_value == 0) {
                         store_result = false;
                     } else if (rs_value < 32) {
-                        set_condition_C((*rd >> (rs_value - 1)) & 1);
+                        carry = (*rd >> (rs_value - 1)) & 1;
+                        flags_operation = FLAGS_OPERATION_LOGICAL;
 
                         u8 msb = (*rd >> 31) & 1;
                         u32 msb_replicated = (-msb << (32 - rs_value));
@@ -567,7 +1496,8 @@ thumb_execute()
                         store_result = true;
                     } else {
                         u8 sign = (*rd >> 31) & 1;
-                        set_condition_C(sign);
+                        carry = sign;
+                        flags_operation = FLAGS_OPERATION_LOGICAL;
                         if (sign == 0) {
                             result = 0;
                         } else {
@@ -599,10 +1529,12 @@ thumb_execute()
                     if (rs_value == 0) {
                         store_result = false;
                     } else if ((rs_value & 0xF) == 0) {
-                        set_condition_C((*rd >> 31) & 1);
+                        carry = (*rd >> 31) & 1;
+                        flags_operation = FLAGS_OPERATION_LOGICAL;
                         store_result = false;
                     } else {
-                        set_condition_C((*rd >> ((rs_value & 0xF) - 1)) & 1);
+                        carry = (*rd >> ((rs_value & 0xF) - 1)) & 1;
+                        flags_operation = FLAGS_OPERATION_LOGICAL;
 
                         u8 shift = rs_value & 0xF;
                         u32 value_to_rotate = *rd & ((1 << shift) - 1);
@@ -630,16 +1562,14 @@ thumb_execute()
                     result = *rd - *rs;
                     store_result = false;
 
-                    set_condition_C((result <= *rd) ? 1 : 0);
-                    set_overflow_subtract(*rd, *rs, result);
+                    flags_operation = FLAGS_OPERATION_SUB;
                     cpu->cycles++;
                 } break;
                 case 11: { // CMN
                     result = *rd + *rs;
                     store_result = false;
 
-                    set_condition_C((result < *rd) ? 1 : 0);
-                    set_overflow_addition(*rd, *rs, result);
+                    flags_operation = FLAGS_OPERATION_ADD;
                     cpu->cycles++;
                 } break;
                 case 12: { // ORR
@@ -664,15 +1594,14 @@ thumb_execute()
                 } break;
             }
 
+            set_flags_lazy(cpu, flags_operation, *rd, *rs, result, carry);
+
             if (store_result) {
                 *rd = result;
             }
-            
-            set_condition_N((result >> 31) & 1);
-            set_condition_Z(result == 0);
 
         } break;
-        case INSTRUCTION_HI_REGISTER_OPERATIONS_BRANCH_EXCHANGE: {
+        case INSTRUCTION_HI_REGISTER_OPERATIONS_BRANCH_EXCHANGE: HANDLER(thumb_hi_register_operations_branch_exchange) {
             // H1 and H2 are flags to use the register as a Hi register (in the range of 8-15).
             // H1 for rd; H2 for rs.
             u8 H1 = decoded_instruction.H1;
@@ -687,8 +1616,8 @@ thumb_execute()
             u8 rs_n = decoded_instruction.rs + (H2 * 8);
             u8 rd_n = decoded_instruction.rd + (H1 * 8);
 
-            u32 *rs = get_register(cpu, rs_n);
-            u32 *rd = get_register(cpu, rd_n);
+            u32 *rs = &cpu->r[rs_n];
+            u32 *rd = &cpu->r[rd_n];
 
             u32 result = 0;
 
@@ -728,36 +1657,31 @@ thumb_execute()
                 } break;
             }
         } break;
-        case INSTRUCTION_PC_RELATIVE_LOAD: {
+        case INSTRUCTION_PC_RELATIVE_LOAD: HANDLER(thumb_pc_relative_load) {
             assert(decoded_instruction.rd != 15);
             u32 base = (cpu->pc & -4) + (decoded_instruction.offset << 2);
-            u32 *address = (u32 *)get_memory_at(cpu, &memory, base);
-            if (address != 0) *get_register(cpu, decoded_instruction.rd) = *address;
+            cpu->r[decoded_instruction.rd] = bus_read32(base);
 
             cpu->cycles += 3;
         } break;
-        case INSTRUCTION_LOAD_STORE_WITH_REGISTER_OFFSET: {
-            u32 base = *get_register(cpu, decoded_instruction.rb) + *get_register(cpu, decoded_instruction.rm);
-            if (base > *get_register(cpu, decoded_instruction.rb)) {
+        case INSTRUCTION_LOAD_STORE_WITH_REGISTER_OFFSET: HANDLER(thumb_load_store_with_register_offset) {
+            u32 base = cpu->r[decoded_instruction.rb] + cpu->r[decoded_instruction.rm];
+            if (base > cpu->r[decoded_instruction.rb]) {
                 // If the result overflow do not execute the instruction.
 
                 if (decoded_instruction.L) {
                     if (decoded_instruction.B) { // LDRB
-                        u8 *address = get_memory_at(cpu, &memory, base);
-                        if (address != 0) *get_register(cpu, decoded_instruction.rd) = (u32)*address;
+                        cpu->r[decoded_instruction.rd] = (u32)bus_read8(base);
                     } else { // LDR
                         assert((base & 0b11) == 0);
-                        u32 *address = (u32 *)get_memory_at(cpu, &memory, base);
-                        if (address != 0) *get_register(cpu, decoded_instruction.rd) = *address;
+                        cpu->r[decoded_instruction.rd] = bus_read32(base);
                     }
                 } else {
                     if (decoded_instruction.B) { // STRB
-                        u8 *address = get_memory_at(cpu, &memory, base);
-                        if (address != 0) *address = (u8)*get_register(cpu, decoded_instruction.rd);
+                        bus_write8(base, (u8)cpu->r[decoded_instruction.rd]);
                     } else { // STR
                         assert((base & 0b11) == 0);
-                        u32 *address = (u32 *)get_memory_at(cpu, &memory, base);
-                        if (address != 0) *address = *get_register(cpu, decoded_instruction.rd);
+                        bus_write32(base, cpu->r[decoded_instruction.rd]);
                     }
                 }
             }
@@ -768,61 +1692,51 @@ thumb_execute()
                 cpu->cycles += 2;
             }
         } break;
-        case INSTRUCTION_LOAD_STORE_SIGN_EXTENDED_BYTE_HALFWORD: {
-            u32 base = *get_register(cpu, decoded_instruction.rb) + *get_register(cpu, decoded_instruction.rm);
+        case INSTRUCTION_LOAD_STORE_SIGN_EXTENDED_BYTE_HALFWORD: HANDLER(thumb_load_store_sign_extended_byte_halfword) {
+            u32 base = cpu->r[decoded_instruction.rb] + cpu->r[decoded_instruction.rm];
             assert((base & 1) == 0);
 
-            u32 *rd = get_register(cpu, decoded_instruction.rd);
+            u32 *rd = &cpu->r[decoded_instruction.rd];
 
             u8 S = decoded_instruction.S;
             u8 H = decoded_instruction.H;
 
             if (S == 0 && H == 0) { // STRH
                 assert((base & 1) == 0);
-                u16 *address = (u16 *)get_memory_at(cpu, &memory, base);
-                if (address != 0) *address = (u16)*rd;
+                bus_write16(base, (u16)*rd);
 
                 cpu->cycles += 2;
             } else if (S == 0 && H == 1) { // LDRH
                 assert((base & 1) == 0);
-                u16 *address = (u16 *)get_memory_at(cpu, &memory, base);
-                if (address != 0) *rd = *address;
+                *rd = bus_read16(base);
 
                 cpu->cycles += 3;
             } else if (S == 1 && H == 0) { // LDRSB
-                u8 *address = get_memory_at(cpu, &memory, base);
-                if (address != 0) *rd = sign_extend(*address, 8);
+                *rd = sign_extend(bus_read8(base), 8);
                 
                 cpu->cycles += 3;
             } else { // LDRSH
                 assert((base & 1) == 0);
-                u16 *address = (u16 *)get_memory_at(cpu, &memory, base);
-                if (address != 0) *rd = sign_extend(*address, 16);
+                *rd = sign_extend(bus_read16(base), 16);
                 
                 cpu->cycles += 3;
             }
         } break;
-        case INSTRUCTION_LOAD_STORE_WITH_IMMEDIATE_OFFSET: {
+        case INSTRUCTION_LOAD_STORE_WITH_IMMEDIATE_OFFSET: HANDLER(thumb_load_store_with_immediate_offset) {
             if (decoded_instruction.B) {
-                u32 base = *get_register(cpu, decoded_instruction.rb) + (decoded_instruction.offset); // For Byte quantity does not multiply the offset.
-                u8 *address = get_memory_at(cpu, &memory, base);
-                if (address != 0) {
-                    if (decoded_instruction.L) { // LDRB
-                        *get_register(cpu, decoded_instruction.rd) = (u32)*address;
-                    } else { // STRB
-                        *address = (u8)*get_register(cpu, decoded_instruction.rd);
-                    }
+                u32 base = cpu->r[decoded_instruction.rb] + (decoded_instruction.offset); // For Byte quantity does not multiply the offset.
+                if (decoded_instruction.L) { // LDRB
+                    cpu->r[decoded_instruction.rd] = (u32)bus_read8(base);
+                } else { // STRB
+                    bus_write8(base, (u8)cpu->r[decoded_instruction.rd]);
                 }
             } else {
-                u32 base = *get_register(cpu, decoded_instruction.rb) + (decoded_instruction.offset << 2);
+                u32 base = cpu->r[decoded_instruction.rb] + (decoded_instruction.offset << 2);
                 assert((base & 0b11) == 0);
-                u32 *address = (u32 *)get_memory_at(cpu, &memory, base);
-                if (address != 0) {
-                    if (decoded_instruction.L) { // LDR
-                        *get_register(cpu, decoded_instruction.rd) = *address;
-                    } else { // STR
-                        *address = *get_register(cpu, decoded_instruction.rd);
-                    }
+                if (decoded_instruction.L) { // LDR
+                    cpu->r[decoded_instruction.rd] = bus_read32(base);
+                } else { // STR
+                    bus_write32(base, cpu->r[decoded_instruction.rd]);
                 }
             }
 
@@ -832,16 +1746,13 @@ thumb_execute()
                 cpu->cycles += 2;
             }
         } break;
-        case INSTRUCTION_LOAD_STORE_HALFWORD: {
-            u32 base = *get_register(cpu, decoded_instruction.rb) + (decoded_instruction.offset << 1);
+        case INSTRUCTION_LOAD_STORE_HALFWORD: HANDLER(thumb_load_store_halfword) {
+            u32 base = cpu->r[decoded_instruction.rb] + (decoded_instruction.offset << 1);
             assert((base & 1) == 0);
-            u16 *address = (u16 *)get_memory_at(cpu, &memory, base);
-            if (address != 0) {
-                if (decoded_instruction.L) { // LDRH
-                    *get_register(cpu, decoded_instruction.rd) = (u32)*address; // Cast to u32 to fill high bits with 0.
-                } else { // STRH
-                    *address = (u16)*get_register(cpu, decoded_instruction.rd);
-                }
+            if (decoded_instruction.L) { // LDRH
+                cpu->r[decoded_instruction.rd] = (u32)bus_read16(base); // Cast to u32 to fill high bits with 0.
+            } else { // STRH
+                bus_write16(base, (u16)cpu->r[decoded_instruction.rd]);
             }
             
             if (decoded_instruction.L) {
@@ -850,17 +1761,14 @@ thumb_execute()
                 cpu->cycles += 2;
             }
         } break;
-        case INSTRUCTION_SP_RELATIVE_LOAD_STORE: {
+        case INSTRUCTION_SP_RELATIVE_LOAD_STORE: HANDLER(thumb_sp_relative_load_store) {
             u32 base = cpu->sp + (decoded_instruction.offset << 2);
             assert((base & 0b11) == 0);
             
-            u32 *address = (u32 *)get_memory_at(cpu, &memory, base);
-            if (address != 0) {
-                if (decoded_instruction.L) { // LDR
-                    *get_register(cpu, decoded_instruction.rd) = *address;
-                } else { // STR
-                    *address = *get_register(cpu, decoded_instruction.rd);
-                }
+            if (decoded_instruction.L) { // LDR
+                cpu->r[decoded_instruction.rd] = bus_read32(base);
+            } else { // STR
+                bus_write32(base, cpu->r[decoded_instruction.rd]);
             }
             
             if (decoded_instruction.L) {
@@ -869,19 +1777,19 @@ thumb_execute()
                 cpu->cycles += 2;
             }
         } break;
-        case INSTRUCTION_LOAD_ADDRESS: {
+        case INSTRUCTION_LOAD_ADDRESS: HANDLER(thumb_load_address) {
             assert(decoded_instruction.rd != 15);
             if (decoded_instruction.S) {
                 // SP
-                *get_register(cpu, decoded_instruction.rd) = cpu->sp + (decoded_instruction.value_8 << 2);
+                cpu->r[decoded_instruction.rd] = cpu->sp + (decoded_instruction.value_8 << 2);
             } else {
                 // PC
-                *get_register(cpu, decoded_instruction.rd) = (cpu->pc & 0xFFFFFFFC) + (decoded_instruction.value_8 << 2);
+                cpu->r[decoded_instruction.rd] = (cpu->pc & 0xFFFFFFFC) + (decoded_instruction.value_8 << 2);
             }
 
             cpu->cycles++;
         } break;
-        case INSTRUCTION_ADD_OFFSET_TO_STACK_POINTER: {
+        case INSTRUCTION_ADD_OFFSET_TO_STACK_POINTER: HANDLER(thumb_add_offset_to_stack_pointer) {
             s8 sign = decoded_instruction.S ? -1 : 1;
             int offset = sign * (decoded_instruction.offset << 2);
 
@@ -889,7 +1797,7 @@ thumb_execute()
 
             cpu->cycles++;
         } break;
-        case INSTRUCTION_PUSH_POP_REGISTERS: {
+        case INSTRUCTION_PUSH_POP_REGISTERS: HANDLER(thumb_push_pop_registers) {
             u8 register_list = (u8)decoded_instruction.register_list;
             // assert(register_list != 0);
             if (register_list == 0) {
@@ -907,8 +1815,7 @@ thumb_execute()
                     if (register_index_set) {
                         registers_set++;
 
-                        u32 *address = (u32 *)get_memory_at(cpu, &memory, sp);
-                        if (address != 0) *get_register(cpu, (u8)register_index) = *address;
+                        cpu->r[(u8)register_index] = bus_read32(sp);
 
                         sp += 4;
                     }
@@ -920,12 +1827,9 @@ thumb_execute()
                 if (decoded_instruction.R) {
                     registers_set += 2;
 
-                    u32 *address = (u32 *)get_memory_at(cpu, &memory, sp);
-                    if (address != 0) {
-                        cpu->pc = *address & 0xFFFFFFFE;
-                        current_instruction = 0;
-                        sp += 4;
-                    }
+                    cpu->pc = bus_read32(sp) & 0xFFFFFFFE;
+                    current_instruction = 0;
+                    sp += 4;
                 }
                 
                 cpu->sp = sp;
@@ -939,8 +1843,7 @@ thumb_execute()
 
                     sp -= 4;
 
-                    u32 *address = (u32 *)get_memory_at(cpu, &memory, sp);
-                    if (address != 0) *address = *get_register(cpu, (u8)14); // LR register
+                    bus_write32(sp, cpu->r[(u8)14]); // LR register
                 }
 
                 while (register_list) {
@@ -950,8 +1853,7 @@ thumb_execute()
 
                         sp -= 4;
                         
-                        u32 *address = (u32 *)get_memory_at(cpu, &memory, sp);
-                        if (address != 0) *address = *get_register(cpu, (u8)register_index);
+                        bus_write32(sp, cpu->r[(u8)register_index]);
                     }
 
                     register_index--;
@@ -963,10 +1865,10 @@ thumb_execute()
                 cpu->cycles += registers_set + 1;
             }
         } break;
-        case INSTRUCTION_MULTIPLE_LOAD_STORE: {
+        case INSTRUCTION_MULTIPLE_LOAD_STORE: HANDLER(thumb_multiple_load_store) {
             u8 fixed_cycles = (decoded_instruction.L) ? 2 : 1;
 
-            u32 *rb = get_register(cpu, decoded_instruction.rb);
+            u32 *rb = &cpu->r[decoded_instruction.rb];
             u32 base = *rb;
             u16 register_list = decoded_instruction.register_list;
             assert(register_list != 0);
@@ -978,19 +1880,15 @@ thumb_execute()
                 if (register_index_set) {
                     registers_set++;
 
-                    u32 *address = (u32 *)get_memory_at(cpu, &memory, base);
-
-                    if (address != 0) {
-                        if (decoded_instruction.L) {
-                            // LDMIA
-                            *get_register(cpu, (u8)register_index) = *address;
-                        } else {
-                            // STMIA
-                            *address = *get_register(cpu, (u8)register_index);
-                        }
-    
-                        base += 4;
+                    if (decoded_instruction.L) {
+                        // LDMIA
+                        cpu->r[(u8)register_index] = bus_read32(base);
+                    } else {
+                        // STMIA
+                        bus_write32(base, cpu->r[(u8)register_index]);
                     }
+
+                    base += 4;
                 }
 
                 register_index++;
@@ -1001,7 +1899,7 @@ thumb_execute()
 
             cpu->cycles += registers_set + fixed_cycles;
         } break;
-        case INSTRUCTION_CONDITIONAL_BRANCH: {
+        case INSTRUCTION_CONDITIONAL_BRANCH: HANDLER(thumb_conditional_branch) {
             Condition condition = (Condition)decoded_instruction.condition;
             int should_execute = should_execute_instruction(condition);
 
@@ -1015,11 +1913,17 @@ thumb_execute()
                 cpu->cycles++;
             }
         } break;
-        case INSTRUCTION_SOFTWARE_INTERRUPT: {
-            cpu->r14_svc = decoded_instruction.address + 2; // Next instruction
+        case INSTRUCTION_SOFTWARE_INTERRUPT: HANDLER(thumb_software_interrupt) {
+            if (use_hle_bios && hle_bios_call(cpu, &memory, &block_cache, decoded_instruction.value_8)) {
+                cpu->cycles += 3;
+                break;
+            }
+
+            materialize_flags(cpu);
             cpu->spsr_svc = cpu->cpsr;
 
             set_mode(MODE_SUPERVISOR);
+            cpu->lr = decoded_instruction.address + 2; // Next instruction
             set_control_bit_T(0); // Execute in ARM state
             set_control_bit_I(1); // Disable normal interrupts
 
@@ -1028,14 +1932,14 @@ thumb_execute()
 
             cpu->cycles += 3;
         } break;
-        case INSTRUCTION_UNCONDITIONAL_BRANCH: {
+        case INSTRUCTION_UNCONDITIONAL_BRANCH: HANDLER(thumb_unconditional_branch) {
             u32 offset = left_shift_sign_extended(decoded_instruction.offset, 11, 1);
             cpu->pc += offset;
             current_instruction = 0;
 
             cpu->cycles += 3;
         } break;
-        case INSTRUCTION_LONG_BRANCH_WITH_LINK: {
+        case INSTRUCTION_LONG_BRANCH_WITH_LINK: HANDLER(thumb_long_branch_with_link) {
             if (decoded_instruction.H == 0) {
                 // First part of the instruction
                 u32 offset = left_shift_sign_extended(decoded_instruction.offset, 11, 12);
@@ -1052,1799 +1956,2468 @@ thumb_execute()
                 cpu->cycles += 3;
             }
 
-        } break;
+        } break;
+
+        default: break;
+    }
+
+exit_thumb_execute:
+    decoded_instruction = (Instruction){0};
+}
+
+//
+// Thumb decoding
+//
+// All Thumb formats are identified by the top 8 bits of the halfword, so they index a 256-entry table
+// with the decoder (operand layout) of each format. The table is built once at startup from the
+// THUMB_INSTRUCTION_FORMAT_* definitions.
+//
+typedef Instruction (*ThumbDecodeFunction)(u16 instruction);
+
+#define THUMB_DECODE_TABLE_SIZE         (256)
+#define THUMB_DECODE_INDEX(instruction) (((instruction) >> 8) & 0xFF)
+
+static ThumbDecodeFunction thumb_decode_table[THUMB_DECODE_TABLE_SIZE];
+
+static Instruction
+decode_thumb_long_branch_with_link(u16 instruction)
+{
+    return (Instruction) {
+        .type = INSTRUCTION_LONG_BRANCH_WITH_LINK,
+        .H = (instruction >> 11) & 1,
+        .offset = instruction & 0x7FF,
+    };
+}
+
+static Instruction
+decode_thumb_unconditional_branch(u16 instruction)
+{
+    return (Instruction) {
+        .type = INSTRUCTION_UNCONDITIONAL_BRANCH,
+        .offset = instruction & 0x7FF,
+    };
+}
+
+static Instruction
+decode_thumb_software_interrupt(u16 instruction)
+{
+    return (Instruction) {
+        .type = INSTRUCTION_SOFTWARE_INTERRUPT,
+        .value_8 = instruction & 0xFF,
+    };
+}
+
+static Instruction
+decode_thumb_conditional_branch(u16 instruction)
+{
+    Instruction result = (Instruction) {
+        .type = INSTRUCTION_CONDITIONAL_BRANCH,
+        .offset = instruction & 0xFF,
+        .condition = (instruction >> 8) & 0xF,
+    };
+
+    assert(result.condition != 0b1110);
+
+    return result;
+}
+
+static Instruction
+decode_thumb_multiple_load_store(u16 instruction)
+{
+    return (Instruction) {
+        .type = INSTRUCTION_MULTIPLE_LOAD_STORE,
+        .register_list = instruction & 0xFF,
+        .rb = (instruction >> 8) & 7,
+        .L = (instruction >> 11) & 1,
+    };
+}
+
+static Instruction
+decode_thumb_push_pop_registers(u16 instruction)
+{
+    return (Instruction) {
+        .type = INSTRUCTION_PUSH_POP_REGISTERS,
+        .register_list = instruction & 0xFF,
+        .R = (instruction >> 8) & 1,
+        .L = (instruction >> 11) & 1,
+    };
+}
+
+static Instruction
+decode_thumb_add_offset_to_stack_pointer(u16 instruction)
+{
+    return (Instruction) {
+        .type = INSTRUCTION_ADD_OFFSET_TO_STACK_POINTER,
+        .offset = instruction & 0x7F,
+        .S = (instruction >> 7) & 1,
+    };
+}
+
+static Instruction
+decode_thumb_load_address(u16 instruction)
+{
+    return (Instruction) {
+        .type = INSTRUCTION_LOAD_ADDRESS,
+        .value_8 = instruction & 0xFF,
+        .rd = (instruction >> 8) & 7,
+        .S = (instruction >> 11) & 1,
+    };
+}
+
+static Instruction
+decode_thumb_sp_relative_load_store(u16 instruction)
+{
+    return (Instruction) {
+        .type = INSTRUCTION_SP_RELATIVE_LOAD_STORE,
+        .offset = instruction & 0xFF,
+        .rd = (instruction >> 8) & 7,
+        .L = (instruction >> 11) & 1,
+    };
+}
+
+static Instruction
+decode_thumb_load_store_halfword(u16 instruction)
+{
+    return (Instruction) {
+        .type = INSTRUCTION_LOAD_STORE_HALFWORD,
+        .rd = (instruction >> 0) & 7,
+        .rb = (instruction >> 3) & 7,
+        .offset = (instruction >> 6) & 0x1F,
+        .L = (instruction >> 11) & 1,
+    };
+}
+
+static Instruction
+decode_thumb_load_store_with_immediate_offset(u16 instruction)
+{
+    return (Instruction) {
+        .type = INSTRUCTION_LOAD_STORE_WITH_IMMEDIATE_OFFSET,
+        .rd = (instruction >> 0) & 7,
+        .rb = (instruction >> 3) & 7,
+        .offset = (instruction >> 6) & 0x1F,
+        .L = (instruction >> 11) & 1,
+        .B = (instruction >> 12) & 1,
+    };
+}
+
+static Instruction
+decode_thumb_load_store_sign_extended_byte_halfword(u16 instruction)
+{
+    return (Instruction) {
+        .type = INSTRUCTION_LOAD_STORE_SIGN_EXTENDED_BYTE_HALFWORD,
+        .rd = (instruction >> 0) & 7,
+        .rb = (instruction >> 3) & 7,
+        .rm = (instruction >> 6) & 7,
+        .S = (instruction >> 10) & 1,
+        .H = (instruction >> 11) & 1,
+    };
+}
+
+static Instruction
+decode_thumb_load_store_with_register_offset(u16 instruction)
+{
+    return (Instruction) {
+        .type = INSTRUCTION_LOAD_STORE_WITH_REGISTER_OFFSET,
+        .rd = (instruction >> 0) & 7,
+        .rb = (instruction >> 3) & 7,
+        .rm = (instruction >> 6) & 7,
+        .B = (instruction >> 10) & 1,
+        .L = (instruction >> 11) & 1,
+    };
+}
+
+static Instruction
+decode_thumb_pc_relative_load(u16 instruction)
+{
+    return (Instruction) {
+        .type = INSTRUCTION_PC_RELATIVE_LOAD,
+        .offset = instruction & 0xFF,
+        .rd = (instruction >> 8) & 7,
+    };
+}
+
+static Instruction
+decode_thumb_hi_register_operations_branch_exchange(u16 instruction)
+{
+    return (Instruction) {
+        .type = INSTRUCTION_HI_REGISTER_OPERATIONS_BRANCH_EXCHANGE,
+        .rd = (instruction >> 0) & 7,
+        .rs = (instruction >> 3) & 7,
+        .H2 = (instruction >> 6) & 1,
+        .H1 = (instruction >> 7) & 1,
+        .op = (instruction >> 8) & 0b11,
+    };
+}
+
+static Instruction
+decode_thumb_alu_operations(u16 instruction)
+{
+    return (Instruction) {
+        .type = INSTRUCTION_ALU_OPERATIONS,
+        .rd = (instruction >> 0) & 7,
+        .rs = (instruction >> 3) & 7,
+        .op = (instruction >> 6) & 0xF,
+    };
+}
+
+static Instruction
+decode_thumb_move_compare_add_subtract_immediate(u16 instruction)
+{
+    return (Instruction) {
+        .type = INSTRUCTION_MOVE_COMPARE_ADD_SUBTRACT_IMMEDIATE,
+        .offset = instruction & 0xFF,
+        .rd = (instruction >> 8) & 7,
+        .op = (instruction >> 11) & 0b11,
+    };
+}
+
+static Instruction
+decode_thumb_add_subtract(u16 instruction)
+{
+    return (Instruction) {
+        .type = INSTRUCTION_ADD_SUBTRACT,
+        .rd = (instruction >> 0) & 7,
+        .rs = (instruction >> 3) & 7,
+        .rn = (instruction >> 6) & 7,
+        .op = (instruction >> 9) & 1,
+        .I = (instruction >> 10) & 1,
+    };
+}
+
+static Instruction
+decode_thumb_move_shifted_register(u16 instruction)
+{
+    return (Instruction) {
+        .type = INSTRUCTION_MOVE_SHIFTED_REGISTER,
+        .rd = (instruction >> 0) & 7,
+        .rs = (instruction >> 3) & 7,
+        .offset = (instruction >> 6) & 0x1F,
+        .op = (instruction >> 11) & 0b11,
+    };
+}
+
+static ThumbDecodeFunction
+get_thumb_decode_function(u16 instruction)
+{
+    if ((instruction & THUMB_INSTRUCTION_FORMAT_LONG_BRANCH_WITH_LINK) == THUMB_INSTRUCTION_FORMAT_LONG_BRANCH_WITH_LINK) {
+        return decode_thumb_long_branch_with_link;
+    }
+    if ((instruction & THUMB_INSTRUCTION_FORMAT_UNCONDITIONAL_BRANCH) == THUMB_INSTRUCTION_FORMAT_UNCONDITIONAL_BRANCH) {
+        return decode_thumb_unconditional_branch;
+    }
+    if ((instruction & THUMB_INSTRUCTION_FORMAT_SOFTWARE_INTERRUPT) == THUMB_INSTRUCTION_FORMAT_SOFTWARE_INTERRUPT) {
+        return decode_thumb_software_interrupt;
+    }
+    if ((instruction & THUMB_INSTRUCTION_FORMAT_CONDITIONAL_BRANCH) == THUMB_INSTRUCTION_FORMAT_CONDITIONAL_BRANCH) {
+        // NOTE: Condition 0b1111 is the software interrupt, already handled above.
+        return decode_thumb_conditional_branch;
+    }
+    if ((instruction & THUMB_INSTRUCTION_FORMAT_MULTIPLE_LOAD_STORE) == THUMB_INSTRUCTION_FORMAT_MULTIPLE_LOAD_STORE) {
+        return decode_thumb_multiple_load_store;
+    }
+    if ((instruction & THUMB_INSTRUCTION_FORMAT_PUSH_POP_REGISTERS) == THUMB_INSTRUCTION_FORMAT_PUSH_POP_REGISTERS) {
+        return decode_thumb_push_pop_registers;
+    }
+    if ((instruction & THUMB_INSTRUCTION_FORMAT_ADD_OFFSET_STACK_POINTER) == THUMB_INSTRUCTION_FORMAT_ADD_OFFSET_STACK_POINTER) {
+        return decode_thumb_add_offset_to_stack_pointer;
+    }
+    if ((instruction & THUMB_INSTRUCTION_FORMAT_LOAD_ADDRESS) == THUMB_INSTRUCTION_FORMAT_LOAD_ADDRESS) {
+        return decode_thumb_load_address;
+    }
+    if ((instruction & THUMB_INSTRUCTION_FORMAT_SP_RELATIVE_LOAD_STORE) == THUMB_INSTRUCTION_FORMAT_SP_RELATIVE_LOAD_STORE) {
+        return decode_thumb_sp_relative_load_store;
+    }
+    if ((instruction & THUMB_INSTRUCTION_FORMAT_LOAD_STORE_HALFWORD) == THUMB_INSTRUCTION_FORMAT_LOAD_STORE_HALFWORD) {
+        return decode_thumb_load_store_halfword;
+    }
+    if ((instruction & THUMB_INSTRUCTION_FORMAT_LOAD_STORE_WITH_IMMEDIATE_OFFSET) == THUMB_INSTRUCTION_FORMAT_LOAD_STORE_WITH_IMMEDIATE_OFFSET) {
+        return decode_thumb_load_store_with_immediate_offset;
+    }
+    if ((instruction & THUMB_INSTRUCTION_FORMAT_LOAD_STORE_SIGN_EXTENDED_BYTE_HALFWORD) == THUMB_INSTRUCTION_FORMAT_LOAD_STORE_SIGN_EXTENDED_BYTE_HALFWORD) {
+        return decode_thumb_load_store_sign_extended_byte_halfword;
+    }
+    if ((instruction & THUMB_INSTRUCTION_FORMAT_LOAD_STORE_WITH_REGISTER_OFFSET) == THUMB_INSTRUCTION_FORMAT_LOAD_STORE_WITH_REGISTER_OFFSET) {
+        return decode_thumb_load_store_with_register_offset;
+    }
+    if ((instruction & THUMB_INSTRUCTION_FORMAT_PC_RELATIVE_LOAD) == THUMB_INSTRUCTION_FORMAT_PC_RELATIVE_LOAD) {
+        return decode_thumb_pc_relative_load;
+    }
+    if ((instruction & THUMB_INSTRUCTION_FORMAT_HI_REGISTER_OPERATIONS_BRANCH_EXCHANGE) == THUMB_INSTRUCTION_FORMAT_HI_REGISTER_OPERATIONS_BRANCH_EXCHANGE) {
+        return decode_thumb_hi_register_operations_branch_exchange;
+    }
+    if ((instruction & THUMB_INSTRUCTION_FORMAT_ALU_OPERATIONS) == THUMB_INSTRUCTION_FORMAT_ALU_OPERATIONS) {
+        return decode_thumb_alu_operations;
+    }
+    if ((instruction & THUMB_INSTRUCTION_FORMAT_MOVE_COMPARE_ADD_SUBTRACT_IMMEDIATE) == THUMB_INSTRUCTION_FORMAT_MOVE_COMPARE_ADD_SUBTRACT_IMMEDIATE) {
+        return decode_thumb_move_compare_add_subtract_immediate;
+    }
+    if ((instruction & THUMB_INSTRUCTION_FORMAT_ADD_SUBTRACT) == THUMB_INSTRUCTION_FORMAT_ADD_SUBTRACT) {
+        return decode_thumb_add_subtract;
+    }
+
+    return decode_thumb_move_shifted_register;
+}
+
+void
+init_thumb_decode_table()
+{
+    for (u32 index = 0; index < THUMB_DECODE_TABLE_SIZE; ++index) {
+        u16 instruction = (u16)(index << 8);
+        thumb_decode_table[index] = get_thumb_decode_function(instruction);
+    }
+}
+
+static Instruction
+decode_thumb_instruction(u16 instruction, u32 address)
+{
+    Instruction result = thumb_decode_table[THUMB_DECODE_INDEX(instruction)](instruction);
+    result.address = address;
+    result.encoding = instruction;
+
+    return result;
+}
+
+void
+thumb_decode()
+{
+    if (current_instruction == 0) return;
+
+    decoded_instruction = decode_thumb_instruction((u16)current_instruction, cpu->pc - 2);
+}
+
+void
+thumb_fetch()
+{
+    current_instruction = bus_read16(cpu->pc);
+    cpu->pc += 2;
+}
+
+
+static void
+process_b()
+{
+    if (decoded_instruction.L) {
+        cpu->lr = cpu->pc - 4;
+        assert(cpu->pc - 4 == decoded_instruction.address + 4);
+    }
+
+    u32 offset = left_shift_sign_extended(decoded_instruction.offset, 24, 2);
+    cpu->pc += offset;
+
+    current_instruction = 0;
+
+    cpu->cycles += 3;
+}
+
+static void
+process_bx()
+{
+    cpu->pc = cpu->r[decoded_instruction.rn] & (-2); // NOTE: PC must be 16-bit align. This clears out the lsb (-2 is 0b1110).
+    current_instruction = 0;
+
+    u8 thumb_mode = cpu->r[decoded_instruction.rn] & 1;
+    set_control_bit_T(thumb_mode);
+
+    cpu->cycles += 3;
+}
+
+//
+// Data processing
+//
+// Every combination of opcode, second operand form and S bit has its own handler, generated by the
+// macros below. The decoder picks the handler once (see get_data_processing_handler()), so executing
+// the instruction does not check the operand form again.
+//
+typedef struct ShifterOperand {
+    u32 value;
+    u8 carry;
+    u8 carry_out;       // false if the shifter leaves the C flag untouched
+    u8 extra_cycles;
+} ShifterOperand;
+
+static ShifterOperand
+shift_operand_immediate(void)
+{
+    ShifterOperand result = {0};
+
+    u8 imm = decoded_instruction.second_operand & 0xFF;
+    u32 rotate = (decoded_instruction.second_operand >> 8) & 0xF;
+    // NOTE: This value is zero extended to 32 bits, and then subject to a rotate right by twice the value in the rotate field.
+    rotate *= 2;
+
+    result.value = rotate_right(imm, rotate, 32);
+    if (rotate != 0) {
+        result.carry = (result.value >> 31) & 1;
+        result.carry_out = true;
+    }
+
+    return result;
+}
+
+static ShifterOperand
+shift_operand_lsl_immediate(void)
+{
+    ShifterOperand result = {0};
+    u32 rm = cpu->r[decoded_instruction.second_operand & 0xF];
+    u8 shift_value = (decoded_instruction.second_operand >> 7) & 0b11111;
+
+    if (shift_value == 0) {
+        result.value = rm;
+    } else {
+        result.value = rm << shift_value;
+        result.carry = (rm >> (32 - shift_value)) & 1;
+        result.carry_out = true;
+    }
+
+    return result;
+}
+
+static ShifterOperand
+shift_operand_lsr_immediate(void)
+{
+    ShifterOperand result = {0};
+    u32 rm = cpu->r[decoded_instruction.second_operand & 0xF];
+    u8 shift_value = (decoded_instruction.second_operand >> 7) & 0b11111;
+
+    // NOTE: LSR #0 encodes LSR #32.
+    if (shift_value == 0) {
+        result.value = 0;
+        result.carry = (rm >> 31) & 1;
+    } else {
+        result.value = rm >> shift_value;
+        result.carry = (rm >> (shift_value - 1)) & 1;
+    }
+    result.carry_out = true;
+
+    return result;
+}
+
+static ShifterOperand
+shift_operand_asr_immediate(void)
+{
+    ShifterOperand result = {0};
+    u32 rm = cpu->r[decoded_instruction.second_operand & 0xF];
+    u8 shift_value = (decoded_instruction.second_operand >> 7) & 0b11111;
+
+    // NOTE: ASR #0 encodes ASR #32.
+    if (shift_value == 0) {
+        result.value = (((rm >> 31) & 1) == 0) ? 0 : 0xFFFFFFFF;
+        result.carry = (rm >> 31) & 1;
+    } else {
+        result.value = arithmetic_shift_right(rm, shift_value);
+        result.carry = (rm >> (shift_value - 1)) & 1;
     }
+    result.carry_out = true;
 
-exit_thumb_execute:
-    decoded_instruction = (Instruction){0};
+    return result;
 }
 
-void
-thumb_decode()
+static ShifterOperand
+shift_operand_ror_immediate(void)
 {
-    if (current_instruction == 0) return;
+    ShifterOperand result = {0};
+    u32 rm = cpu->r[decoded_instruction.second_operand & 0xF];
+    u8 shift_value = (decoded_instruction.second_operand >> 7) & 0b11111;
+
+    // NOTE: ROR #0 encodes RRX.
+    if (shift_value == 0) {
+        result.value = (CONDITION_C << 31) | (rm >> 1);
+        result.carry = rm & 1;
+    } else {
+        result.value = rotate_right(rm, shift_value, 32);
+        result.carry = (rm >> (shift_value - 1)) & 1;
+    }
+    result.carry_out = true;
 
-    if ((current_instruction & THUMB_INSTRUCTION_FORMAT_LONG_BRANCH_WITH_LINK) == THUMB_INSTRUCTION_FORMAT_LONG_BRANCH_WITH_LINK) {
-        decoded_instruction = (Instruction) {
-            .type = INSTRUCTION_LONG_BRANCH_WITH_LINK,
-            .H = (current_instruction >> 11) & 1,
-            .offset = current_instruction & 0x7FF,
-        };
-    }
-    else if ((current_instruction & THUMB_INSTRUCTION_FORMAT_UNCONDITIONAL_BRANCH) == THUMB_INSTRUCTION_FORMAT_UNCONDITIONAL_BRANCH) {
-        decoded_instruction = (Instruction) {
-            .type = INSTRUCTION_UNCONDITIONAL_BRANCH,
-            .offset = current_instruction & 0x7FF,
-        };
-    }
-    else if ((current_instruction & THUMB_INSTRUCTION_FORMAT_SOFTWARE_INTERRUPT) == THUMB_INSTRUCTION_FORMAT_SOFTWARE_INTERRUPT) {
-thumb_swi:
-        decoded_instruction = (Instruction) {
-            .type = INSTRUCTION_SOFTWARE_INTERRUPT,
-            .value_8 = current_instruction & 0xFF,
-        };
-    }
-    else if ((current_instruction & THUMB_INSTRUCTION_FORMAT_CONDITIONAL_BRANCH) == THUMB_INSTRUCTION_FORMAT_CONDITIONAL_BRANCH) {
-        decoded_instruction = (Instruction) {
-            .type = INSTRUCTION_CONDITIONAL_BRANCH,
-            .offset = current_instruction & 0xFF,
-            .condition = (current_instruction >> 8) & 0xF,
-        };
-
-        assert(decoded_instruction.condition != 0b1110);
-
-        if (decoded_instruction.condition == 0b1111) {
-            goto thumb_swi;
-        }
+    return result;
+}
+
+static ShifterOperand
+shift_operand_lsl_register(void)
+{
+    ShifterOperand result = {0};
+    u32 rm = cpu->r[decoded_instruction.second_operand & 0xF];
+    u8 shift_value = (u8)(cpu->r[(decoded_instruction.second_operand >> 8) & 0xF]);
+    result.extra_cycles = 1;
+
+    if (shift_value == 0) {
+        result.value = rm;
+        return result;
     }
-    else if ((current_instruction & THUMB_INSTRUCTION_FORMAT_MULTIPLE_LOAD_STORE) == THUMB_INSTRUCTION_FORMAT_MULTIPLE_LOAD_STORE) {
-        decoded_instruction = (Instruction) {
-            .type = INSTRUCTION_MULTIPLE_LOAD_STORE,
-            .register_list = current_instruction & 0xFF,
-            .rb = (current_instruction >> 8) & 7,
-            .L = (current_instruction >> 11) & 1,
-        };
-    }
-    else if ((current_instruction & THUMB_INSTRUCTION_FORMAT_PUSH_POP_REGISTERS) == THUMB_INSTRUCTION_FORMAT_PUSH_POP_REGISTERS) {
-        decoded_instruction = (Instruction) {
-            .type = INSTRUCTION_PUSH_POP_REGISTERS,
-            .register_list = current_instruction & 0xFF,
-            .R = (current_instruction >> 8) & 1,
-            .L = (current_instruction >> 11) & 1,
-        };
-    }
-    else if ((current_instruction & THUMB_INSTRUCTION_FORMAT_ADD_OFFSET_STACK_POINTER) == THUMB_INSTRUCTION_FORMAT_ADD_OFFSET_STACK_POINTER) {
-        decoded_instruction = (Instruction) {
-            .type = INSTRUCTION_ADD_OFFSET_TO_STACK_POINTER,
-            .offset = current_instruction & 0x7F,
-            .S = (current_instruction >> 7) & 1,
-        };
-    }
-    else if ((current_instruction & THUMB_INSTRUCTION_FORMAT_LOAD_ADDRESS) == THUMB_INSTRUCTION_FORMAT_LOAD_ADDRESS) {
-        decoded_instruction = (Instruction) {
-            .type = INSTRUCTION_LOAD_ADDRESS,
-            .value_8 = current_instruction & 0xFF,
-            .rd = (current_instruction >> 8) & 7,
-            .S = (current_instruction >> 11) & 1,
-        };
-    }
-    else if ((current_instruction & THUMB_INSTRUCTION_FORMAT_SP_RELATIVE_LOAD_STORE) == THUMB_INSTRUCTION_FORMAT_SP_RELATIVE_LOAD_STORE) {
-        decoded_instruction = (Instruction) {
-            .type = INSTRUCTION_SP_RELATIVE_LOAD_STORE,
-            .offset = current_instruction & 0xFF,
-            .rd = (current_instruction >> 8) & 7,
-            .L = (current_instruction >> 11) & 1,
-        };
-    }
-    else if ((current_instruction & THUMB_INSTRUCTION_FORMAT_LOAD_STORE_HALFWORD) == THUMB_INSTRUCTION_FORMAT_LOAD_STORE_HALFWORD) {
-        decoded_instruction = (Instruction) {
-            .type = INSTRUCTION_LOAD_STORE_HALFWORD,
-            .rd = (current_instruction >> 0) & 7,
-            .rb = (current_instruction >> 3) & 7,
-            .offset = (current_instruction >> 6) & 0x1F,
-            .L = (current_instruction >> 11) & 1,
-        };
-    }
-    else if ((current_instruction & THUMB_INSTRUCTION_FORMAT_LOAD_STORE_WITH_IMMEDIATE_OFFSET) == THUMB_INSTRUCTION_FORMAT_LOAD_STORE_WITH_IMMEDIATE_OFFSET) {
-        decoded_instruction = (Instruction) {
-            .type = INSTRUCTION_LOAD_STORE_WITH_IMMEDIATE_OFFSET,
-            .rd = (current_instruction >> 0) & 7,
-            .rb = (current_instruction >> 3) & 7,
-            .offset = (current_instruction >> 6) & 0x1F,
-            .L = (current_instruction >> 11) & 1,
-            .B = (current_instruction >> 12) & 1,
-        };
-    }
-    else if ((current_instruction & THUMB_INSTRUCTION_FORMAT_LOAD_STORE_SIGN_EXTENDED_BYTE_HALFWORD) == THUMB_INSTRUCTION_FORMAT_LOAD_STORE_SIGN_EXTENDED_BYTE_HALFWORD) {
-        decoded_instruction = (Instruction) {
-            .type = INSTRUCTION_LOAD_STORE_SIGN_EXTENDED_BYTE_HALFWORD,
-            .rd = (current_instruction >> 0) & 7,
-            .rb = (current_instruction >> 3) & 7,
-            .rm = (current_instruction >> 6) & 7,
-            .S = (current_instruction >> 10) & 1,
-            .H = (current_instruction >> 11) & 1,
-        };
-    }
-    else if ((current_instruction & THUMB_INSTRUCTION_FORMAT_LOAD_STORE_WITH_REGISTER_OFFSET) == THUMB_INSTRUCTION_FORMAT_LOAD_STORE_WITH_REGISTER_OFFSET) {
-        decoded_instruction = (Instruction) {
-            .type = INSTRUCTION_LOAD_STORE_WITH_REGISTER_OFFSET,
-            .rd = (current_instruction >> 0) & 7,
-            .rb = (current_instruction >> 3) & 7,
-            .rm = (current_instruction >> 6) & 7,
-            .B = (current_instruction >> 10) & 1,
-            .L = (current_instruction >> 11) & 1,
-        };
-    }
-    else if ((current_instruction & THUMB_INSTRUCTION_FORMAT_PC_RELATIVE_LOAD) == THUMB_INSTRUCTION_FORMAT_PC_RELATIVE_LOAD) {
-        decoded_instruction = (Instruction) {
-            .type = INSTRUCTION_PC_RELATIVE_LOAD,
-            .offset = current_instruction & 0xFF,
-            .rd = (current_instruction >> 8) & 7,
-        };
-    }
-    else if ((current_instruction & THUMB_INSTRUCTION_FORMAT_HI_REGISTER_OPERATIONS_BRANCH_EXCHANGE) == THUMB_INSTRUCTION_FORMAT_HI_REGISTER_OPERATIONS_BRANCH_EXCHANGE) {
-        decoded_instruction = (Instruction) {
-            .type = INSTRUCTION_HI_REGISTER_OPERATIONS_BRANCH_EXCHANGE,
-            .rd = (current_instruction >> 0) & 7,
-            .rs = (current_instruction >> 3) & 7,
-            .H2 = (current_instruction >> 6) & 1,
-            .H1 = (current_instruction >> 7) & 1,
-            .op = (current_instruction >> 8) & 0b11,
-        };
-    }
-    else if ((current_instruction & THUMB_INSTRUCTION_FORMAT_ALU_OPERATIONS) == THUMB_INSTRUCTION_FORMAT_ALU_OPERATIONS) {
-        decoded_instruction = (Instruction) {
-            .type = INSTRUCTION_ALU_OPERATIONS,
-            .rd = (current_instruction >> 0) & 7,
-            .rs = (current_instruction >> 3) & 7,
-            .op = (current_instruction >> 6) & 0xF,
-        };
-    }
-    else if ((current_instruction & THUMB_INSTRUCTION_FORMAT_MOVE_COMPARE_ADD_SUBTRACT_IMMEDIATE) == THUMB_INSTRUCTION_FORMAT_MOVE_COMPARE_ADD_SUBTRACT_IMMEDIATE) {
-        decoded_instruction = (Instruction) {
-            .type = INSTRUCTION_MOVE_COMPARE_ADD_SUBTRACT_IMMEDIATE,
-            .offset = current_instruction & 0xFF,
-            .rd = (current_instruction >> 8) & 7,
-            .op = (current_instruction >> 11) & 0b11,
-        };
-    }
-    else if ((current_instruction & THUMB_INSTRUCTION_FORMAT_ADD_SUBTRACT) == THUMB_INSTRUCTION_FORMAT_ADD_SUBTRACT) {
-        decoded_instruction = (Instruction) {
-            .type = INSTRUCTION_ADD_SUBTRACT,
-            .rd = (current_instruction >> 0) & 7,
-            .rs = (current_instruction >> 3) & 7,
-            .rn = (current_instruction >> 6) & 7,
-            .op = (current_instruction >> 9) & 1,
-            .I = (current_instruction >> 10) & 1,
-        };
-    }
-    else if ((current_instruction & THUMB_INSTRUCTION_FORMAT_MOVE_SHIFTED_REGISTER) == THUMB_INSTRUCTION_FORMAT_MOVE_SHIFTED_REGISTER) {
-        decoded_instruction = (Instruction) {
-            .type = INSTRUCTION_MOVE_SHIFTED_REGISTER,
-            .rd = (current_instruction >> 0) & 7,
-            .rs = (current_instruction >> 3) & 7,
-            .offset = (current_instruction >> 6) & 0x1F,
-            .op = (current_instruction >> 11) & 0b11,
-        };
-    }
-    else {
-        fprintf(stderr, "Thumb instruction unknown: 0x%08X\n", current_instruction);
-        exit(1);
+
+    if (shift_value < 32) {
+        result.value = rm << shift_value;
+        result.carry = (rm >> (32 - shift_value)) & 1;
+    } else if (shift_value == 32) {
+        result.value = 0;
+        result.carry = rm & 1;
+    } else {
+        result.value = 0;
+        result.carry = 0;
     }
+    result.carry_out = true;
 
-    decoded_instruction.address = cpu->pc - 2;
-    decoded_instruction.encoding = current_instruction;
+    return result;
 }
 
-void
-thumb_fetch()
+static ShifterOperand
+shift_operand_lsr_register(void)
 {
-    current_instruction = *(u16 *)get_memory_at(cpu, &memory, cpu->pc);
-    cpu->pc += 2;
+    ShifterOperand result = {0};
+    u32 rm = cpu->r[decoded_instruction.second_operand & 0xF];
+    u8 shift_value = (u8)(cpu->r[(decoded_instruction.second_operand >> 8) & 0xF]);
+    result.extra_cycles = 1;
+
+    if (shift_value == 0) {
+        result.value = rm;
+        return result;
+    }
+
+    if (shift_value < 32) {
+        result.value = rm >> shift_value;
+        result.carry = (rm >> (shift_value - 1)) & 1;
+    } else if (shift_value == 32) {
+        result.value = 0;
+        result.carry = (rm >> 31) & 1;
+    } else {
+        result.value = 0;
+        result.carry = 0;
+    }
+    result.carry_out = true;
+
+    return result;
 }
 
+static ShifterOperand
+shift_operand_asr_register(void)
+{
+    ShifterOperand result = {0};
+    u32 rm = cpu->r[decoded_instruction.second_operand & 0xF];
+    u8 shift_value = (u8)(cpu->r[(decoded_instruction.second_operand >> 8) & 0xF]);
+    result.extra_cycles = 1;
+
+    if (shift_value == 0) {
+        result.value = rm;
+        return result;
+    }
 
-static void
-process_branch()
+    if (shift_value < 32) {
+        result.value = arithmetic_shift_right(rm, shift_value);
+        result.carry = (rm >> (shift_value - 1)) & 1;
+    } else {
+        result.value = (((rm >> 31) & 1) == 0) ? 0 : 0xFFFFFFFF;
+        result.carry = (rm >> 31) & 1;
+    }
+    result.carry_out = true;
+
+    return result;
+}
+
+static ShifterOperand
+shift_operand_ror_register(void)
 {
-    switch (decoded_instruction.type) {
-        case INSTRUCTION_B: {
-            if (decoded_instruction.L) {
-                cpu->lr = cpu->pc - 4;
-                assert(cpu->pc - 4 == decoded_instruction.address + 4);
-            }
+    ShifterOperand result = {0};
+    u32 rm = cpu->r[decoded_instruction.second_operand & 0xF];
+    u8 shift_value = (u8)(cpu->r[(decoded_instruction.second_operand >> 8) & 0xF]);
+    result.extra_cycles = 1;
+
+    if (shift_value == 0) {
+        result.value = rm;
+        return result;
+    }
 
-            u32 offset = left_shift_sign_extended(decoded_instruction.offset, 24, 2);
-            cpu->pc += offset;
+    if ((shift_value & 0xF) == 0) {
+        result.value = rm;
+        result.carry = (rm >> 31) & 1;
+    } else {
+        result.value = rotate_right(rm, shift_value & 0xF, 32);
+        result.carry = (rm >> ((shift_value & 0xF) - 1)) & 1;
+    }
+    result.carry_out = true;
 
-            current_instruction = 0;
+    return result;
+}
 
-            cpu->cycles += 3;
-        } break;
+// Flags of each kind of operation, with rn, operand, and result in scope.
+#define DATA_PROCESSING_LOGICAL_FLAGS                                                                   \
+    set_flags_lazy(cpu, operand.carry_out ? FLAGS_OPERATION_LOGICAL : FLAGS_OPERATION_NZ, 0, 0, result, operand.carry)
+#define DATA_PROCESSING_ADD_FLAGS       set_flags_lazy(cpu, FLAGS_OPERATION_ADD, rn, operand.value, result, 0)
+#define DATA_PROCESSING_SUB_FLAGS       set_flags_lazy(cpu, FLAGS_OPERATION_SUB, rn, operand.value, result, 0)
+#define DATA_PROCESSING_RSB_FLAGS                                                                       \
+    set_condition_Z(result == 0);                                                                       \
+    set_condition_N(result >> 31);                                                                      \
+    set_condition_C(operand.value <= rn ? 1 : 0);                                                      \
+    set_overflow_subtract(operand.value, rn, result)
+#define DATA_PROCESSING_ADC_FLAGS                                                                       \
+    set_condition_Z(result == 0);                                                                       \
+    set_condition_N(result >> 31);                                                                      \
+    set_condition_C((result < operand.value) ? 1 : 0);                                                  \
+    set_overflow_addition(rn, operand.value + CONDITION_C, result)
+#define DATA_PROCESSING_SBC_FLAGS                                                                       \
+    set_condition_Z(result == 0);                                                                       \
+    set_condition_N(result >> 31);                                                                      \
+    set_condition_C(operand.value <= rn ? 1 : 0);                                                      \
+    set_overflow_subtract(rn, operand.value - ~(CONDITION_C), result)
+#define DATA_PROCESSING_RSC_FLAGS                                                                       \
+    set_condition_Z(result == 0);                                                                       \
+    set_condition_N(result >> 31);                                                                      \
+    set_condition_C(operand.value <= rn ? 1 : 0);                                                      \
+    set_overflow_subtract(operand.value, rn - ~(CONDITION_C), result)
+
+// X(name, type, store_result, operation, flags), in opcode order. MOV and MVN discard rn, which every
+// handler reads.
+#define DATA_PROCESSING_OPERATIONS(X)                                                                   \
+    X(and, INSTRUCTION_AND, true,  rn & operand.value,                      DATA_PROCESSING_LOGICAL_FLAGS)  \
+    X(eor, INSTRUCTION_EOR, true,  rn ^ operand.value,                      DATA_PROCESSING_LOGICAL_FLAGS)  \
+    X(sub, INSTRUCTION_SUB, true,  rn - operand.value,                      DATA_PROCESSING_SUB_FLAGS)      \
+    X(rsb, INSTRUCTION_RSB, true,  operand.value - rn,                      DATA_PROCESSING_RSB_FLAGS)      \
+    X(add, INSTRUCTION_ADD, true,  rn + operand.value,                      DATA_PROCESSING_ADD_FLAGS)      \
+    X(adc, INSTRUCTION_ADC, true,  rn + operand.value + CONDITION_C,        DATA_PROCESSING_ADC_FLAGS)      \
+    X(sbc, INSTRUCTION_SBC, true,  rn - operand.value - ~(CONDITION_C),     DATA_PROCESSING_SBC_FLAGS)      \
+    X(rsc, INSTRUCTION_RSC, true,  operand.value - rn - ~(CONDITION_C),     DATA_PROCESSING_RSC_FLAGS)      \
+    X(tst, INSTRUCTION_TST, false, rn & operand.value,                      DATA_PROCESSING_LOGICAL_FLAGS)  \
+    X(teq, INSTRUCTION_TEQ, false, rn ^ operand.value,                      DATA_PROCESSING_LOGICAL_FLAGS)  \
+    X(cmp, INSTRUCTION_CMP, false, rn - operand.value,                      DATA_PROCESSING_SUB_FLAGS)      \
+    X(cmn, INSTRUCTION_CMN, false, rn + operand.value,                      DATA_PROCESSING_ADD_FLAGS)      \
+    X(orr, INSTRUCTION_ORR, true,  rn | operand.value,                      DATA_PROCESSING_LOGICAL_FLAGS)  \
+    X(mov, INSTRUCTION_MOV, true,  ((void)rn, operand.value),               DATA_PROCESSING_LOGICAL_FLAGS)  \
+    X(bic, INSTRUCTION_BIC, true,  rn & ~operand.value,                     DATA_PROCESSING_LOGICAL_FLAGS)  \
+    X(mvn, INSTRUCTION_MVN, true,  ((void)rn, ~operand.value),              DATA_PROCESSING_LOGICAL_FLAGS)
+
+// X(form, shifter function, ...), in ShifterForm order. The arguments of the operation are passed
+// through (no __VA_ARGS__, MSVC would forward them as a single argument).
+#define DATA_PROCESSING_SHIFTER_FORMS(X, name, store_result, operation, flags)                          \
+    X(immediate,        shift_operand_immediate,        name, store_result, operation, flags)           \
+    X(lsl_immediate,    shift_operand_lsl_immediate,    name, store_result, operation, flags)           \
+    X(lsr_immediate,    shift_operand_lsr_immediate,    name, store_result, operation, flags)           \
+    X(asr_immediate,    shift_operand_asr_immediate,    name, store_result, operation, flags)           \
+    X(ror_immediate,    shift_operand_ror_immediate,    name, store_result, operation, flags)           \
+    X(lsl_register,     shift_operand_lsl_register,     name, store_result, operation, flags)           \
+    X(lsr_register,     shift_operand_lsr_register,     name, store_result, operation, flags)           \
+    X(asr_register,     shift_operand_asr_register,     name, store_result, operation, flags)           \
+    X(ror_register,     shift_operand_ror_register,     name, store_result, operation, flags)
+
+#define DATA_PROCESSING_HANDLER(handler_name, shifter, S, store_result, operation, flags)              \
+static void                                                                                             \
+handler_name(void)                                                                                      \
+{                                                                                                       \
+    ShifterOperand operand = shifter();                                                                 \
+    u8 extra_cpu_cycles = operand.extra_cycles;                                                         \
+                                                                                                        \
+    u32 rn = cpu->r[decoded_instruction.rn];                                                            \
+    u32 result = operation;                                                                             \
+                                                                                                        \
+    if (S && decoded_instruction.rd == 15) {                                                            \
+        set_cpsr(cpu, *get_spsr_current_mode(cpu));                                                     \
+    } else if (S) {                                                                                     \
+        flags;                                                                                          \
+    }                                                                                                   \
+                                                                                                        \
+    if (store_result) {                                                                                 \
+        cpu->r[decoded_instruction.rd] = result;                                                        \
+                                                                                                        \
+        if (decoded_instruction.rd == 15) {                                                             \
+            current_instruction = 0;                                                                    \
+                                                                                                        \
+            extra_cpu_cycles += 2;                                                                      \
+        }                                                                                               \
+    }                                                                                                   \
+                                                                                                        \
+    cpu->cycles += 1 + extra_cpu_cycles;                                                                \
+}
 
-        case INSTRUCTION_BX: {
-            cpu->pc = *get_register(cpu, decoded_instruction.rn) & (-2); // NOTE: PC must be 16-bit align. This clears out the lsb (-2 is 0b1110).
-            current_instruction = 0;
+#define DATA_PROCESSING_FORM_HANDLERS(form, shifter, name, store_result, operation, flags)             \
+    DATA_PROCESSING_HANDLER(data_processing_##name##_##form, shifter, 0, store_result, operation, flags)    \
+    DATA_PROCESSING_HANDLER(data_processing_##name##_##form##_s, shifter, 1, store_result, operation, flags)
 
-            u8 thumb_mode = *get_register(cpu, decoded_instruction.rn) & 1;
-            set_control_bit_T(thumb_mode);
+#define DATA_PROCESSING_OPERATION_HANDLERS(name, type, store_result, operation, flags)                 \
+    DATA_PROCESSING_SHIFTER_FORMS(DATA_PROCESSING_FORM_HANDLERS, name, store_result, operation, flags)
 
-            cpu->cycles += 3;
-        } break;
+DATA_PROCESSING_OPERATIONS(DATA_PROCESSING_OPERATION_HANDLERS)
 
-        default: {
-            assert(!"Invalid instruction type for category");
+#define DATA_PROCESSING_FORM_ENTRY(form, shifter, name, store_result, operation, flags)                \
+    { data_processing_##name##_##form, data_processing_##name##_##form##_s },
+
+#define DATA_PROCESSING_OPERATION_ENTRY(name, type, store_result, operation, flags)                    \
+    [type - INSTRUCTION_AND] = {                                                                        \
+        DATA_PROCESSING_SHIFTER_FORMS(DATA_PROCESSING_FORM_ENTRY, name, store_result, operation, flags) \
+    },
+
+static DataProcessingHandler data_processing_handlers[16][SHIFTER_FORM_COUNT][2] = {
+    DATA_PROCESSING_OPERATIONS(DATA_PROCESSING_OPERATION_ENTRY)
+};
+
+/**
+ * Picks the handler for the opcode, the form of the second operand and the S bit of a decoded data
+ * processing instruction.
+ */
+static DataProcessingHandler
+get_data_processing_handler(Instruction *instruction)
+{
+    ShifterForm form = SHIFTER_FORM_IMMEDIATE;
+    if (!instruction->I) {
+        ShiftType shift_type = (ShiftType)((instruction->second_operand >> 5) & 0b11);
+        if ((instruction->second_operand >> 4) & 1) {
+            form = (ShifterForm)(SHIFTER_FORM_LSL_REGISTER + shift_type);
+        } else {
+            form = (ShifterForm)(SHIFTER_FORM_LSL_IMMEDIATE + shift_type);
         }
     }
+
+    return data_processing_handlers[instruction->type - INSTRUCTION_AND][form][instruction->S & 1];
 }
 
 static void
 process_data_processing()
 {
-    u8 extra_cpu_cycles = 0;
+    decoded_instruction.data_processing_handler();
+}
 
-    u8 carry = 0;
-    u32 second_operand = 0;
-    if (decoded_instruction.I) {
-        // Immediate with rotate right
+static void
+process_mrs()
+{
+    if (decoded_instruction.P) {
+        cpu->r[decoded_instruction.rd] = *(get_spsr_current_mode(cpu));
+    } else {
+        materialize_flags(cpu);
+        cpu->r[decoded_instruction.rd] = cpu->cpsr;
+    }
+
+    cpu->cycles++;
+}
 
-        u8 imm = decoded_instruction.second_operand & 0xFF;
-        u32 rotate = (decoded_instruction.second_operand >> 8) & 0xF;
+static void
+process_msr()
+{
+    u32 value;
+    if (decoded_instruction.I) {
+        u8 imm = decoded_instruction.source_operand & 0xFF;
+        u32 rotate = (decoded_instruction.source_operand >> 8) & 0xF;
         // NOTE: This value is zero extended to 32 bits, and then subject to a rotate right by twice the value in the rotate field.
         rotate *= 2;
 
-        second_operand = rotate_right(imm, rotate, 32);
-        if (rotate == 0) {
-            carry = CONDITION_C;
-        } else {
-            carry = (second_operand >> 31) & 1;
-        }
+        value = rotate_right(imm, rotate, 8);
     } else {
-        // From register
+        value = cpu->r[decoded_instruction.rm];
+    }
 
-        u8 rm_n = decoded_instruction.second_operand & 0xF;
-        u32 rm = *get_register(cpu, rm_n);
-        u8 shift = (decoded_instruction.second_operand >> 4) & 0xFF;
-        ShiftType shift_type = (ShiftType)((shift >> 1) & 0b11);
-        if (shift & 1) {
-            // Shift register
-            extra_cpu_cycles++;
+    u32 field_mask = decoded_instruction.mask;
+    if (decoded_instruction.P == 0) {
+        // NOTE: The fields not written keep the current flags.
+        materialize_flags(cpu);
 
-            u8 rs = (shift >> 4) & 0xF; // Register to the value to shift.
-            u8 shift_value = (u8)(*get_register(cpu, rs));
-            
-            switch (shift_type) {
-                case SHIFT_TYPE_LOGICAL_LEFT: {
-                    if (shift_value == 0) {
-                        second_operand = rm;
-                        carry = CONDITION_C;
-                    } else if (shift_value < 32) {
-                        second_operand = rm << shift_value;
-                        carry = (rm >> (32 - shift_value)) & 1;
-                    } else if (shift_value == 32) {
-                        second_operand = 0;
-                        carry = rm & 1;
-                    } else {
-                        second_operand = 0;
-                        carry = 0;
-                    }
-                } break;
-                case SHIFT_TYPE_LOGICAL_RIGHT: {
-                    if (shift_value == 0) {
-                        second_operand = rm;
-                        carry = CONDITION_C;
-                    } else if (shift_value < 32) {
-                        second_operand = rm >> shift_value;
-                        carry = (rm >> (shift_value - 1)) & 1;
-                    } else if (shift_value == 32) {
-                        second_operand = 0;
-                        carry = (rm >> 31) & 1;
-                    } else {
-                        second_operand = 0;
-                        carry = 0;
-                    }
-                } break;
-                case SHIFT_TYPE_ARITHMETIC_RIGHT: {
-                    if (shift_value == 0) {
-                        second_operand = rm;
-                        carry = CONDITION_C;
-                    } else if (shift_value < 32) {
-                        second_operand = arithmetic_shift_right(rm, shift_value);
-                        carry = (rm >> (shift_value - 1)) & 1;
-                    } else {
-                        if (((rm >> 31) & 1) == 0) {
-                            second_operand = 0;
-                            carry = (rm >> 31) & 1;
-                        } else {
-                            second_operand = 0xFFFFFFFF;
-                            carry = (rm >> 31) & 1;
-                        }
-                    }
-                } break;
-                case SHIFT_TYPE_ROTATE_RIGHT: {
-                    if (shift_value == 0) {
-                        second_operand = rm;
-                        carry = CONDITION_C;
-                    } else if ((shift_value & 0xF) == 0) {
-                        second_operand = rm;
-                        carry = (rm >> 31) & 1;
-                    } else {
-                        second_operand = rotate_right(rm, shift_value & 0xF, 32);
-                        carry = (rm >> ((shift_value & 0xF) - 1)) & 1;
-                    }
-                } break;
+        if (in_privileged_mode(cpu)) {
+            if (((field_mask >> 0) & 1)) {
+                // NOTE: The mode may change.
+                set_cpsr(cpu, (cpu->cpsr & 0xFFFFFF00) | (value & 0x000000FF));
+            }
+            if (((field_mask >> 1) & 1)) {
+                cpu->cpsr = cpu->cpsr & 0xFFFF00FF;
+                cpu->cpsr |=   (value & 0x0000FF00);
+            }
+            if (((field_mask >> 2) & 1)) {
+                cpu->cpsr = cpu->cpsr & 0xFF00FFFF;
+                cpu->cpsr |=   (value & 0x00FF0000);
+            }
+            if (((field_mask >> 3) & 1)) {
+                cpu->cpsr = cpu->cpsr & 0x00FFFFFF;
+                cpu->cpsr |=   (value & 0xFF000000);
             }
+        }
+    } else {
+        if (current_mode_has_spsr(cpu)) {
+            u32 *sr = get_spsr_current_mode(cpu);
+
+            if (((field_mask >> 0) & 1)) {
+                *sr =     *sr & 0xFFFFFF00;
+                *sr |= (value & 0x000000FF);
+            }
+            if (((field_mask >> 1) & 1)) {
+                *sr =     *sr & 0xFFFF00FF;
+                *sr |= (value & 0x0000FF00);
+            }
+            if (((field_mask >> 2) & 1)) {
+                *sr =     *sr & 0xFF00FFFF;
+                *sr |= (value & 0x00FF0000);
+            }
+            if (((field_mask >> 3) & 1)) {
+                *sr =     *sr & 0x00FFFFFF;
+                *sr |= (value & 0xFF000000);
+            }
+        }
+
+    }
+
+
+    // u32 *sr = &cpu->cpsr;
+    // if (decoded_instruction.P) {
+    //     sr = get_spsr_current_mode(cpu);
+    // }
+
+    // if (decoded_instruction.I) {
+    //     u8 imm = decoded_instruction.source_operand & 0xFF;
+    //     u32 rotate = (decoded_instruction.source_operand >> 8) & 0xF;
+    //     // NOTE: This value is zero extended to 32 bits, and then subject to a rotate right by twice the value in the rotate field.
+    //     rotate *= 2;
+
+    //     u32 value = rotate_right(imm, rotate, 8);
+    //     *sr = value;
+    // } else {
+    //     *sr = cpu->r[decoded_instruction.rm];
+    // }
+
+    cpu->cycles++;
+}
+
+static void
+process_mul()
+{
+    assert(!"Implement");
+}
+
+static void
+process_mla()
+{
+    assert(!"Implement");
+}
+
+static void
+process_mull()
+{
+    assert(!"Implement");
+}
+
+static void
+process_mlal()
+{
+    assert(!"Implement");
+}
+
+#define UPDATE_BASE_OFFSET()            \
+    do {                                \
+        if (decoded_instruction.U) {    \
+            base += offset;             \
+        } else {                        \
+            base -= offset;             \
+        }                               \
+    } while (0)
+
+/**
+ * The offset of LDR and STR: the 12-bit immediate or the shifted register.
+ */
+static u32
+get_single_data_transfer_offset(void)
+{
+    u32 offset = 0;
+
+    if (decoded_instruction.I) {
+        // Offset is in register
+
+        u8 carry;
+        u32 rm = cpu->r[decoded_instruction.offset & 0xF];
+        u8 shift = (decoded_instruction.offset >> 4) & 0xFF;
+        u8 shift_type = (ShiftType)((shift >> 1) & 0b11);
+        if (shift & 1) {
+            // From register
+            assert(!"The manual does not specify this as valid addressing mode. ARM Architecture Reference Manual, page A5-19");
 
+            u8 rs = (shift >> 4) & 0xF ; // Register to the value to shift.
+            offset = apply_shift(rm, (u8)(cpu->r[rs] & 0xF), shift_type, &carry);
         } else {
             // Shift immediate 5-bit value
 
             u8 shift_value = (shift >> 3) & 0b11111;
-            
+            // offset = (u16)apply_shift(offset_register, shift_amount, shift_type, &carry);
             switch (shift_type) {
                 case SHIFT_TYPE_LOGICAL_LEFT: {
-                    if (shift_value == 0) {
-                        second_operand = rm;
-                        carry = CONDITION_C;
-                    } else {
-                        second_operand = rm << shift_value;
-                        carry = (rm >> (32 - shift_value)) & 1;
-                    }
+                    offset = rm << shift_value;
                 } break;
                 case SHIFT_TYPE_LOGICAL_RIGHT: {
                     if (shift_value == 0) {
-                        second_operand = 0;
-                        carry = (rm >> 31) & 1;
+                        offset = 0;
                     } else {
-                        second_operand = rm >> shift_value;
-                        carry = (rm >> (shift_value - 1)) & 1;
+                        offset = rm >> shift_value;
                     }
                 } break;
                 case SHIFT_TYPE_ARITHMETIC_RIGHT: {
                     if (shift_value == 0) {
-                        if (((rm >> 31) & 1) == 0) {
-                            second_operand = 0;
-                            carry = (rm >> 31) & 1;
+                        if (((rm >> 31) & 1) == 1) {
+                            offset = 0xFFFFFFFF;
                         } else {
-                            second_operand = 0xFFFFFFFF;
-                            carry = (rm >> 31) & 1;
+                            offset = 0;
                         }
                     } else {
-                        second_operand = arithmetic_shift_right(rm, shift_value);
-                        carry = (rm >> (shift_value - 1)) & 1;
+                        offset = arithmetic_shift_right(rm, shift_value);
                     }
                 } break;
                 case SHIFT_TYPE_ROTATE_RIGHT: {
                     if (shift_value == 0) {
-                        second_operand = (CONDITION_C << 31) | (rm >> 1);
-                        carry = rm & 1;
+                        offset = (CONDITION_C << 31) | (rm >> 1);
                     } else {
-                        second_operand = rotate_right(rm, shift_value, 32);
-                        carry = (rm >> (shift_value - 1)) & 1;
+                        offset = rotate_right(rm, shift_value, 32);
                     }
                 } break;
             }
         }
+
+    } else {
+        // Immediate value
+
+        offset = (u16)decoded_instruction.offset;
+    }
+
+    return offset;
+}
+
+static void
+process_ldr()
+{
+    u32 base = cpu->r[decoded_instruction.rn];
+    u32 offset = get_single_data_transfer_offset();
+
+    u8 P = decoded_instruction.P;
+    u8 B = decoded_instruction.B;
+    u32 *rd = &cpu->r[decoded_instruction.rd];
+
+    if (B) {
+        u32 address;
+        if (P) {
+            UPDATE_BASE_OFFSET();
+            address = base;
+
+            if (decoded_instruction.W) {
+                cpu->r[decoded_instruction.rn] = base;
+            }
+        } else {
+            address = base;
+            UPDATE_BASE_OFFSET();
+            cpu->r[decoded_instruction.rn] = base;
+        }
+
+        *rd = bus_read8(address);
+    } else {
+        u32 address;
+        if (P) {
+            UPDATE_BASE_OFFSET();
+            address = base;
+
+            if (decoded_instruction.W) {
+                cpu->r[decoded_instruction.rn] = base;
+            }
+        } else {
+            address = base;
+            UPDATE_BASE_OFFSET();
+            cpu->r[decoded_instruction.rn] = base;
+        }
+
+        u8 rotate_value = 8 * (base & 0b11);
+        u32 value = rotate_right(bus_read32(address), rotate_value, 32);
+
+        if (decoded_instruction.rd == 15) {
+            cpu->pc = value & 0xFFFFFFFC; // NOTE: From "ARM Architecture Reference Manual"
+
+            // PC written, so it has to branch to that instruction and invalidate whatever the pre-fetched was.
+            current_instruction = 0;
+
+            cpu->cycles += 2; // 2 Extra cycles on LDR PC
+        } else {
+            *rd = value;
+        }
+    }
+
+    cpu->cycles += 3;
+}
+
+static void
+process_str()
+{
+    u32 base = cpu->r[decoded_instruction.rn];
+    u32 offset = get_single_data_transfer_offset();
+
+    u8 P = decoded_instruction.P;
+    u8 B = decoded_instruction.B;
+    u32 *rd = &cpu->r[decoded_instruction.rd];
+
+    if (B) {
+        u32 address;
+        if (P) {
+            UPDATE_BASE_OFFSET();
+            address = base;
+
+            if (decoded_instruction.W) {
+                cpu->r[decoded_instruction.rn] = base;
+            }
+        } else {
+            address = base;
+            UPDATE_BASE_OFFSET();
+            cpu->r[decoded_instruction.rn] = base;
+        }
+
+        bus_write8(address, (u8)(*rd & 0xFF));
+    } else {
+        u32 address;
+        if (P) {
+            UPDATE_BASE_OFFSET();
+            address = base;
+
+            if (decoded_instruction.W) {
+                cpu->r[decoded_instruction.rn] = base;
+            }
+        } else {
+            address = base;
+            UPDATE_BASE_OFFSET();
+            cpu->r[decoded_instruction.rn] = base;
+        }
+
+        bus_write32(address, *rd);
+    }
+
+    cpu->cycles += 2;
+}
+
+static void
+process_ldrh()
+{
+    assert(decoded_instruction.rd != 15);
+
+    u32 base = cpu->r[decoded_instruction.rn];
+    u32 offset;
+    if (decoded_instruction.I) {
+        offset = decoded_instruction.offset;
+    } else {
+        offset = cpu->r[decoded_instruction.rm];
+    }
+
+    if (decoded_instruction.P) {
+        UPDATE_BASE_OFFSET();
+
+        cpu->r[decoded_instruction.rd] = bus_read16(base);
+
+        if (decoded_instruction.W) {
+            cpu->r[decoded_instruction.rn] = base;
+        }
+    } else {
+        cpu->r[decoded_instruction.rd] = bus_read16(base);
+
+        UPDATE_BASE_OFFSET();
+        cpu->r[decoded_instruction.rn] = base;
+    }
+
+    cpu->cycles += 3;
+}
+
+static void
+process_strh()
+{
+    u32 base = cpu->r[decoded_instruction.rn];
+    u32 offset;
+    if (decoded_instruction.I) {
+        offset = decoded_instruction.offset;
+    } else {
+        offset = cpu->r[decoded_instruction.rm];
+    }
+
+    if (decoded_instruction.P) {
+        UPDATE_BASE_OFFSET();
+
+        bus_write16(base, (u16)cpu->r[decoded_instruction.rd]);
+
+        if (decoded_instruction.W) {
+            cpu->r[decoded_instruction.rn] = base;
+        }
+    } else {
+        bus_write16(base, (u16)cpu->r[decoded_instruction.rd]);
+
+        UPDATE_BASE_OFFSET();
+        cpu->r[decoded_instruction.rn] = base;
     }
 
+    cpu->cycles += 2;
+}
 
-    int store_result = false;
-    u32 result = 0;
+static void
+process_ldrsb()
+{
+    assert(decoded_instruction.rd != 15);
 
-    u32 rn = *get_register(cpu, decoded_instruction.rn);
-    u32 *rd = get_register(cpu, decoded_instruction.rd);
-    
-    switch (decoded_instruction.type) {
-        case INSTRUCTION_ADD: {
-            result = rn + second_operand;
-            store_result = true;
-
-            if (decoded_instruction.S == 1 && decoded_instruction.rd == 15) {
-                cpu->cpsr = *get_spsr_current_mode(cpu);
-            } else if (decoded_instruction.S == 1) {
-                set_condition_Z(result == 0);
-                set_condition_N(result >> 31);
-                set_condition_C((result < second_operand) ? 1 : 0);
-                set_overflow_addition(rn, second_operand, result);
-            }
-        } break;
-        case INSTRUCTION_AND: {
-            result = rn & second_operand;
-            store_result = true;
-
-            if (decoded_instruction.S == 1 && decoded_instruction.rd == 15) {
-                cpu->cpsr = *get_spsr_current_mode(cpu);
-            } else if (decoded_instruction.S == 1) {
-                set_condition_Z(result == 0);
-                set_condition_N(result >> 31);
-                set_condition_C(carry);
-            }
-        } break;
-        case INSTRUCTION_EOR: {
-            result = rn ^ second_operand;
-            store_result = true;
-
-            if (decoded_instruction.S == 1 && decoded_instruction.rd == 15) {
-                cpu->cpsr = *get_spsr_current_mode(cpu);
-            } else if (decoded_instruction.S == 1) {
-                set_condition_Z(result == 0);
-                set_condition_N(result >> 31);
-                set_condition_C(carry);
-            }
-        } break;
-        case INSTRUCTION_SUB: {
-            result = rn - second_operand;
-            store_result = true;
-
-            if (decoded_instruction.S == 1 && decoded_instruction.rd == 15) {
-                cpu->cpsr = *get_spsr_current_mode(cpu);
-            } else if (decoded_instruction.S == 1) {
-                set_condition_Z(result == 0);
-                set_condition_N(result >> 31);
-                set_condition_C(second_operand <= rn ? 1 : 0);
-                set_overflow_subtract(rn, second_operand, result);
-            }
-        } break;
-        case INSTRUCTION_RSB: {
-            result = second_operand - rn;
-            store_result = true;
-
-            if (decoded_instruction.S == 1 && decoded_instruction.rd == 15) {
-                cpu->cpsr = *get_spsr_current_mode(cpu);
-            } else if (decoded_instruction.S == 1) {
-                set_condition_Z(result == 0);
-                set_condition_N(result >> 31);
-                set_condition_C(second_operand <= rn ? 1 : 0);
-                set_overflow_subtract(second_operand, rn, result);
-            }
-        } break;
-        case INSTRUCTION_ADC: {
-            // result = rn & second_operand + carry;
-            result = rn + second_operand + CONDITION_C;
-            store_result = true;
-
-            if (decoded_instruction.S == 1 && decoded_instruction.rd == 15) {
-                cpu->cpsr = *get_spsr_current_mode(cpu);
-            } else if (decoded_instruction.S == 1) {
-                set_condition_Z(result == 0);
-                set_condition_N(result >> 31);
-                set_condition_C((result < second_operand) ? 1 : 0);
-                set_overflow_addition(rn, second_operand + CONDITION_C, result);
-            }
-        } break;
-        case INSTRUCTION_SBC: {
-            // result = rn - second_operand + carry - 1;
-            result = rn - second_operand - ~(CONDITION_C);
-            store_result = true;
-
-            if (decoded_instruction.S == 1 && decoded_instruction.rd == 15) {
-                cpu->cpsr = *get_spsr_current_mode(cpu);
-            } else if (decoded_instruction.S == 1) {
-                set_condition_Z(result == 0);
-                set_condition_N(result >> 31);
-                set_condition_C(second_operand <= rn ? 1 : 0);
-                set_overflow_subtract(rn, second_operand - ~(CONDITION_C), result);
-            }
-        } break;
-        case INSTRUCTION_RSC: {
-            // result = second_operand - rn + carry - 1;
-            result = second_operand - rn - ~(CONDITION_C);
-            store_result = true;
-
-            if (decoded_instruction.S == 1 && decoded_instruction.rd == 15) {
-                cpu->cpsr = *get_spsr_current_mode(cpu);
-            } else if (decoded_instruction.S == 1) {
-                set_condition_Z(result == 0);
-                set_condition_N(result >> 31);
-                set_condition_C(second_operand <= rn ? 1 : 0);
-                set_overflow_subtract(second_operand, rn - ~(CONDITION_C), result);
-            }
-        } break;
-        case INSTRUCTION_TST: {
-            result = rn & second_operand;
-            store_result = false;
-
-            if (decoded_instruction.S == 1 && decoded_instruction.rd == 15) {
-                cpu->cpsr = *get_spsr_current_mode(cpu);
-            } else if (decoded_instruction.S == 1) {
-                set_condition_Z(result == 0);
-                set_condition_N(result >> 31);
-                set_condition_C(carry);
-            }
-        } break;
-        case INSTRUCTION_TEQ: {
-            result = rn ^ second_operand;
-            store_result = false;
-
-            if (decoded_instruction.S == 1 && decoded_instruction.rd == 15) {
-                cpu->cpsr = *get_spsr_current_mode(cpu);
-            } else if (decoded_instruction.S == 1) {
-                set_condition_Z(result == 0);
-                set_condition_N(result >> 31);
-                set_condition_C(carry);
-            }
-        } break;
-        case INSTRUCTION_CMP: {
-            result = rn - second_operand;
-            store_result = false;
-
-            if (decoded_instruction.S == 1 && decoded_instruction.rd == 15) {
-                cpu->cpsr = *get_spsr_current_mode(cpu);
-            } else if (decoded_instruction.S == 1) {
-                set_condition_Z(result == 0);
-                set_condition_N(result >> 31);
-                set_condition_C(second_operand <= rn ? 1 : 0);
-                set_overflow_subtract(rn, second_operand, result);
-            }
-        } break;
-        case INSTRUCTION_CMN: {
-            result = rn + second_operand;
-            store_result = false;
-
-            if (decoded_instruction.S == 1 && decoded_instruction.rd == 15) {
-                cpu->cpsr = *get_spsr_current_mode(cpu);
-            } else if (decoded_instruction.S == 1) {
-                set_condition_Z(result == 0);
-                set_condition_N(result >> 31);
-                set_condition_C((result < second_operand) ? 1 : 0);
-                set_overflow_addition(rn, second_operand, result);
-            }
-        } break;
-        case INSTRUCTION_ORR: {
-            result = rn | second_operand;
-            store_result = true;
-
-            if (decoded_instruction.S == 1 && decoded_instruction.rd == 15) {
-                cpu->cpsr = *get_spsr_current_mode(cpu);
-            } else if (decoded_instruction.S == 1) {
-                set_condition_Z(result == 0);
-                set_condition_N(result >> 31);
-                set_condition_C(carry);
-            }
-        } break;
-        case INSTRUCTION_MOV: {
-            result = second_operand;
-            store_result = true;
-
-            if (decoded_instruction.S == 1 && decoded_instruction.rd == 15) {
-                cpu->cpsr = *get_spsr_current_mode(cpu);
-            } else if (decoded_instruction.S == 1) {
-                set_condition_Z(result == 0);
-                set_condition_N(result >> 31);
-                set_condition_C(carry);
-            }
-        } break;
-        case INSTRUCTION_BIC: {
-            result = rn & ~second_operand;
-            store_result = true;
-
-            if (decoded_instruction.S == 1 && decoded_instruction.rd == 15) {
-                cpu->cpsr = *get_spsr_current_mode(cpu);
-            } else if (decoded_instruction.S == 1) {
-                set_condition_Z(result == 0);
-                set_condition_N(result >> 31);
-                set_condition_C(carry);
-            }
-        } break;
-        case INSTRUCTION_MVN: {
-            result = ~second_operand;
-            store_result = true;
-
-            if (decoded_instruction.S == 1 && decoded_instruction.rd == 15) {
-                cpu->cpsr = *get_spsr_current_mode(cpu);
-            } else if (decoded_instruction.S == 1) {
-                set_condition_Z(result == 0);
-                set_condition_N(result >> 31);
-                set_condition_C(carry);
-            }
-        } break;
+    u32 base = cpu->r[decoded_instruction.rn];
+    u32 offset;
+    if (decoded_instruction.I) {
+        offset = decoded_instruction.offset;
+    } else {
+        offset = cpu->r[decoded_instruction.rm];
+    }
 
-        default: {
-            assert(!"Invalid instruction type for category");
+
+    if (decoded_instruction.P) {
+        UPDATE_BASE_OFFSET();
+
+        u8 value = bus_read8(base);
+        u8 sign = (value >> 7) & 1;
+        u32 value_sign_extended = (((u32)-sign) << 8) | value;
+
+        cpu->r[decoded_instruction.rd] = value_sign_extended;
+
+        if (decoded_instruction.W) {
+            cpu->r[decoded_instruction.rn] = base;
         }
+
+    } else {
+        u8 value = bus_read8(base);
+        u8 sign = (value >> 7) & 1;
+        u32 value_sign_extended = (((u32)-sign) << 8) | value;
+
+        cpu->r[decoded_instruction.rd] = value_sign_extended;
+
+        UPDATE_BASE_OFFSET();
+        cpu->r[decoded_instruction.rn] = base;
     }
 
-    if (store_result) {
-        *rd = result;
+    cpu->cycles += 3;
+}
 
-        if (decoded_instruction.rd == 15) {
-            current_instruction = 0;
-            
-            extra_cpu_cycles += 2;
+static void
+process_ldrsh()
+{
+    assert(decoded_instruction.rd != 15);
+
+    u32 base = cpu->r[decoded_instruction.rn];
+    u32 offset;
+    if (decoded_instruction.I) {
+        offset = decoded_instruction.offset;
+    } else {
+        offset = cpu->r[decoded_instruction.rm];
+    }
+
+
+    if (decoded_instruction.P) {
+        UPDATE_BASE_OFFSET();
+
+        u16 value = bus_read16(base);
+        u8 sign = (value >> 15) & 1;
+        u32 value_sign_extended = (((u32)-sign) << 16) | value;
+
+        cpu->r[decoded_instruction.rd] = value_sign_extended;
+
+        if (decoded_instruction.W) {
+            cpu->r[decoded_instruction.rn] = base;
         }
+    } else {
+        u16 value = bus_read16(base);
+        u8 sign = (value >> 15) & 1;
+        u32 value_sign_extended = (((u32)-sign) << 16) | value;
+
+        cpu->r[decoded_instruction.rd] = value_sign_extended;
+
+        UPDATE_BASE_OFFSET();
+        cpu->r[decoded_instruction.rn] = base;
     }
 
-    cpu->cycles += 1 + extra_cpu_cycles;
+    cpu->cycles += 3;
 }
 
+#undef UPDATE_BASE_OFFSET
+
+
 static void
-process_psr_transfer()
+process_ldm()
 {
-    switch (decoded_instruction.type) {
-        case INSTRUCTION_MRS: {
-            if (decoded_instruction.P) {
-                *get_register(cpu, decoded_instruction.rd) = *(get_spsr_current_mode(cpu));
-            } else {
-                *get_register(cpu, decoded_instruction.rd) = cpu->cpsr;
-            }
-        } break;
-        case INSTRUCTION_MSR: {
-            u32 value;
-            if (decoded_instruction.I) {
-                u8 imm = decoded_instruction.source_operand & 0xFF;
-                u32 rotate = (decoded_instruction.source_operand >> 8) & 0xF;
-                // NOTE: This value is zero extended to 32 bits, and then subject to a rotate right by twice the value in the rotate field.
-                rotate *= 2;
-
-                value = rotate_right(imm, rotate, 8);
-            } else {
-                value = *get_register(cpu, decoded_instruction.rm);
-            }
+    if (decoded_instruction.S) {
+        assert(!"Not handled");
+    }
 
-            u32 field_mask = decoded_instruction.mask;
-            if (decoded_instruction.P == 0) {
-                if (in_privileged_mode(cpu)) {
-                    if (((field_mask >> 0) & 1)) {
-                        cpu->cpsr = cpu->cpsr & 0xFFFFFF00;
-                        cpu->cpsr |=   (value & 0x000000FF);
-                    }
-                    if (((field_mask >> 1) & 1)) {
-                        cpu->cpsr = cpu->cpsr & 0xFFFF00FF;
-                        cpu->cpsr |=   (value & 0x0000FF00);
-                    }
-                    if (((field_mask >> 2) & 1)) {
-                        cpu->cpsr = cpu->cpsr & 0xFF00FFFF;
-                        cpu->cpsr |=   (value & 0x00FF0000);
-                    }
-                    if (((field_mask >> 3) & 1)) {
-                        cpu->cpsr = cpu->cpsr & 0x00FFFFFF;
-                        cpu->cpsr |=   (value & 0xFF000000);
+    u8 P = decoded_instruction.P;
+    u32 base_address = cpu->r[decoded_instruction.rn];
+    u16 register_list = decoded_instruction.register_list;
+    assert(register_list != 0);
+
+    int register_index = (decoded_instruction.U) ? 0 : 15;
+    u8 registers_set = 0;
+    while (register_list) {
+        if (decoded_instruction.U) {
+            // Increment
+            int register_index_set = register_list & 1;
+            if (register_index_set) {
+                registers_set++;
+
+                u32 address;
+                if (P) {
+                    base_address += 4;
+                    address = base_address;
+
+                    if (decoded_instruction.W) {
+                        cpu->r[decoded_instruction.rn] = base_address;
                     }
+                } else {
+                    address = base_address;
+                    base_address += 4;
+                    cpu->r[decoded_instruction.rn] = base_address;
                 }
-            } else {
-                if (current_mode_has_spsr(cpu)) {
-                    u32 *sr = get_spsr_current_mode(cpu);
 
-                    if (((field_mask >> 0) & 1)) {
-                        *sr =     *sr & 0xFFFFFF00;
-                        *sr |= (value & 0x000000FF);
-                    }
-                    if (((field_mask >> 1) & 1)) {
-                        *sr =     *sr & 0xFFFF00FF;
-                        *sr |= (value & 0x0000FF00);
+                if (register_index == 15) {
+                    assert(!"Check if I have to use the P flag (I think I do)");
+                    u32 value = bus_read32(base_address);
+                    if (value != 0) {
+                        cpu->pc = value & 0xFFFFFFFC;
+                        current_instruction = 0;
                     }
-                    if (((field_mask >> 2) & 1)) {
-                        *sr =     *sr & 0xFF00FFFF;
-                        *sr |= (value & 0x00FF0000);
+
+                    base_address += 4;
+
+                    assert("Add cpu cycles");
+                } else {
+                    cpu->r[(u8)register_index] = bus_read32(address);
+                }
+            }
+
+            register_index++;
+            register_list >>= 1;
+        } else {
+            // Decrement
+            assert(!"Implemented checking the manual, but when reach this point, let's re-check the implementation (just in case)");
+            assert(!"Add cpu cycles");
+            int register_index_set = (register_list >> 15) & 1;
+            if (register_index_set) {
+                u32 address;
+                if (P) {
+                    base_address -= 4;
+                    address = base_address;
+
+                    if (decoded_instruction.W) {
+                        cpu->r[decoded_instruction.rn] = base_address;
                     }
-                    if (((field_mask >> 3) & 1)) {
-                        *sr =     *sr & 0x00FFFFFF;
-                        *sr |= (value & 0xFF000000);
+                } else {
+                    address = base_address;
+                    base_address -= 4;
+                    cpu->r[decoded_instruction.rn] = base_address;
+                }
+
+                if (register_index == 15) {
+                    u32 value = bus_read32(base_address);
+                    cpu->pc = value & 0xFFFFFFFC;
+                    current_instruction = 0;
+
+                    base_address -= 4;
+                } else {
+                    cpu->r[(u8)register_index] = bus_read32(address);
+                }
+            }
+
+            register_index--;
+            register_list <<= 1;
+        }
+
+    }
+
+    cpu->cycles += registers_set + 2;
+}
+
+static void
+process_stm()
+{
+    if (decoded_instruction.S) {
+        assert(!"Not handled");
+    }
+
+    u8 P = decoded_instruction.P;
+    u32 base_address = cpu->r[decoded_instruction.rn];
+    u16 register_list = decoded_instruction.register_list;
+    assert(register_list != 0);
+
+    int register_index = (decoded_instruction.U) ? 0 : 15;
+    u8 registers_set = 0;
+
+    while (register_list) {
+        if (decoded_instruction.U) {
+            // Increment
+            int register_index_set = register_list & 1;
+            if (register_index_set) {
+                registers_set++;
+
+                u32 address;
+                if (P) {
+                    base_address += 4;
+                    address = base_address;
+
+                    if (decoded_instruction.W) {
+                        cpu->r[decoded_instruction.rn] = base_address;
                     }
+                } else {
+                    address = base_address;
+                    base_address += 4;
+                    cpu->r[decoded_instruction.rn] = base_address;
                 }
 
+                bus_write32(address, cpu->r[(u8)register_index]);
             }
 
+            register_index++;
+            register_list >>= 1;
+        } else {
+            // Decrement
+            int register_index_set = (register_list >> 15) & 1;
+            if (register_index_set) {
+                registers_set++;
 
-            // u32 *sr = &cpu->cpsr;
-            // if (decoded_instruction.P) {
-            //     sr = get_spsr_current_mode(cpu);
-            // }
+                u32 address;
+                if (P) {
+                    base_address -= 4;
+                    address = base_address;
 
-            // if (decoded_instruction.I) {
-            //     u8 imm = decoded_instruction.source_operand & 0xFF;
-            //     u32 rotate = (decoded_instruction.source_operand >> 8) & 0xF;
-            //     // NOTE: This value is zero extended to 32 bits, and then subject to a rotate right by twice the value in the rotate field.
-            //     rotate *= 2;
+                    if (decoded_instruction.W) {
+                        cpu->r[decoded_instruction.rn] = base_address;
+                    }
+                } else {
+                    address = base_address;
+                    base_address -= 4;
+                    cpu->r[decoded_instruction.rn] = base_address;
+                }
 
-            //     u32 value = rotate_right(imm, rotate, 8);
-            //     *sr = value;
-            // } else {
-            //     *sr = *get_register(cpu, decoded_instruction.rm);
-            // }
-        } break;
+                bus_write32(address, cpu->r[(u8)register_index]);
+            }
 
-        default: {
-            assert(!"Invalid instruction type for category");
+            register_index--;
+            register_list <<= 1;
         }
     }
 
-    cpu->cycles++;
+    cpu->cycles += registers_set + 1;
 }
 
 static void
-process_multiply()
+process_swp()
 {
-    switch (decoded_instruction.type) {
-        case INSTRUCTION_MUL: {
-            assert(!"Implement");
-        } break;
-        case INSTRUCTION_MLA: {
-            assert(!"Implement");
-        } break;
-        case INSTRUCTION_MULL: {
-            assert(!"Implement");
-        } break;
-        case INSTRUCTION_MLAL: {
-            assert(!"Implement");
-        } break;
+    u32 *rn = &cpu->r[decoded_instruction.rn];
+    u32 *rm = &cpu->r[decoded_instruction.rm];
+    u32 *rd = &cpu->r[decoded_instruction.rd];
+
+    if (decoded_instruction.B) {
+        u8 temp = bus_read8(*rn);
+        bus_write8(*rn, (u8)*rm);
+        *rd = temp;
+    } else {
+        u32 address = *rn;
+        int rotate_value = 8 * (address & 0b11);
+        u32 temp = rotate_right(bus_read32(address), rotate_value, 32);
 
-        default: {
-            assert(!"Invalid instruction type for category");
-        }
+        bus_write32(address, *rm);
+        *rd = temp;
     }
+
+    cpu->cycles += 4;
 }
 
-#define UPDATE_BASE_OFFSET()            \
-    do {                                \
-        if (decoded_instruction.U) {    \
-            base += offset;             \
-        } else {                        \
-            base -= offset;             \
-        }                               \
-    } while (0)
+static void
+process_swi()
+{
+    if (use_hle_bios && hle_bios_call(cpu, &memory, &block_cache, decoded_instruction.value_8)) {
+        cpu->cycles += 3;
+        return;
+    }
+
+    materialize_flags(cpu);
+    cpu->spsr_svc = cpu->cpsr;
+
+    set_mode(MODE_SUPERVISOR);
+    cpu->lr = decoded_instruction.address + 4; // Next instruction
+    set_control_bit_I(1); // Disable normal interrupts
+
+    cpu->pc = 0x8;
+    current_instruction = 0;
+
+    cpu->cycles += 3;
+}
 
 static void
-process_single_data_transfer()
+process_cdp()
 {
-    u32 base = *get_register(cpu, decoded_instruction.rn);
-    u32 offset = 0;
+    assert(!"Implement");
+}
 
-    if (decoded_instruction.I) {
-        // Offset is in register
+static void
+process_stc()
+{
+    assert(!"Implement");
+}
 
-        u8 carry;
-        u32 rm = *get_register(cpu, decoded_instruction.offset & 0xF);
-        u8 shift = (decoded_instruction.offset >> 4) & 0xFF;
-        u8 shift_type = (ShiftType)((shift >> 1) & 0b11);
-        if (shift & 1) {
-            // From register
-            assert(!"The manual does not specify this as valid addressing mode. ARM Architecture Reference Manual, page A5-19");
+static void
+process_ldc()
+{
+    assert(!"Implement");
+}
 
-            u8 rs = (shift >> 4) & 0xF ; // Register to the value to shift.
-            offset = apply_shift(rm, (u8)(*get_register(cpu, rs) & 0xF), shift_type, &carry);
-        } else {
-            // Shift immediate 5-bit value
+static void
+process_mcr()
+{
+    assert(!"Implement");
+}
 
-            u8 shift_value = (shift >> 3) & 0b11111;
-            // offset = (u16)apply_shift(offset_register, shift_amount, shift_type, &carry);
-            switch (shift_type) {
-                case SHIFT_TYPE_LOGICAL_LEFT: {
-                    offset = rm << shift_value;
-                } break;
-                case SHIFT_TYPE_LOGICAL_RIGHT: {
-                    if (shift_value == 0) {
-                        offset = 0;
-                    } else {
-                        offset = rm >> shift_value;
-                    }
-                } break;
-                case SHIFT_TYPE_ARITHMETIC_RIGHT: {
-                    if (shift_value == 0) {
-                        if (((rm >> 31) & 1) == 1) {
-                            offset = 0xFFFFFFFF;
-                        } else {
-                            offset = 0;
-                        }
-                    } else {
-                        offset = arithmetic_shift_right(rm, shift_value);
-                    }
-                } break;
-                case SHIFT_TYPE_ROTATE_RIGHT: {
-                    if (shift_value == 0) {
-                        offset = (CONDITION_C << 31) | (rm >> 1);
-                    } else {
-                        offset = rotate_right(rm, shift_value, 32);
-                    }
-                } break;
-            }
-        }
+static void
+process_mrc()
+{
+    assert(!"Implement");
+}
 
-    } else {
-        // Immediate value
+void
+execute()
+{
+    if (decoded_instruction.type == INSTRUCTION_NONE) goto exit_execute;
 
-        offset = (u16)decoded_instruction.offset;
+    // Do it only once the game starts.
+    if (!first_instruction_cartridge_executed && decoded_instruction.address == 0x8000000) {
+        // Setting all keys as "released" when the game begins (the bios "pressed" all the buttons).
+        // 0: Key is pressed
+        // 1: Key is not pressed
+        // There are 10 buttons, son this set all available buttons (not pressed).
+        *REG_KEYINPUT = 0x03FF;
+
+        first_instruction_cartridge_executed = true;
+    }
+    
+    if (IN_THUMB_MODE) {
+        thumb_execute();
+        return;
+    }
+
+    if (!should_execute_instruction(decoded_instruction.condition)) {
+        DEBUG_PRINT("0x%08X: 0x%08X %s, cpsr = 0x%08X, cycles = %lld... Skipped\n", decoded_instruction.address, decoded_instruction.encoding, get_instruction_type_string(decoded_instruction.type), cpu->cpsr, cpu->cycles);
+        cpu->cycles++;
+        
+        goto exit_execute;
     }
-
-    u8 P = decoded_instruction.P;
-    u8 B = decoded_instruction.B;
-    u32 *rd = get_register(cpu, decoded_instruction.rd);
     
-    switch (decoded_instruction.type) {
-        case INSTRUCTION_LDR: {
-            if (B) {
-                u8 *address;
-                if (P) {
-                    UPDATE_BASE_OFFSET();
-                    address = get_memory_at(cpu, &memory, base);
-
-                    if (decoded_instruction.W) {
-                        *get_register(cpu, decoded_instruction.rn) = base;
-                    }
-                } else {
-                    address = get_memory_at(cpu, &memory, base);
-                    UPDATE_BASE_OFFSET();
-                    *get_register(cpu, decoded_instruction.rn) = base;
-                }
-                
-                if (address != 0) *rd = *address;
-            } else {
-                u32 value = 0;
-                u32 *address;
-                if (P) {
-                    UPDATE_BASE_OFFSET();
-                    address = (u32 *)get_memory_at(cpu, &memory, base);
+    DEBUG_PRINT("0x%08X: 0x%08X %s, cpsr = 0x%08X, cycles = %lld\n", decoded_instruction.address, decoded_instruction.encoding, get_instruction_type_string(decoded_instruction.type), cpu->cpsr, cpu->cycles);
 
-                    if (decoded_instruction.W) {
-                        *get_register(cpu, decoded_instruction.rn) = base;
-                    }
-                } else {
-                    address = (u32 *)get_memory_at(cpu, &memory, base);
-                    UPDATE_BASE_OFFSET();
-                    *get_register(cpu, decoded_instruction.rn) = base;
-                }
+#ifdef THREADED_DISPATCH
+    // NOTE: Every slot defaults to the exit label, then the handled types override it.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init"
+    static void *handlers[INSTRUCTION_TYPE_COUNT] = {
+        [0 ... INSTRUCTION_TYPE_COUNT - 1]    = &&exit_execute,
+        [INSTRUCTION_B]                       = &&arm_b,
+        [INSTRUCTION_BX]                      = &&arm_bx,
+        [INSTRUCTION_AND ... INSTRUCTION_MVN] = &&arm_data_processing,
+        [INSTRUCTION_MRS]                     = &&arm_mrs,
+        [INSTRUCTION_MSR]                     = &&arm_msr,
+        [INSTRUCTION_MUL]                     = &&arm_mul,
+        [INSTRUCTION_MLA]                     = &&arm_mla,
+        [INSTRUCTION_MULL]                    = &&arm_mull,
+        [INSTRUCTION_MLAL]                    = &&arm_mlal,
+        [INSTRUCTION_LDR]                     = &&arm_ldr,
+        [INSTRUCTION_STR]                     = &&arm_str,
+        [INSTRUCTION_LDRH]                    = &&arm_ldrh,
+        [INSTRUCTION_STRH]                    = &&arm_strh,
+        [INSTRUCTION_LDRSB]                   = &&arm_ldrsb,
+        [INSTRUCTION_LDRSH]                   = &&arm_ldrsh,
+        [INSTRUCTION_LDM]                     = &&arm_ldm,
+        [INSTRUCTION_STM]                     = &&arm_stm,
+        [INSTRUCTION_SWP]                     = &&arm_swp,
+        [INSTRUCTION_SWI]                     = &&arm_swi,
+        [INSTRUCTION_CDP]                     = &&arm_cdp,
+        [INSTRUCTION_STC]                     = &&arm_stc,
+        [INSTRUCTION_LDC]                     = &&arm_ldc,
+        [INSTRUCTION_MCR]                     = &&arm_mcr,
+        [INSTRUCTION_MRC]                     = &&arm_mrc,
+    };
+#pragma GCC diagnostic pop
+
+    goto *handlers[decoded_instruction.type];
+#endif
 
-                if (address != 0) {
-                    u8 rotate_value = 8 * (base & 0b11);
-                    value = rotate_right(*address, rotate_value, 32);
-    
-                    if (*rd == 15) {
-                        cpu->pc = value & 0xFFFFFFFC; // NOTE: From "ARM Architecture Reference Manual"
-    
-                        // PC written, so it has to branch to that instruction and invalidate whatever the pre-fetched was.
-                        current_instruction = 0;
-    
-                        cpu->cycles += 2; // 2 Extra cycles on LDR PC
-                    } else {
-                        *rd = value;
-                    }
-                }
-            }
-            
-            cpu->cycles += 3;
+    switch (decoded_instruction.type) {
+        case INSTRUCTION_B: HANDLER(arm_b) {
+            process_b();
+        } break;
+        case INSTRUCTION_BX: HANDLER(arm_bx) {
+            process_bx();
+        } break;
+        // NOTE: The decoded instruction has the handler of the opcode, operand form and S bit.
+        case INSTRUCTION_AND: case INSTRUCTION_EOR: case INSTRUCTION_SUB: case INSTRUCTION_RSB:
+        case INSTRUCTION_ADD: case INSTRUCTION_ADC: case INSTRUCTION_SBC: case INSTRUCTION_RSC:
+        case INSTRUCTION_TST: case INSTRUCTION_TEQ: case INSTRUCTION_CMP: case INSTRUCTION_CMN:
+        case INSTRUCTION_ORR: case INSTRUCTION_MOV: case INSTRUCTION_BIC: case INSTRUCTION_MVN: HANDLER(arm_data_processing) {
+            process_data_processing();
+        } break;
+        case INSTRUCTION_MRS: HANDLER(arm_mrs) {
+            process_mrs();
+        } break;
+        case INSTRUCTION_MSR: HANDLER(arm_msr) {
+            process_msr();
+        } break;
+        case INSTRUCTION_MUL: HANDLER(arm_mul) {
+            process_mul();
+        } break;
+        case INSTRUCTION_MLA: HANDLER(arm_mla) {
+            process_mla();
+        } break;
+        case INSTRUCTION_MULL: HANDLER(arm_mull) {
+            process_mull();
+        } break;
+        case INSTRUCTION_MLAL: HANDLER(arm_mlal) {
+            process_mlal();
+        } break;
+        case INSTRUCTION_LDR: HANDLER(arm_ldr) {
+            process_ldr();
+        } break;
+        case INSTRUCTION_STR: HANDLER(arm_str) {
+            process_str();
+        } break;
+        case INSTRUCTION_LDRH: HANDLER(arm_ldrh) {
+            process_ldrh();
+        } break;
+        case INSTRUCTION_STRH: HANDLER(arm_strh) {
+            process_strh();
+        } break;
+        case INSTRUCTION_LDRSB: HANDLER(arm_ldrsb) {
+            process_ldrsb();
+        } break;
+        case INSTRUCTION_LDRSH: HANDLER(arm_ldrsh) {
+            process_ldrsh();
+        } break;
+        case INSTRUCTION_LDM: HANDLER(arm_ldm) {
+            process_ldm();
+        } break;
+        case INSTRUCTION_STM: HANDLER(arm_stm) {
+            process_stm();
+        } break;
+        case INSTRUCTION_SWP: HANDLER(arm_swp) {
+            process_swp();
+        } break;
+        case INSTRUCTION_SWI: HANDLER(arm_swi) {
+            process_swi();
+        } break;
+        case INSTRUCTION_CDP: HANDLER(arm_cdp) {
+            process_cdp();
+        } break;
+        case INSTRUCTION_STC: HANDLER(arm_stc) {
+            process_stc();
+        } break;
+        case INSTRUCTION_LDC: HANDLER(arm_ldc) {
+            process_ldc();
+        } break;
+        case INSTRUCTION_MCR: HANDLER(arm_mcr) {
+            process_mcr();
+        } break;
+        case INSTRUCTION_MRC: HANDLER(arm_mrc) {
+            process_mrc();
         } break;
-        case INSTRUCTION_STR: {
-            if (B) {
-                u8 *address;
-                if (P) {
-                    UPDATE_BASE_OFFSET();
-                    address = get_memory_at(cpu, &memory, base);
 
-                    if (decoded_instruction.W) {
-                        *get_register(cpu, decoded_instruction.rn) = base;
-                    }
-                } else {
-                    address = get_memory_at(cpu, &memory, base);
-                    UPDATE_BASE_OFFSET();
-                    *get_register(cpu, decoded_instruction.rn) = base;
-                }
+        default: break;
+    }
 
-                if (address != 0) *address = (*rd & 0xFF);
-            } else {
-                u32 *address;
-                if (P) {
-                    UPDATE_BASE_OFFSET();
-                    address = (u32 *)get_memory_at(cpu, &memory, base);
+exit_execute:
+    decoded_instruction = (Instruction){0};
+}
 
-                    if (decoded_instruction.W) {
-                        *get_register(cpu, decoded_instruction.rn) = base;
-                    }
-                } else {
-                    address = (u32 *)get_memory_at(cpu, &memory, base);
-                    UPDATE_BASE_OFFSET();
-                    *get_register(cpu, decoded_instruction.rn) = base;
-                }
 
-                if (address != 0) *address = *rd;
-            }
+//
+// ARM decoding
+//
+// Every ARM format can be told apart by bits 27-20 and 7-4 of the instruction, so those 12 bits index a
+// 4096-entry table with the decoder of each format. The table is built once at startup by running the
+// INSTRUCTION_FORMAT_* checks over every possible index.
+//
+typedef Instruction (*ArmDecodeFunction)(u32 instruction);
 
-            cpu->cycles += 2;
+#define ARM_DECODE_TABLE_SIZE           (4096)
+#define ARM_DECODE_INDEX(instruction)   ((((instruction) >> 16) & 0xFF0) | (((instruction) >> 4) & 0xF))
 
-        } break;
+static ArmDecodeFunction arm_decode_table[ARM_DECODE_TABLE_SIZE];
 
-        default: {
-            assert(!"Invalid instruction type for category");
-        }
-    }
+static Instruction
+decode_arm_software_interrupt(u32 instruction)
+{
+    return (Instruction) {
+        .type = INSTRUCTION_SWI,
+        .value_8 = (instruction >> 16) & 0xFF, // The BIOS takes the function number from bits 16-23 of the comment field
+    };
 }
 
-static void
-process_halfword_and_signed_data_transfer()
+static Instruction
+decode_arm_coprocessor_register_transfer(u32 instruction)
 {
-    switch (decoded_instruction.type) {
-        case INSTRUCTION_LDRH: {
-            assert(decoded_instruction.rd != 15);
+    u8 L = (instruction >> 20) & 1;
+    InstructionType type = 0;
+    switch (L) {
+        case 0: type = INSTRUCTION_MCR; break;
+        case 1: type = INSTRUCTION_MRC; break;
+    }
 
-            u32 base = *get_register(cpu, decoded_instruction.rn);
-            u32 offset;
-            if (decoded_instruction.I) {
-                offset = decoded_instruction.offset;
-            } else {
-                offset = *get_register(cpu, decoded_instruction.rm);
-            }
+    return (Instruction) {
+        .type = type,
+    };
+}
 
-            if (decoded_instruction.P) {
-                UPDATE_BASE_OFFSET();
+static Instruction
+decode_arm_coprocessor_data_operation(u32 instruction)
+{
+    (void)instruction;
 
-                u8 *address = get_memory_at(cpu, &memory, base);
-                if (address != 0) *get_register(cpu, decoded_instruction.rd) = *((u16 *)address);
+    return (Instruction) {
+        .type = INSTRUCTION_CDP,
+    };
+}
 
-                if (decoded_instruction.W) {
-                    *get_register(cpu, decoded_instruction.rn) = base;
-                }
-            } else {
-                u8 *address = get_memory_at(cpu, &memory, base);
-                if (address != 0) *get_register(cpu, decoded_instruction.rd) = *((u16 *)address);
+static Instruction
+decode_arm_coprocessor_data_transfer(u32 instruction)
+{
+    u8 L = (instruction >> 20) & 1;
+    InstructionType type = 0;
+    switch (L) {
+        case 0: type = INSTRUCTION_STC; break;
+        case 1: type = INSTRUCTION_LDC; break;
+    }
 
-                UPDATE_BASE_OFFSET();
-                *get_register(cpu, decoded_instruction.rn) = base;
-            }
+    return (Instruction) {
+        .type = type,
+    };
+}
 
-            cpu->cycles += 3;
+static Instruction
+decode_arm_branch(u32 instruction)
+{
+    return (Instruction) {
+        .type = INSTRUCTION_B,
+        .offset = instruction & 0xFFFFFF,
+        .L = (u8)((instruction >> 24) & 1),
+    };
+}
 
-        } break;
-        case INSTRUCTION_STRH: {
-            u32 base = *get_register(cpu, decoded_instruction.rn);
-            u32 offset;
-            if (decoded_instruction.I) {
-                offset = decoded_instruction.offset;
-            } else {
-                offset = *get_register(cpu, decoded_instruction.rm);
-            }
+static Instruction
+decode_arm_block_data_transfer(u32 instruction)
+{
+    int opcode = (instruction >> 20) & 1;
+    InstructionType type = 0;
+    switch (opcode) {
+        case 0: type = INSTRUCTION_STM; break;
+        case 1: type = INSTRUCTION_LDM; break;
+    }
 
-            if (decoded_instruction.P) {
-                UPDATE_BASE_OFFSET();
+    Instruction result = (Instruction) {
+        .type = type,
+        .P = (instruction >> 24) & 1,
+        .U = (instruction >> 23) & 1,
+        .S = (instruction >> 22) & 1,
+        .W = (instruction >> 21) & 1,
+        .L = (instruction >> 20) & 1,
+        .rn = (instruction >> 16) & 0xF,
+        .register_list = instruction & 0xFFFF,
+    };
+
+    if (result.S) {
+        result.W = 0; // NOTE: Setting bit 21 (the W bit) has UNPREDICTABLE results, so let's force to 0.
+    }
 
-                u8 *address = get_memory_at(cpu, &memory, base);
-                if (address != 0) *((u16 *)address) = (u16)*get_register(cpu, decoded_instruction.rd);
+    // NOTE: R15 should not be used as the base register in any LDM or STM instruction.
+    assert(result.rn != 15);
 
-                if (decoded_instruction.W) {
-                    *get_register(cpu, decoded_instruction.rn) = base;
-                }
-            } else {
-                u8 *address = get_memory_at(cpu, &memory, base);
-                if (address != 0) *((u16 *)address) = (u16)*get_register(cpu, decoded_instruction.rd);
+    // NOTE: Any subset of the registers, or all the registers, may be specified. The only restriction is that the register list should not be empty.
+    assert(result.register_list > 0);
 
-                UPDATE_BASE_OFFSET();
-                *get_register(cpu, decoded_instruction.rn) = base;
-            }
-            
-            cpu->cycles += 2;
+    return result;
+}
 
-        } break;
-        case INSTRUCTION_LDRSB: {
-            assert(decoded_instruction.rd != 15);
-            
-            u32 base = *get_register(cpu, decoded_instruction.rn);
-            u32 offset;
-            if (decoded_instruction.I) {
-                offset = decoded_instruction.offset;
-            } else {
-                offset = *get_register(cpu, decoded_instruction.rm);
-            }
+static Instruction
+decode_arm_single_data_transfer(u32 instruction)
+{
+    int opcode = (instruction >> 20) & 1;
+    InstructionType type = 0;
+    switch (opcode) {
+        case 0: type = INSTRUCTION_STR; break;
+        case 1: type = INSTRUCTION_LDR; break;
+    }
 
+    return (Instruction) {
+        .type = type,
+        .I = (instruction >> 25) & 1,
+        .P = (instruction >> 24) & 1,
+        .U = (instruction >> 23) & 1,
+        .B = (instruction >> 22) & 1,
+        .W = (instruction >> 21) & 1,
+        .L = (instruction >> 20) & 1,
+        .rn = (instruction >> 16) & 0xF,
+        .rd = (instruction >> 12) & 0xF,
+        .offset = instruction & 0xFFF,
+    };
+}
 
-            if (decoded_instruction.P) {
-                UPDATE_BASE_OFFSET();
+static InstructionType
+get_halfword_data_transfer_type(u8 S, u8 H, u8 L)
+{
+    InstructionType type = 0;
+    if (S == 0 && H == 1) {
+        if (L) {
+            // load
+            type = INSTRUCTION_LDRH;
+        } else {
+            type = INSTRUCTION_STRH;
+        }
+    } else if (S == 1 && H == 0) {
+        type = INSTRUCTION_LDRSB;
+    } else {
+        type = INSTRUCTION_LDRSH;
+    }
 
-                u8 *address = get_memory_at(cpu, &memory, base);
-                if (address != 0) {
-                    u8 value = *address;
-                    u8 sign = (value >> 7) & 1;
-                    u32 value_sign_extended = (((u32)-sign) << 8) | value;
-    
-                    *get_register(cpu, decoded_instruction.rd) = value_sign_extended;
-                    
-                    if (decoded_instruction.W) {
-                        *get_register(cpu, decoded_instruction.rn) = base;
-                    }
-                }
+    return type;
+}
 
-            } else {
-                u8 *address = get_memory_at(cpu, &memory, base);
-                if (address != 0) {
-                    u8 value = *address;
-                    u8 sign = (value >> 7) & 1;
-                    u32 value_sign_extended = (((u32)-sign) << 8) | value;
-    
-                    *get_register(cpu, decoded_instruction.rd) = value_sign_extended;
-    
-                    UPDATE_BASE_OFFSET();
-                    *get_register(cpu, decoded_instruction.rn) = base;
-                }
-            }
+static Instruction
+decode_arm_halfword_data_transfer_immediate_offset(u32 instruction)
+{
+    u8 H = (instruction >> 5) & 1;
+    u8 S = (instruction >> 6) & 1;
+    u8 L = (instruction >> 20) & 1;
+
+    return (Instruction) {
+        .type = get_halfword_data_transfer_type(S, H, L),
+        .offset = ((instruction >> 4) & 0xF0) | (instruction & 0xF),
+        .H = H,
+        .S = S,
+        .rd = (instruction >> 12) & 0xF,
+        .rn = (instruction >> 16) & 0xF,
+        .L = L,
+        .I = (instruction >> 22) & 1,
+        .W = (instruction >> 21) & 1,
+        .U = (instruction >> 23) & 1,
+        .P = (instruction >> 24) & 1,
+    };
+}
 
-            cpu->cycles += 3;
+static Instruction
+decode_arm_halfword_data_transfer_register_offset(u32 instruction)
+{
+    u8 H = (instruction >> 5) & 1;
+    u8 S = (instruction >> 6) & 1;
+    u8 L = (instruction >> 20) & 1;
+
+    // if (L == 0 && S == 1) assert(!"Bad flags");
+
+    return (Instruction) {
+        .type = get_halfword_data_transfer_type(S, H, L),
+        .rm = instruction & 0xF,
+        .H = H,
+        .S = S,
+        .rd = (instruction >> 12) & 0xF,
+        .rn = (instruction >> 16) & 0xF,
+        .L = L,
+        .W = (instruction >> 21) & 1,
+        .U = (instruction >> 23) & 1,
+        .P = (instruction >> 24) & 1,
+    };
+}
 
-        } break;
-        case INSTRUCTION_LDRSH: {
-            assert(decoded_instruction.rd != 15);
-            
-            u32 base = *get_register(cpu, decoded_instruction.rn);
-            u32 offset;
-            if (decoded_instruction.I) {
-                offset = decoded_instruction.offset;
-            } else {
-                offset = *get_register(cpu, decoded_instruction.rm);
-            }
+static Instruction
+decode_arm_single_data_swap(u32 instruction)
+{
+    return (Instruction) {
+        .type = INSTRUCTION_SWP,
+        .rm = instruction & 0xF,
+        .rd = (instruction >> 12) & 0xF,
+        .rn = (instruction >> 16) & 0xF,
+        .B = (instruction >> 22) & 1,
+    };
+}
 
+static Instruction
+decode_arm_multiply_long(u32 instruction)
+{
+    u8 A = (instruction >> 21) & 1;
+    InstructionType type = 0;
+    switch (A) {
+        case 0: type = INSTRUCTION_MULL; break;
+        case 1: type = INSTRUCTION_MLAL; break;
+    }
 
-            if (decoded_instruction.P) {
-                UPDATE_BASE_OFFSET();
+    return (Instruction) {
+        .type = type,
+        .rm = instruction & 0xF,
+        .rs = (instruction >> 8) & 0xF,
+        .rdlo = (instruction >> 12) & 0xF,
+        .rdhi = (instruction >> 16) & 0xF,
+        .S = (instruction >> 20) & 1,
+        .A = A,
+        .U = (instruction >> 22) & 1,
+    };
+}
 
-                u8 *address = get_memory_at(cpu, &memory, base);
-                if (address != 0) {
-                    u16 value = *((u16 *)address);
-                    u8 sign = (value >> 15) & 1;
-                    u32 value_sign_extended = (((u32)-sign) << 16) | value;
-    
-                    *get_register(cpu, decoded_instruction.rd) = value_sign_extended;
-    
-                    if (decoded_instruction.W) {
-                        *get_register(cpu, decoded_instruction.rn) = base;
-                    }
-                }
-            } else {
-                u8 *address = get_memory_at(cpu, &memory, base);
-                if (address != 0) {
-                    u16 value = *((u16 *)address);
-                    u8 sign = (value >> 15) & 1;
-                    u32 value_sign_extended = (((u32)-sign) << 16) | value;
-    
-                    *get_register(cpu, decoded_instruction.rd) = value_sign_extended;
-    
-                    UPDATE_BASE_OFFSET();
-                    *get_register(cpu, decoded_instruction.rn) = base;
-                }
-            }
+static Instruction
+decode_arm_multiply(u32 instruction)
+{
+    u8 A = (instruction >> 21) & 1;
+    InstructionType type = 0;
+    switch (A) {
+        case 0: type = INSTRUCTION_MUL; break;
+        case 1: type = INSTRUCTION_MLA; break;
+    }
 
-            cpu->cycles += 3;
+    return (Instruction) {
+        .type = type,
+        .rm = instruction & 0xF,
+        .rs = (instruction >> 8) & 0xF,
+        .rn = (instruction >> 12) & 0xF,
+        .rd = (instruction >> 16) & 0xF,
+        .S = (instruction >> 20) & 1,
+        .A = A,
+    };
+}
 
-        } break;
+static Instruction
+decode_arm_data_processing(u32 instruction)
+{
+    int opcode = (instruction >> 21) & 0b1111;
+    InstructionType type = 0;
+    switch (opcode) {
+        case 0b0000: type = INSTRUCTION_AND; break;
+        case 0b0001: type = INSTRUCTION_EOR; break;
+        case 0b0010: type = INSTRUCTION_SUB; break;
+        case 0b0011: type = INSTRUCTION_RSB; break;
+        case 0b0100: type = INSTRUCTION_ADD; break;
+        case 0b0101: type = INSTRUCTION_ADC; break;
+        case 0b0110: type = INSTRUCTION_SBC; break;
+        case 0b0111: type = INSTRUCTION_RSC; break;
+        case 0b1000: type = INSTRUCTION_TST; break;
+        case 0b1001: type = INSTRUCTION_TEQ; break;
+        case 0b1010: type = INSTRUCTION_CMP; break;
+        case 0b1011: type = INSTRUCTION_CMN; break;
+        case 0b1100: type = INSTRUCTION_ORR; break;
+        case 0b1101: type = INSTRUCTION_MOV; break;
+        case 0b1110: type = INSTRUCTION_BIC; break;
+        case 0b1111: type = INSTRUCTION_MVN; break;
+    }
 
-        default: {
-            assert(!"Invalid instruction type for category");
+    u8 S = (instruction >> 20) & 1;
+    Instruction result = (Instruction) {
+        .type = type,
+        .S = S, // Set condition codes
+        .I = (instruction >> 25) & 1, // Immediate operand
+        .rn = (instruction >> 16) & 0xF, // Source register
+        .rd = (instruction >> 12) & 0xF, // Destination register
+        .second_operand = instruction & ((1 << 12) - 1),
+    };
+
+    if (S == 0 && (type == INSTRUCTION_TST ||
+                   type == INSTRUCTION_TEQ ||
+                   type == INSTRUCTION_CMP ||
+                   type == INSTRUCTION_CMN))
+    {
+        u8 special_type = (instruction >> 16) & 0b111111;
+        switch (special_type) {
+            case 0b001111: {
+                result = (Instruction) {
+                    .type = INSTRUCTION_MRS,
+                    .P = (instruction >> 22) & 1,
+                    .rd = (instruction >> 12) & 0xF,
+                };
+            } break;
+            case 0b101001: {
+                result = (Instruction) {
+                    .type = INSTRUCTION_MSR,
+                    .P = (instruction >> 22) & 1,
+                    .rm = instruction & 0xF,
+                    .mask = (instruction >> 16) & 0xF,
+                };
+            } break;
+            case 0b101000: {
+                result = (Instruction) {
+                    .type = INSTRUCTION_MSR,
+                    .P = (instruction >> 22) & 1,
+                    .source_operand = instruction & 0xFFF,
+                    .I = 1, // To be recognized as immediate
+                    .mask = (instruction >> 16) & 0xF,
+                };
+            } break;
+            default: {
+                // If does not meet the requirements to be the previous instructions, just keep the original one and set the S flag.
+                // NOTE: An assembler should always set the S flag for these instructions even if this is not specified in the mnemonic.
+                result.S = 1;
+            }
         }
     }
+
+    if (result.type >= INSTRUCTION_AND && result.type <= INSTRUCTION_MVN) {
+        result.data_processing_handler = get_data_processing_handler(&result);
+    }
+
+    return result;
 }
 
-#undef UPDATE_BASE_OFFSET
+static Instruction
+decode_arm_branch_and_exchange(u32 instruction)
+{
+    // NOTE: Bits 19-8 of BX are not part of the decode table index, so the same entry is shared with the
+    // data processing instructions that only differ in those bits.
+    if ((instruction & INSTRUCTION_FORMAT_BRANCH_AND_EXCHANGE) != INSTRUCTION_FORMAT_BRANCH_AND_EXCHANGE) {
+        return decode_arm_data_processing(instruction);
+    }
 
+    return (Instruction) {
+        .type = INSTRUCTION_BX,
+        .rn = (instruction & 0xF),
+    };
+}
 
-static void
-process_block_data_transfer()
+static ArmDecodeFunction
+get_arm_decode_function(u32 instruction)
 {
-    if (decoded_instruction.S) {
-        assert(!"Not handled");
+    // Bits 19-8 are not in the index, but BX requires all of them set.
+    u32 instruction_bx = instruction | (0xFFF << 8);
+
+    if ((instruction & INSTRUCTION_FORMAT_SOFTWARE_INTERRUPT) == INSTRUCTION_FORMAT_SOFTWARE_INTERRUPT) {
+        return decode_arm_software_interrupt;
+    }
+    if ((instruction & INSTRUCTION_FORMAT_COPROCESSOR_REGISTER_TRANSFER) == INSTRUCTION_FORMAT_COPROCESSOR_REGISTER_TRANSFER) {
+        return decode_arm_coprocessor_register_transfer;
+    }
+    if ((instruction & INSTRUCTION_FORMAT_COPROCESSOR_DATA_OPERATION) == INSTRUCTION_FORMAT_COPROCESSOR_DATA_OPERATION) {
+        return decode_arm_coprocessor_data_operation;
+    }
+    if ((instruction & INSTRUCTION_FORMAT_COPROCESSOR_DATA_TRANSFER) == INSTRUCTION_FORMAT_COPROCESSOR_DATA_TRANSFER) {
+        return decode_arm_coprocessor_data_transfer;
+    }
+    if ((instruction & INSTRUCTION_FORMAT_BRANCH) == INSTRUCTION_FORMAT_BRANCH) {
+        return decode_arm_branch;
+    }
+    if ((instruction & INSTRUCTION_FORMAT_BLOCK_DATA_TRANSFER) == INSTRUCTION_FORMAT_BLOCK_DATA_TRANSFER) {
+        return decode_arm_block_data_transfer;
+    }
+    if ((instruction & INSTRUCTION_FORMAT_SINGLE_DATA_TRANSFER) == INSTRUCTION_FORMAT_SINGLE_DATA_TRANSFER) {
+        return decode_arm_single_data_transfer;
     }
 
-    u8 P = decoded_instruction.P;
-    switch (decoded_instruction.type) {
-        case INSTRUCTION_LDM: {
-            u32 base_address = *get_register(cpu, decoded_instruction.rn);
-            u16 register_list = decoded_instruction.register_list;
-            assert(register_list != 0);
+    if ((instruction & INSTRUCTION_FORMAT_HALFWORD_DATA_TRANSFER_IMMEDIATE_OFFSET) == INSTRUCTION_FORMAT_HALFWORD_DATA_TRANSFER_IMMEDIATE_OFFSET ||
+        (instruction & INSTRUCTION_FORMAT_HALFWORD_DATA_TRANSFER_REGISTER_OFFSET) == INSTRUCTION_FORMAT_HALFWORD_DATA_TRANSFER_REGISTER_OFFSET)
+    {
+        if ((instruction >> 25) & 1) {
+            // HALFWORD_DATA_TRANSFER does not have the 25-bit set; it should be a DATA_PROCESSING instruction.
+            return decode_arm_data_processing;
+        }
 
-            int register_index = (decoded_instruction.U) ? 0 : 15;
-            u8 registers_set = 0;
-            while (register_list) {
-                if (decoded_instruction.U) {
-                    // Increment
-                    int register_index_set = register_list & 1;
-                    if (register_index_set) {
-                        registers_set++;
+        u8 H = (instruction >> 5) & 1;
+        u8 S = (instruction >> 6) & 1;
+        if (S == 0 && H == 0) return decode_arm_single_data_swap;
 
-                        u32 *address;
-                        if (P) {
-                            base_address += 4;
-                            address = (u32 *)get_memory_at(cpu, &memory, base_address);
-                            
-                            if (decoded_instruction.W) {
-                                *get_register(cpu, decoded_instruction.rn) = base_address;
-                            }
-                        } else {
-                            address = (u32 *)get_memory_at(cpu, &memory, base_address);
-                            base_address += 4;
-                            *get_register(cpu, decoded_instruction.rn) = base_address;
-                        }
+        if ((instruction & INSTRUCTION_FORMAT_HALFWORD_DATA_TRANSFER_IMMEDIATE_OFFSET) == INSTRUCTION_FORMAT_HALFWORD_DATA_TRANSFER_IMMEDIATE_OFFSET) {
+            return decode_arm_halfword_data_transfer_immediate_offset;
+        }
 
-                        if (register_index == 15) {
-                            assert(!"Check if I have to use the P flag (I think I do)");
-                            u32 value = *(u32 *)get_memory_at(cpu, &memory, base_address);
-                            if (value != 0) {
-                                cpu->pc = value & 0xFFFFFFFC;
-                                current_instruction = 0;
-                            }
+        return decode_arm_halfword_data_transfer_register_offset;
+    }
 
-                            base_address += 4;
+    if ((instruction_bx & INSTRUCTION_FORMAT_BRANCH_AND_EXCHANGE) == INSTRUCTION_FORMAT_BRANCH_AND_EXCHANGE) {
+        return decode_arm_branch_and_exchange;
+    }
+    if ((instruction & INSTRUCTION_FORMAT_SINGLE_DATA_SWAP) == INSTRUCTION_FORMAT_SINGLE_DATA_SWAP) {
+        return decode_arm_single_data_swap;
+    }
+    if ((instruction & INSTRUCTION_FORMAT_MULTIPLY_LONG) == INSTRUCTION_FORMAT_MULTIPLY_LONG) {
+        return decode_arm_multiply_long;
+    }
+    if ((instruction & INSTRUCTION_FORMAT_MULTIPLY) == INSTRUCTION_FORMAT_MULTIPLY) {
+        return decode_arm_multiply;
+    }
 
-                            assert("Add cpu cycles");
-                        } else {
-                            u32 value = 0;
-                            if (address != 0) {
-                                value = *address;
-                            }
+    return decode_arm_data_processing;
+}
 
-                            *get_register(cpu, (u8)register_index) = value;
-                        }
-                    }
+void
+init_arm_decode_table()
+{
+    for (u32 index = 0; index < ARM_DECODE_TABLE_SIZE; ++index) {
+        // Rebuild an instruction that only has the index bits set (27-20 and 7-4).
+        u32 instruction = ((index & 0xFF0) << 16) | ((index & 0xF) << 4);
+        arm_decode_table[index] = get_arm_decode_function(instruction);
+    }
+}
 
-                    register_index++;
-                    register_list >>= 1;
-                } else {
-                    // Decrement
-                    assert(!"Implemented checking the manual, but when reach this point, let's re-check the implementation (just in case)");
-                    assert(!"Add cpu cycles");
-                    int register_index_set = (register_list >> 15) & 1;
-                    if (register_index_set) {
-                        u32 *address;
-                        if (P) {
-                            base_address -= 4;
-                            address = (u32 *)get_memory_at(cpu, &memory, base_address);
-                            
-                            if (decoded_instruction.W) {
-                                *get_register(cpu, decoded_instruction.rn) = base_address;
-                            }
-                        } else {
-                            address = (u32 *)get_memory_at(cpu, &memory, base_address);
-                            base_address -= 4;
-                            *get_register(cpu, decoded_instruction.rn) = base_address;
-                        }
+static Instruction
+decode_arm_instruction(u32 instruction, u32 address)
+{
+    Instruction result = arm_decode_table[ARM_DECODE_INDEX(instruction)](instruction);
+    result.condition = (instruction >> 28) & 0xF;
+    result.address = address;
+    result.encoding = instruction;
 
-                        if (register_index == 15) {
-                            u32 value = *(u32 *)get_memory_at(cpu, &memory, base_address);
-                            cpu->pc = value & 0xFFFFFFFC;
-                            current_instruction = 0;
+    return result;
+}
 
-                            base_address -= 4;
-                        } else {
-                            if (address != 0) *get_register(cpu, (u8)register_index) = *address;
-                        }
-                    }
+void
+decode()
+{
+    if (IN_THUMB_MODE) {
+        thumb_decode();
+        return;
+    }
 
-                    register_index--;
-                    register_list <<= 1;
-                }
+    if (current_instruction == 0) return;
 
-            }
+    decoded_instruction = decode_arm_instruction(current_instruction, cpu->pc - 4);
 
-            cpu->cycles += registers_set + 2;
+    current_instruction = 0;
+}
 
-        } break;
+void
+fetch()
+{
+    if (IN_THUMB_MODE) {
+        thumb_fetch();
+    } else {
+        current_instruction = bus_read32(cpu->pc);
+        cpu->pc += 4;
+    }
+}
 
-        case INSTRUCTION_STM: {
-            u32 base_address = *get_register(cpu, decoded_instruction.rn);
-            u16 register_list = decoded_instruction.register_list;
-            assert(register_list != 0);
 
-            u8 P = decoded_instruction.P;
 
-            int register_index = (decoded_instruction.U) ? 0 : 15;
-            u8 registers_set = 0;
+static u32 current_frame = 0;
+static u64 run_end_cycles; // Where the current run_cycles() stops
+
+/**
+ * Nothing runs while the CPU is halted, so the cycles go straight to the next event of the scheduler (or
+ * to the end of the run), until one of the events requests an interrupt enabled in IE. The halt ends even
+ * with IME clear, the interrupt is only taken if it is set.
+ */
+static void
+run_halted()
+{
+    if (*REG_IE & *REG_IF) {
+        cpu->halted = false;
+        return;
+    }
+
+    u64 end_cycles = (scheduler.next_event_cycles < run_end_cycles) ? scheduler.next_event_cycles : run_end_cycles;
+    if (cpu->cycles < end_cycles) cpu->cycles = end_cycles;
+    run_events();
+}
+
+/**
+ * IRQ exception, between two instructions: the CPU enters IRQ mode in ARM state with IRQs disabled and
+ * jumps to the vector of the BIOS, which calls the handler of the game (at 0x03007FFC). The handler
+ * returns with SUBS PC, LR, #4, so LR is the next instruction to execute + 4 in both states.
+ */
+static void
+take_irq()
+{
+    u32 next_address = cpu->pc;
+    if (decoded_instruction.type != INSTRUCTION_NONE) {
+        next_address = decoded_instruction.address;
+    } else if (current_instruction != 0) {
+        next_address -= IN_THUMB_MODE ? 2 : 4;
+    }
 
-            while (register_list) {
-                if (decoded_instruction.U) {
-                    // Increment
-                    int register_index_set = register_list & 1;
-                    if (register_index_set) {
-                        registers_set++;
+    materialize_flags(cpu);
+    u32 cpsr = cpu->cpsr;
 
-                        u32 *address;
-                        if (P) {
-                            base_address += 4;
-                            address = (u32 *)get_memory_at(cpu, &memory, base_address);
-                            
-                            if (decoded_instruction.W) {
-                                *get_register(cpu, decoded_instruction.rn) = base_address;
-                            }
-                        } else {
-                            address = (u32 *)get_memory_at(cpu, &memory, base_address);
-                            base_address += 4;
-                            *get_register(cpu, decoded_instruction.rn) = base_address;
-                        }
+    set_mode(MODE_IRQ);
+    cpu->spsr_irq = cpsr;
+    cpu->lr = next_address + 4;
+    set_control_bit_T(0); // Execute in ARM state
+    set_control_bit_I(1); // Disable normal interrupts
 
-                        if (address != 0) *address = *get_register(cpu, (u8)register_index);
-                    }
+    cpu->pc = 0x18;
+    current_instruction = 0;
+    decoded_instruction = (Instruction){0};
+    cpu->halted = false;
 
-                    register_index++;
-                    register_list >>= 1;
-                } else {
-                    // Decrement
-                    int register_index_set = (register_list >> 15) & 1;
-                    if (register_index_set) {
-                        registers_set++;
+    cpu->cycles += 3;
+    run_events();
+}
 
-                        u32 *address;
-                        if (P) {
-                            base_address -= 4;
-                            address = (u32 *)get_memory_at(cpu, &memory, base_address);
-                            
-                            if (decoded_instruction.W) {
-                                *get_register(cpu, decoded_instruction.rn) = base_address;
-                            }
-                        } else {
-                            address = (u32 *)get_memory_at(cpu, &memory, base_address);
-                            base_address -= 4;
-                            *get_register(cpu, decoded_instruction.rn) = base_address;
-                        }
 
-                        if (address != 0) *address = *get_register(cpu, (u8)register_index);
-                    }
+//
+// Cached interpreter
+//
+// When the pipeline is empty (after a branch), the instructions are executed from a block of already
+// decoded instructions instead of going through fetch() and decode() again.
+//
 
-                    register_index--;
-                    register_list <<= 1;
-                }
+static bool
+ends_basic_block(Instruction *instruction, u8 thumb)
+{
+    if (thumb) {
+        switch (instruction->type) {
+            case INSTRUCTION_HI_REGISTER_OPERATIONS_BRANCH_EXCHANGE: {
+                // BX, or ADD/MOV writing to the PC.
+                return instruction->op == 3 || (instruction->op != 1 && instruction->H1 && instruction->rd == 7);
+            }
+            case INSTRUCTION_PUSH_POP_REGISTERS: {
+                return instruction->L && instruction->R; // POP {PC}
+            }
+            case INSTRUCTION_LONG_BRANCH_WITH_LINK: {
+                return instruction->H;
+            }
+            case INSTRUCTION_CONDITIONAL_BRANCH:
+            case INSTRUCTION_SOFTWARE_INTERRUPT:
+            case INSTRUCTION_UNCONDITIONAL_BRANCH: {
+                return true;
+            }
+            default: {
+                return false;
             }
-            
-            cpu->cycles += registers_set + 1;
-            
-        } break;
-
-        default: {
-            assert(!"Invalid instruction type for category");
         }
     }
-}
-static void
-process_single_data_swap()
-{
-    switch (decoded_instruction.type) {
-        case INSTRUCTION_SWP: {
-            u32 *rn = get_register(cpu, decoded_instruction.rn);
-            u32 *rm = get_register(cpu, decoded_instruction.rm);
-            u32 *rd = get_register(cpu, decoded_instruction.rd);
-            
-            if (decoded_instruction.B) {
-                u8 *address = get_memory_at(cpu, &memory, *rn);
-                if (address != 0) {
-                    u8 temp = *address;
-                    *address = (u8)*rm;
-                    *rd = temp;
-                }
-            } else {
-                u32 *address = (u32 *)get_memory_at(cpu, &memory, *rn);
-                if (address != 0) {
-                    int rotate_value = 8 * (*rn & 0b11);
-                    u32 temp = rotate_right(*address, rotate_value, 32);
-    
-                    *address = *rm;
-                    *rd = temp;
-                }
-            }
-
-            cpu->cycles += 4;
-        } break;
 
+    switch (instruction_categories[instruction->type]) {
+        case INSTRUCTION_CATEGORY_BRANCH:
+        case INSTRUCTION_CATEGORY_PSR_TRANSFER: // The mode or the state may change
+        case INSTRUCTION_CATEGORY_SOFTWARE_INTERRUPT:
+        case INSTRUCTION_CATEGORY_COPROCESSOR_DATA_OPERATIONS:
+        case INSTRUCTION_CATEGORY_COPROCESSOR_DATA_TRANSFERS:
+        case INSTRUCTION_CATEGORY_COPROCESSOR_REGISTER_TRANSFERS: {
+            return true;
+        }
+        case INSTRUCTION_CATEGORY_BLOCK_DATA_TRANSFER: {
+            return instruction->L && ((instruction->register_list >> 15) & 1);
+        }
         default: {
-            assert(!"Invalid instruction type for category");
+            return instruction->rd == 15;
         }
     }
 }
 
-static void
-process_software_interrupt()
+/**
+ * Whether the instruction can be part of an idle loop: it may read memory and change registers (other
+ * than the PC) and flags, but not write memory or change the mode.
+ */
+static bool
+is_idle_loop_instruction(Instruction *instruction, u8 thumb)
 {
-    switch (decoded_instruction.type) {
-        case INSTRUCTION_SWI: {
-            assert(!"Implement");
-        } break;
-
-        default: {
-            assert(!"Invalid instruction type for category");
+    if (thumb) {
+        switch (instruction->type) {
+            case INSTRUCTION_MOVE_SHIFTED_REGISTER:
+            case INSTRUCTION_ADD_SUBTRACT:
+            case INSTRUCTION_MOVE_COMPARE_ADD_SUBTRACT_IMMEDIATE:
+            case INSTRUCTION_ALU_OPERATIONS:
+            case INSTRUCTION_PC_RELATIVE_LOAD:
+            case INSTRUCTION_LOAD_ADDRESS:
+            case INSTRUCTION_ADD_OFFSET_TO_STACK_POINTER: {
+                return true;
+            }
+            case INSTRUCTION_HI_REGISTER_OPERATIONS_BRANCH_EXCHANGE: {
+                return instruction->op != 3 && !(instruction->H1 && instruction->rd == 7);
+            }
+            case INSTRUCTION_LOAD_STORE_WITH_REGISTER_OFFSET:
+            case INSTRUCTION_LOAD_STORE_WITH_IMMEDIATE_OFFSET:
+            case INSTRUCTION_LOAD_STORE_HALFWORD:
+            case INSTRUCTION_SP_RELATIVE_LOAD_STORE: {
+                return instruction->L;
+            }
+            case INSTRUCTION_LOAD_STORE_SIGN_EXTENDED_BYTE_HALFWORD: {
+                return instruction->S || instruction->H; // Anything but STRH
+            }
+            default: {
+                return false;
+            }
         }
     }
-}
 
-static void
-process_coprocessor_data_operations()
-{
-    switch (decoded_instruction.type) {
-        case INSTRUCTION_CDP: {
-            assert(!"Implement");
-        } break;
+    if (instruction->rd == 15) return false;
 
+    switch (instruction_categories[instruction->type]) {
+        case INSTRUCTION_CATEGORY_DATA_PROCESSING: {
+            return true;
+        }
+        case INSTRUCTION_CATEGORY_SINGLE_DATA_TRANSFER: {
+            return instruction->type == INSTRUCTION_LDR;
+        }
+        case INSTRUCTION_CATEGORY_HALFWORD_AND_SIGNED_DATA_TRANSFER: {
+            return instruction->type != INSTRUCTION_STRH_IMM && instruction->type != INSTRUCTION_STRH;
+        }
         default: {
-            assert(!"Invalid instruction type for category");
+            return false;
         }
     }
 }
 
-static void
-process_coprocessor_data_transfers()
+/**
+ * A block is an idle loop candidate when it ends with a direct branch to its first instruction and
+ * nothing before the branch writes memory. Polling loops (waiting for VCOUNT, for example) look like this.
+ */
+static bool
+is_idle_loop_block(BasicBlock *block)
 {
-    switch (decoded_instruction.type) {
-        case INSTRUCTION_STC: {
-            assert(!"Implement");
-        } break;
-        case INSTRUCTION_LDC: {
-            assert(!"Implement");
-        } break;
-
-        default: {
-            assert(!"Invalid instruction type for category");
-        }
+    Instruction *last = block->instructions + block->instruction_count - 1;
+
+    u32 target = 0;
+    if (block->thumb && last->type == INSTRUCTION_CONDITIONAL_BRANCH) {
+        target = last->address + 4 + left_shift_sign_extended(last->offset, 8, 1);
+    } else if (block->thumb && last->type == INSTRUCTION_UNCONDITIONAL_BRANCH) {
+        target = last->address + 4 + left_shift_sign_extended(last->offset, 11, 1);
+    } else if (!block->thumb && last->type == INSTRUCTION_B && !last->L) {
+        target = last->address + 8 + left_shift_sign_extended(last->offset, 24, 2);
+    } else {
+        return false;
     }
-}
 
-static void
-process_coprocessor_register_transfers()
-{
-    switch (decoded_instruction.type) {
-        case INSTRUCTION_MCR: {
-            assert(!"Implement");
-        } break;
-        case INSTRUCTION_MRC: {
-            assert(!"Implement");
-        } break;
+    if (target != block->address) return false;
 
-        default: {
-            assert(!"Invalid instruction type for category");
-        }
+    for (int i = 0; i < block->instruction_count - 1; ++i) {
+        if (!is_idle_loop_instruction(block->instructions + i, block->thumb)) return false;
     }
-}
 
-static bool first_instruction_cartridge_executed = false;
+    return true;
+}
 
-void
-execute()
+static BasicBlock *
+build_basic_block(u32 address, u8 thumb)
 {
-    if (decoded_instruction.type == INSTRUCTION_NONE) goto exit_execute;
+    BasicBlock *block = get_block_slot(&block_cache, address);
+    discard_cached_block(&block_cache, block);
+    block->address = address;
+    block->end_address = address;
+    block->thumb = thumb;
+    block->instruction_count = 0;
+    block->execution_count = 0;
+    block->native_code = 0;
+    block->native_instruction_count = 0;
+    block->native_tried = false;
+
+    u32 instruction_size = thumb ? 2 : 4;
+    u32 at = address;
+    for (int scanned = 0; scanned < BLOCK_MAX_INSTRUCTIONS && is_cacheable_code_address(at); ++scanned, at += instruction_size) {
+        Instruction instruction;
+        if (thumb) {
+            u16 encoding = bus_read16(at);
+            if (encoding == 0) continue; // NOTE: The pipeline never executes a zero encoding (see decode()).
+
+            instruction = decode_thumb_instruction(encoding, at);
+        } else {
+            u32 encoding = bus_read32(at);
+            if (encoding == 0) continue;
 
-    // Do it only once the game starts.
-    if (!first_instruction_cartridge_executed && decoded_instruction.address == 0x8000000) {
-        // Setting all keys as "released" when the game begins (the bios "pressed" all the buttons).
-        // 0: Key is pressed
-        // 1: Key is not pressed
-        // There are 10 buttons, son this set all available buttons (not pressed).
-        *REG_KEYINPUT = 0x03FF;
+            instruction = decode_arm_instruction(encoding, at);
+        }
 
-        first_instruction_cartridge_executed = true;
-    }
-    
-    if (IN_THUMB_MODE) {
-        thumb_execute();
-        return;
-    }
+        block->instructions[block->instruction_count++] = instruction;
+        block->end_address = at;
 
-    if (!should_execute_instruction(decoded_instruction.condition)) {
-        DEBUG_PRINT("0x%08X: 0x%08X %s, cpsr = 0x%08X, cycles = %lld... Skipped\n", decoded_instruction.address, decoded_instruction.encoding, get_instruction_type_string(decoded_instruction.type), cpu->cpsr, cpu->cycles);
-        cpu->cycles++;
-        
-        goto exit_execute;
+        if (ends_basic_block(&instruction, thumb)) break;
     }
-    
-    DEBUG_PRINT("0x%08X: 0x%08X %s, cpsr = 0x%08X, cycles = %lld\n", decoded_instruction.address, decoded_instruction.encoding, get_instruction_type_string(decoded_instruction.type), cpu->cpsr, cpu->cycles);
 
-    InstructionCategory category = instruction_categories[decoded_instruction.type];
-    switch (category) {
-        case INSTRUCTION_CATEGORY_BRANCH: {
-            process_branch();
-        } break;
-        case INSTRUCTION_CATEGORY_DATA_PROCESSING: {
-            process_data_processing();
-        } break;
-        case INSTRUCTION_CATEGORY_PSR_TRANSFER: {
-            process_psr_transfer();
-        } break;
-        case INSTRUCTION_CATEGORY_MULTIPLY: {
-            process_multiply();
-        } break;
-        case INSTRUCTION_CATEGORY_SINGLE_DATA_TRANSFER: {
-            process_single_data_transfer();
-        } break;
-        case INSTRUCTION_CATEGORY_HALFWORD_AND_SIGNED_DATA_TRANSFER: {
-            process_halfword_and_signed_data_transfer();
-        } break;
-        case INSTRUCTION_CATEGORY_BLOCK_DATA_TRANSFER: {
-            process_block_data_transfer();
-        } break;
-        case INSTRUCTION_CATEGORY_SINGLE_DATA_SWAP: {
-            process_single_data_swap();
-        } break;
-        case INSTRUCTION_CATEGORY_SOFTWARE_INTERRUPT: {
-            process_software_interrupt();
-        } break;
-        case INSTRUCTION_CATEGORY_COPROCESSOR_DATA_OPERATIONS: {
-            process_coprocessor_data_operations();
-        } break;
-        case INSTRUCTION_CATEGORY_COPROCESSOR_DATA_TRANSFERS: {
-            process_coprocessor_data_transfers();
-        } break;
-        case INSTRUCTION_CATEGORY_COPROCESSOR_REGISTER_TRANSFERS: {
-            process_coprocessor_register_transfers();
-        } break;
-    }
+    if (block->instruction_count == 0) return 0;
 
-exit_execute:
-    decoded_instruction = (Instruction){0};
+    block->idle_loop = is_idle_loop_block(block);
+    block->valid = true;
+    link_block_code_pages(&block_cache, block);
+
+    return block;
 }
 
+static BasicBlock *
+get_basic_block(u32 address, u8 thumb)
+{
+    BasicBlock *block = find_cached_block(&block_cache, address, thumb);
+    if (block) return block;
+
+    if (!is_cacheable_code_address(address)) return 0;
 
-void
-decode()
+    return build_basic_block(address, thumb);
+}
+
+static void
+flush_native_code()
 {
-    if (IN_THUMB_MODE) {
-        thumb_decode();
-        return;
+    for (int i = 0; i < BLOCK_CACHE_SIZE; ++i) {
+        BasicBlock *block = block_cache.blocks + i;
+        block->execution_count = 0;
+        block->native_code = 0;
+        block->native_instruction_count = 0;
+        block->native_tried = false;
     }
 
-    if (current_instruction == 0) return;
-
-    if ((current_instruction & INSTRUCTION_FORMAT_SOFTWARE_INTERRUPT) == INSTRUCTION_FORMAT_SOFTWARE_INTERRUPT) {
-        decoded_instruction = (Instruction) {
-            .type = INSTRUCTION_SWI,
-        };
-    }
-    else if ((current_instruction & INSTRUCTION_FORMAT_COPROCESSOR_REGISTER_TRANSFER) == INSTRUCTION_FORMAT_COPROCESSOR_REGISTER_TRANSFER) {
-        u8 L = (current_instruction >> 20) & 1;
-        InstructionType type = 0;
-        switch (L) {
-            case 0: type = INSTRUCTION_MCR; break;
-            case 1: type = INSTRUCTION_MRC; break;
-        }
+    reset_jit_code_buffer(&jit_code_buffer);
+}
 
-        decoded_instruction = (Instruction) {
-            .type = type,
-        };
-    }
-    else if ((current_instruction & INSTRUCTION_FORMAT_COPROCESSOR_DATA_OPERATION) == INSTRUCTION_FORMAT_COPROCESSOR_DATA_OPERATION) {
-        decoded_instruction = (Instruction) {
-            .type = INSTRUCTION_CDP,
-        };
-    }
-    else if ((current_instruction & INSTRUCTION_FORMAT_COPROCESSOR_DATA_TRANSFER) == INSTRUCTION_FORMAT_COPROCESSOR_DATA_TRANSFER) {
-        u8 L = (current_instruction >> 20) & 1;
-        InstructionType type = 0;
-        switch (L) {
-            case 0: type = INSTRUCTION_STC; break;
-            case 1: type = INSTRUCTION_LDC; break;
-        }
+/**
+ * Runs the translated leading instructions of the block, translating them once the block is hot.
+ * Returns how many instructions of the block were run.
+ */
+static int
+run_native_code(BasicBlock *block)
+{
+    // NOTE: execute() sets up the keys when the cartridge code starts, so leave the BIOS interpreted.
+    if (!first_instruction_cartridge_executed) return 0;
 
-        decoded_instruction = (Instruction) {
-            .type = type,
-        };
-    }
-    else if ((current_instruction & INSTRUCTION_FORMAT_BRANCH) == INSTRUCTION_FORMAT_BRANCH) {
-        decoded_instruction = (Instruction) {
-            .type = INSTRUCTION_B,
-            .offset = current_instruction & 0xFFFFFF,
-            .L = (u8)((current_instruction >> 24) & 1),
-        };
-    }
-    else if ((current_instruction & INSTRUCTION_FORMAT_BLOCK_DATA_TRANSFER) == INSTRUCTION_FORMAT_BLOCK_DATA_TRANSFER) {
-        int opcode = (current_instruction >> 20) & 1;
-        InstructionType type = 0;
-        switch (opcode) {
-            case 0: type = INSTRUCTION_STM; break;
-            case 1: type = INSTRUCTION_LDM; break;
-        }
+    if (!block->native_tried) {
+        if (++block->execution_count < JIT_HOT_BLOCK_THRESHOLD) return 0;
 
-        decoded_instruction = (Instruction) {
-            .type = type,
-            .P = (current_instruction >> 24) & 1,
-            .U = (current_instruction >> 23) & 1,
-            .S = (current_instruction >> 22) & 1,
-            .W = (current_instruction >> 21) & 1,
-            .L = (current_instruction >> 20) & 1,
-            .rn = (current_instruction >> 16) & 0xF,
-            .register_list = current_instruction & 0xFFFF,
-        };
-
-        if (decoded_instruction.S) {
-            decoded_instruction.W = 0; // NOTE: Setting bit 21 (the W bit) has UNPREDICTABLE results, so let's force to 0.
+        if (jit_code_buffer.used + JIT_MAX_BLOCK_CODE_SIZE > JIT_CODE_BUFFER_SIZE) {
+            flush_native_code();
         }
 
-        // NOTE: R15 should not be used as the base register in any LDM or STM instruction.
-        assert(decoded_instruction.rn != 15);
-
-        // NOTE: Any subset of the registers, or all the registers, may be specified. The only restriction is that the register list should not be empty.
-        assert(decoded_instruction.register_list > 0);
+        JitBlockFunction code = 0;
+        block->native_instruction_count = (u16)jit_translate_block(&jit_code_buffer, cpu, block, &code, &block->native_cycles);
+        block->native_code = (void *)code;
+        block->native_tried = true;
     }
-    else if ((current_instruction & INSTRUCTION_FORMAT_SINGLE_DATA_TRANSFER) == INSTRUCTION_FORMAT_SINGLE_DATA_TRANSFER) {
-        int opcode = (current_instruction >> 20) & 1;
-        InstructionType type = 0;
-        switch (opcode) {
-            case 0: type = INSTRUCTION_STR; break;
-            case 1: type = INSTRUCTION_LDR; break;
-        }
 
-        decoded_instruction = (Instruction) {
-            .type = type,
-            .I = (current_instruction >> 25) & 1,
-            .P = (current_instruction >> 24) & 1,
-            .U = (current_instruction >> 23) & 1,
-            .B = (current_instruction >> 22) & 1,
-            .W = (current_instruction >> 21) & 1,
-            .L = (current_instruction >> 20) & 1,
-            .rn = (current_instruction >> 16) & 0xF,
-            .rd = (current_instruction >> 12) & 0xF,
-            .offset = current_instruction & 0xFFF,
-        };
-    }
-    else if ((current_instruction & INSTRUCTION_FORMAT_HALFWORD_DATA_TRANSFER_IMMEDIATE_OFFSET) == INSTRUCTION_FORMAT_HALFWORD_DATA_TRANSFER_IMMEDIATE_OFFSET) {
-        if ((current_instruction >> 25) & 1) {
-            // HALFWORD_DATA_TRANSFER does not have the 25-bit set; it should be a DATA_PROCESSING instruction.
-            goto data_processing;
-        }
-        
-        u8 H = (current_instruction >> 5) & 1;
-        u8 S = (current_instruction >> 6) & 1;
+    if (!block->native_code) return 0;
 
-        if (S == 0 && H == 0) goto SWP;
+    // NOTE: The translated instructions run all at once, so neither the run nor the next event (an
+    // interrupt, a DMA, ...) can come in the middle of them.
+    u64 end_cycles = (scheduler.next_event_cycles < run_end_cycles) ? scheduler.next_event_cycles : run_end_cycles;
+    if (cpu->cycles + block->native_cycles >= end_cycles) return 0;
 
-        u8 L = (current_instruction >> 20) & 1;
-        InstructionType type = 0;
-        if (S == 0 && H == 1) {
-            if (L) {
-                // load
-                type = INSTRUCTION_LDRH;
-            } else {
-                type = INSTRUCTION_STRH;
-            }
-        } else if (S == 1 && H == 0) {
-            type = INSTRUCTION_LDRSB;
-        } else {
-            type = INSTRUCTION_LDRSH;
-        }
+    // NOTE: The native code works on the flags in the cpsr.
+    materialize_flags(cpu);
+    ((JitBlockFunction)block->native_code)(cpu);
+    run_events();
 
-        decoded_instruction = (Instruction) {
-            .type = type,
-            .offset = ((current_instruction >> 4) & 0xF0) | (current_instruction & 0xF),
-            .H = H,
-            .S = S,
-            .rd = (current_instruction >> 12) & 0xF,
-            .rn = (current_instruction >> 16) & 0xF,
-            .L = L,
-            .I = (current_instruction >> 22) & 1,
-            .W = (current_instruction >> 21) & 1,
-            .U = (current_instruction >> 23) & 1,
-            .P = (current_instruction >> 24) & 1,
-        };
-    }
-    else if ((current_instruction & INSTRUCTION_FORMAT_HALFWORD_DATA_TRANSFER_REGISTER_OFFSET) == INSTRUCTION_FORMAT_HALFWORD_DATA_TRANSFER_REGISTER_OFFSET) {
-        if ((current_instruction >> 25) & 1) {
-            // HALFWORD_DATA_TRANSFER does not have the 25-bit set; it should be a DATA_PROCESSING instruction.
-            goto data_processing;
+    return block->native_instruction_count;
+}
+
+static void
+run_basic_block(BasicBlock *block)
+{
+    u8 thumb = block->thumb;
+    u32 instruction_size = thumb ? 2 : 4;
+    u32 next_address = block->address;
+
+    int first = 0;
+    if (use_jit && (block->native_code || !block->native_tried)) {
+        first = run_native_code(block);
+        if (first > 0) {
+            next_address = block->instructions[first - 1].address + instruction_size;
         }
+    }
 
-        u8 H = (current_instruction >> 5) & 1;
-        u8 S = (current_instruction >> 6) & 1;
+    for (int i = first; i < block->instruction_count; ++i) {
+        Instruction *instruction = block->instructions + i;
+        u32 pc = instruction->address + 2*instruction_size; // As if the instruction went through the pipeline
+        next_address = instruction->address + instruction_size;
 
-        if (S == 0 && H == 0) goto SWP;
+        cpu->pc = pc;
+        current_instruction = instruction->encoding; // Anything but 0: execute() clears it when the pipeline is flushed.
+        decoded_instruction = *instruction;
 
-        u8 L = (current_instruction >> 20) & 1;
+        execute();
+        run_events();
 
-        // if (L == 0 && S == 1) assert(!"Bad flags");
+        if (current_instruction == 0) {
+            // Branch taken: the pipeline is empty and PC is the next instruction to execute.
+            return;
+        }
 
-        InstructionType type = 0;
-        if (S == 0 && H == 1) {
-            if (L) {
-                // load
-                type = INSTRUCTION_LDRH;
+        if (cpu->pc != pc || IN_THUMB_MODE != thumb) {
+            // PC or state changed without flushing the pipeline, so continue with the same pipeline
+            // contents the regular loop would have.
+            if (thumb) {
+                current_instruction = bus_read16(next_address);
             } else {
-                type = INSTRUCTION_STRH;
+                current_instruction = bus_read32(next_address);
             }
-        } else if (S == 1 && H == 0) {
-            type = INSTRUCTION_LDRSB;
-        } else {
-            type = INSTRUCTION_LDRSH;
-        }
 
-        decoded_instruction = (Instruction) {
-            .type = type,
-            .rm = current_instruction & 0xF,
-            .H = H,
-            .S = S,
-            .rd = (current_instruction >> 12) & 0xF,
-            .rn = (current_instruction >> 16) & 0xF,
-            .L = L,
-            .W = (current_instruction >> 21) & 1,
-            .U = (current_instruction >> 23) & 1,
-            .P = (current_instruction >> 24) & 1,
-        };
-    }
-    else if ((current_instruction & INSTRUCTION_FORMAT_BRANCH_AND_EXCHANGE) == INSTRUCTION_FORMAT_BRANCH_AND_EXCHANGE) {
-        decoded_instruction = (Instruction) {
-            .type = INSTRUCTION_BX,
-            .rn = (current_instruction & 0xF),
-        };
-    }
-    else if ((current_instruction & INSTRUCTION_FORMAT_SINGLE_DATA_SWAP) == INSTRUCTION_FORMAT_SINGLE_DATA_SWAP) {
-SWP:
-        decoded_instruction = (Instruction) {
-            .type = INSTRUCTION_SWP,
-            .rm = current_instruction & 0xF,
-            .rd = (current_instruction >> 12) & 0xF,
-            .rn = (current_instruction >> 16) & 0xF,
-            .B = (current_instruction >> 22) & 1,
-        };
-    }
-    else if ((current_instruction & INSTRUCTION_FORMAT_MULTIPLY_LONG) == INSTRUCTION_FORMAT_MULTIPLY_LONG) {
-        u8 A = (current_instruction >> 21) & 1;
-        InstructionType type = 0;
-        switch (A) {
-            case 0: type = INSTRUCTION_MULL; break;
-            case 1: type = INSTRUCTION_MLAL; break;
+            decode();
+            fetch();
+            return;
         }
 
-        decoded_instruction = (Instruction) {
-            .type = type,
-            .rm = current_instruction & 0xF,
-            .rs = (current_instruction >> 8) & 0xF,
-            .rdlo = (current_instruction >> 12) & 0xF,
-            .rdhi = (current_instruction >> 16) & 0xF,
-            .S = (current_instruction >> 20) & 1,
-            .A = A,
-            .U = (current_instruction >> 22) & 1,
-        };
-    }
-    else if ((current_instruction & INSTRUCTION_FORMAT_MULTIPLY) == INSTRUCTION_FORMAT_MULTIPLY) {
-        u8 A = (current_instruction >> 21) & 1;
-        InstructionType type = 0;
-        switch (A) {
-            case 0: type = INSTRUCTION_MUL; break;
-            case 1: type = INSTRUCTION_MLA; break;
+        if (!block->valid || cpu->cycles >= run_end_cycles || cpu->halted || cpu->irq_pending) {
+            break;
         }
+    }
 
-        decoded_instruction = (Instruction) {
-            .type = type,
-            .rm = current_instruction & 0xF,
-            .rs = (current_instruction >> 8) & 0xF,
-            .rn = (current_instruction >> 12) & 0xF,
-            .rd = (current_instruction >> 16) & 0xF,
-            .S = (current_instruction >> 20) & 1,
-            .A = A,
-        };
-    }
-    else if ((current_instruction & INSTRUCTION_FORMAT_DATA_PROCESSING) == INSTRUCTION_FORMAT_DATA_PROCESSING) {
-data_processing:
-        int opcode = (current_instruction >> 21) & 0b1111;
-        InstructionType type = 0;
-        switch (opcode) {
-            case 0b0000: type = INSTRUCTION_AND; break;
-            case 0b0001: type = INSTRUCTION_EOR; break;
-            case 0b0010: type = INSTRUCTION_SUB; break;
-            case 0b0011: type = INSTRUCTION_RSB; break;
-            case 0b0100: type = INSTRUCTION_ADD; break;
-            case 0b0101: type = INSTRUCTION_ADC; break;
-            case 0b0110: type = INSTRUCTION_SBC; break;
-            case 0b0111: type = INSTRUCTION_RSC; break;
-            case 0b1000: type = INSTRUCTION_TST; break;
-            case 0b1001: type = INSTRUCTION_TEQ; break;
-            case 0b1010: type = INSTRUCTION_CMP; break;
-            case 0b1011: type = INSTRUCTION_CMN; break;
-            case 0b1100: type = INSTRUCTION_ORR; break;
-            case 0b1101: type = INSTRUCTION_MOV; break;
-            case 0b1110: type = INSTRUCTION_BIC; break;
-            case 0b1111: type = INSTRUCTION_MVN; break;
-        }
+    // Leave the pipeline empty, so the next instruction is fetched from next_address.
+    cpu->pc = next_address;
+    current_instruction = 0;
+}
 
-        u8 S = (current_instruction >> 20) & 1;
-        decoded_instruction = (Instruction) {
-            .type = type,
-            .S = S, // Set condition codes
-            .I = (current_instruction >> 25) & 1, // Immediate operand
-            .rn = (current_instruction >> 16) & 0xF, // Source register
-            .rd = (current_instruction >> 12) & 0xF, // Destination register
-            .second_operand = current_instruction & ((1 << 12) - 1),
-        };
-
-        if (S == 0 && (type == INSTRUCTION_TST ||
-                       type == INSTRUCTION_TEQ ||
-                       type == INSTRUCTION_CMP ||
-                       type == INSTRUCTION_CMN))
-        {
-            u8 special_type = (current_instruction >> 16) & 0b111111;
-            switch (special_type) {
-                case 0b001111: {
-                    decoded_instruction = (Instruction) {
-                        .type = INSTRUCTION_MRS,
-                        .P = (current_instruction >> 22) & 1,
-                        .rd = (current_instruction >> 12) & 0xF,
-                    };
-                } break;
-                case 0b101001: {
-                    decoded_instruction = (Instruction) {
-                        .type = INSTRUCTION_MSR,
-                        .P = (current_instruction >> 22) & 1,
-                        .rm = current_instruction & 0xF,
-                        .mask = (current_instruction >> 16) & 0xF,
-                    };
-                } break;
-                case 0b101000: {
-                    decoded_instruction = (Instruction) {
-                        .type = INSTRUCTION_MSR,
-                        .P = (current_instruction >> 22) & 1,
-                        .source_operand = current_instruction & 0xFFF,
-                        .I = 1, // To be recognized as immediate
-                        .mask = (current_instruction >> 16) & 0xF,
-                    };
-                } break;
-                default: {
-                    // If does not meet the requirements to be the previous instructions, just keep the original one and set the S flag.
-                    // NOTE: An assembler should always set the S flag for these instructions even if this is not specified in the mnemonic.
-                    decoded_instruction.S = 1;
-                }
-            }
-        }
+/**
+ * Runs an iteration of an idle loop candidate. If it branched back to the start leaving the registers and
+ * flags as they were, the next iterations would do the same until the I/O registers change (on the next
+ * event of the scheduler), so the whole iterations that fit before that are skipped.
+ */
+static void
+run_idle_loop(BasicBlock *block)
+{
+    materialize_flags(cpu);
+    u32 registers[15];
+    memcpy(registers, cpu->r, sizeof(registers));
+    u32 cpsr = cpu->cpsr;
+    u64 start_cycles = cpu->cycles;
+    u64 next_event_cycles = scheduler.next_event_cycles;
+    timer_counter_read = false;
 
+    run_basic_block(block);
 
-    } else {
-        fprintf(stderr, "Instruction unknown: 0x%08X\n", current_instruction);
-        exit(1);
-    }
+    if (current_instruction != 0 || cpu->pc != block->address) return;
 
+    // NOTE: No event must have run during the iteration, the reads could have seen both values. The
+    // timer counters change between the events, so a loop reading them is not idle.
+    if (scheduler.next_event_cycles != next_event_cycles || cpu->cycles >= next_event_cycles) return;
+    if (timer_counter_read) return;
 
-    decoded_instruction.condition = (current_instruction >> 28) & 0xF;
-    decoded_instruction.address = cpu->pc - 4;
-    decoded_instruction.encoding = current_instruction;
+    materialize_flags(cpu);
+    if (cpu->cpsr != cpsr || memcmp(registers, cpu->r, sizeof(registers)) != 0) return;
 
-    current_instruction = 0;
+    u64 end_cycles = (next_event_cycles < run_end_cycles) ? next_event_cycles : run_end_cycles;
+    if (cpu->cycles >= end_cycles) return;
+
+    u64 iteration_cycles = cpu->cycles - start_cycles;
+    cpu->cycles += ((end_cycles - cpu->cycles) / iteration_cycles) * iteration_cycles;
+    run_events();
 }
 
+/**
+ * Runs the emulator for n cycles, or a few more: the last instruction (or BIOS call) can end after them.
+ * Frames do not matter here, so the embedders can run slices of any size.
+ */
 void
-fetch()
+run_cycles(u64 n)
 {
-    if (IN_THUMB_MODE) {
-        thumb_fetch();
-    } else {
-        current_instruction = *(u32 *)get_memory_at(cpu, &memory, cpu->pc);
-        cpu->pc += 4;
-    }
-}
-
+    run_end_cycles = cpu->cycles + n;
 
+    while (cpu->cycles < run_end_cycles) {
+        if (cpu->irq_pending) {
+            take_irq();
+            continue;
+        }
 
-#define CYCLES_HDRAW            960
-#define CYCLES_HBLANK           272
-#define CYCLES_SCANLINE         (CYCLES_HDRAW + CYCLES_HBLANK)
-#define CYCLES_VDRAW            160*CYCLES_SCANLINE
-#define CYCLES_VBLANK           68*CYCLES_SCANLINE
-#define MAX_SCANLINE            228
-#define CPU_CYCLES_PER_FRAME    (280896)
+        if (cpu->halted) {
+            run_halted();
+            continue;
+        }
 
-static u8 current_scanline;
+        if (use_block_cache && decoded_instruction.type == INSTRUCTION_NONE) {
+            // The pipeline is empty, the next instruction is the one fetched (if any).
+            u8 thumb = IN_THUMB_MODE;
+            u32 address = cpu->pc;
+            if (current_instruction != 0) {
+                address -= thumb ? 2 : 4;
+            }
 
-static void
-set_lcd_io()
-{
-    u32 cycles_current_frame = (cpu->cycles % CPU_CYCLES_PER_FRAME);
-    u32 cycles_current_scanline = (cycles_current_frame / CYCLES_SCANLINE);
+            BasicBlock *block = get_basic_block(address, thumb);
+            if (block && block->idle_loop) {
+                run_idle_loop(block);
+                continue;
+            }
+            if (block) {
+                run_basic_block(block);
+                continue;
+            }
+        }
 
-    u8 scanline = cycles_current_scanline % MAX_SCANLINE;
-    if (scanline != current_scanline) {
-        current_scanline = scanline;
-        *IO_VCOUNT = current_scanline;
+        execute();
+        run_events();
+        
+        decode();
+        fetch();
     }
     
-
-    *IO_DISPSTAT &= 0xFFFC; // Clear last 2 bits
-    
-    if (cycles_current_frame > CYCLES_VDRAW && cycles_current_frame <= CYCLES_VBLANK) {
-        *IO_DISPSTAT |= 1; // Set bit 0
-    }
-
-    if (cycles_current_scanline > CYCLES_HDRAW && cycles_current_scanline <= CYCLES_HBLANK) {
-        *IO_DISPSTAT |= 0b10; // Set bit 1
-    }
+    materialize_flags(cpu);
 }
 
-
-static u32 current_frame = 0;
-
+/**
+ * Runs until the end of the current frame.
+ */
 static void
 run()
 {
-    while (cpu->cycles / CPU_CYCLES_PER_FRAME <= current_frame) {
-        execute();
-        set_lcd_io();
-        
-        decode();
-        fetch();
-        if (paused) return;
+    u64 frame_end_cycles = (u64)(current_frame + 1) * CPU_CYCLES_PER_FRAME;
+    if (cpu->cycles < frame_end_cycles) {
+        run_cycles(frame_end_cycles - cpu->cycles);
     }
-    
-    current_frame++;
 
+    current_frame++;
 }
 
 // Video
@@ -2952,10 +4525,25 @@ mark_pressed_keys()
             *REG_KEYINPUT |= (1 << i);
         }
     }
+
+    check_keypad_interrupt();
 }
 
 int main(int argc, char *argv[])
 {
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--jit") == 0) {
+            // NOTE: The interpreter stays the default, so both can be compared.
+            use_jit = JIT_AVAILABLE;
+        } else if (strcmp(argv[i], "--interpreter") == 0) {
+            use_jit = false;
+        } else if (strcmp(argv[i], "--lle-bios") == 0) {
+            use_hle_bios = false;
+        } else if (strcmp(argv[i], "--direct-boot") == 0) {
+            use_direct_boot = true;
+        }
+    }
+
     init_gba();
     
     // char *filename = "Donkey Kong Country 2.gba";
@@ -2964,6 +4552,10 @@ int main(int argc, char *argv[])
     if (error) {
         exit(1);
     }
+
+    if (use_direct_boot) {
+        direct_boot();
+    }
     
     // CartridgeHeader *header = (CartridgeHeader *)memory.game_pak_rom;
     // printf("fixed_value = 0x%08X, expected = 0x96\n", header->fixed_value);
@@ -1,6 +1,11 @@
 #ifndef MEMORY_H
 #define MEMORY_H
 
+#define MEMORY_PAGE_SHIFT       (14)        /* 16 KB pages */
+#define MEMORY_PAGE_SIZE        (1 << MEMORY_PAGE_SHIFT)
+#define MEMORY_PAGE_MASK        (MEMORY_PAGE_SIZE - 1)
+#define MEMORY_PAGE_COUNT       ((1 << 28) >> MEMORY_PAGE_SHIFT)
+
 typedef struct GBAMemory {
     // General Internal Memory
     u8 bios_system_rom[16*KILOBYTE];
@@ -14,13 +19,47 @@ typedef struct GBAMemory {
     u8 oam_obj_attributes[1*KILOBYTE];
 
     // External Memory (Game Pak)
-    u8 game_pak_rom[32*MEGABYTE];
-    u8 game_pak_ram[64*MEGABYTE];
+    u8 *game_pak_rom;               // Up to 32 MB, allocated to the size of the ROM file (see load_cartridge_into_memory())
+    u32 game_pak_rom_size;          // Rounded up to whole pages
+    u8 game_pak_ram[64*KILOBYTE];   // SRAM/Flash, the 64 KB window the cartridge backup is reached through
+
+    // Host memory of each page of the 28 bits bus, or 0 for the ones that go through the checks in
+    // get_memory_at_slow() (see init_memory_pages()).
+    u8 *pages[MEMORY_PAGE_COUNT];
 } GBAMemory;
 
 
-u8 *
-get_memory_at(CPU *cpu, GBAMemory *gba_memory, u32 at)
+static void
+map_memory_pages(GBAMemory *gba_memory, u32 start, u32 end, u8 *memory, u32 size)
+{
+    for (u32 at = start; at < end; at += MEMORY_PAGE_SIZE) {
+        gba_memory->pages[at >> MEMORY_PAGE_SHIFT] = memory + ((at - start) % size);
+    }
+}
+
+/**
+ * Only the regions that are linear (or mirrored) over whole pages are mapped: the BIOS, the work RAMs,
+ * the first 96 KB of VRAM and the Game Pak. The I/O registers, the palette and the OAM (smaller than a
+ * page) and the mirrors that are asserted on stay on the slow path, and so does the Game Pak ROM after
+ * the end of the loaded ROM.
+ */
+static void
+init_memory_pages(GBAMemory *gba_memory)
+{
+    memset(gba_memory->pages, 0, sizeof(gba_memory->pages));
+
+    map_memory_pages(gba_memory, 0x00000000, 0x00004000, gba_memory->bios_system_rom, sizeof(gba_memory->bios_system_rom));
+    map_memory_pages(gba_memory, 0x02000000, 0x02040000, gba_memory->ewram, sizeof(gba_memory->ewram));
+    map_memory_pages(gba_memory, 0x03000000, 0x04000000, gba_memory->iwram, sizeof(gba_memory->iwram));
+    map_memory_pages(gba_memory, 0x06000000, 0x06018000, gba_memory->vram, sizeof(gba_memory->vram));
+    map_memory_pages(gba_memory, 0x08000000, 0x08000000 + gba_memory->game_pak_rom_size, gba_memory->game_pak_rom, gba_memory->game_pak_rom_size);
+    map_memory_pages(gba_memory, 0x0A000000, 0x0A000000 + gba_memory->game_pak_rom_size, gba_memory->game_pak_rom, gba_memory->game_pak_rom_size);
+    map_memory_pages(gba_memory, 0x0C000000, 0x0C000000 + gba_memory->game_pak_rom_size, gba_memory->game_pak_rom, gba_memory->game_pak_rom_size);
+    map_memory_pages(gba_memory, 0x0E000000, 0x0E010000, gba_memory->game_pak_ram, sizeof(gba_memory->game_pak_ram));
+}
+
+static u8 *
+get_memory_at_slow(CPU *cpu, GBAMemory *gba_memory, u32 at)
 {
     // General Internal Memory
     if (at <= 0x00003FFF) return (gba_memory->bios_system_rom + (at - 0x00000000));
@@ -81,14 +120,11 @@ get_memory_at(CPU *cpu, GBAMemory *gba_memory, u32 at)
     }
 
     // External Memory (Game Pak)
-    if (at <= 0x09FFFFFF) return (gba_memory->game_pak_rom + (at - 0x08000000));
-    if (at <= 0x0BFFFFFF) {
-        at -= 0x0A000000;
-
-        return (gba_memory->game_pak_rom + at);
-    }
     if (at <= 0x0DFFFFFF) {
-        at -= 0x0C000000;
+        // NOTE: The three regions (wait states 0, 1 and 2) mirror the same ROM. Past its end there is
+        // nothing to read.
+        at = (at - 0x08000000) % 0x02000000;
+        if (at >= gba_memory->game_pak_rom_size) return 0;
 
         return (gba_memory->game_pak_rom + at);
     }
@@ -100,4 +136,19 @@ get_memory_at(CPU *cpu, GBAMemory *gba_memory, u32 at)
     return 0;
 }
 
+/**
+ * Host memory of the address: a lookup in the page table, or the region checks for the pages that are
+ * not mapped.
+ */
+u8 *
+get_memory_at(CPU *cpu, GBAMemory *gba_memory, u32 at)
+{
+    u32 page = at >> MEMORY_PAGE_SHIFT;
+    if (page < MEMORY_PAGE_COUNT && gba_memory->pages[page]) {
+        return gba_memory->pages[page] + (at & MEMORY_PAGE_MASK);
+    }
+
+    return get_memory_at_slow(cpu, gba_memory, at);
+}
+
 #endif // MEMORY_H
\ No newline at end of file
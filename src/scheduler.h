@@ -0,0 +1,95 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+//
+// Scheduler
+//
+// The hardware that changes on its own (the LCD, the timers) does it at cycles that are known in
+// advance, so each change is an event scheduled at its cycle instead of being polled after every
+// instruction. There is at most one pending event of each type, so the queue is a small array indexed by
+// type, along with the cycle of the earliest event: the CPU runs until cpu->cycles reaches it (see
+// run_events()).
+//
+typedef enum EventType {
+    EVENT_HBLANK,       // The LCD reaches the end of the visible part of the scanline
+    EVENT_SCANLINE,     // The LCD starts the next scanline
+    EVENT_TIMER0,       // Overflow of a timer counting cycles (EVENT_TIMER0 + timer index)
+    EVENT_TIMER1,
+    EVENT_TIMER2,
+    EVENT_TIMER3,
+    EVENT_COUNT
+} EventType;
+
+#define EVENT_NOT_SCHEDULED     (~(u64)0)
+
+typedef struct Scheduler {
+    u64 event_cycles[EVENT_COUNT];  // Cycle of each event, or EVENT_NOT_SCHEDULED
+    u64 next_event_cycles;          // The earliest of event_cycles
+} Scheduler;
+
+
+static void
+update_next_event_cycles(Scheduler *scheduler)
+{
+    u64 next = EVENT_NOT_SCHEDULED;
+    for (int i = 0; i < EVENT_COUNT; ++i) {
+        if (scheduler->event_cycles[i] < next) next = scheduler->event_cycles[i];
+    }
+
+    scheduler->next_event_cycles = next;
+}
+
+static void
+init_scheduler(Scheduler *scheduler)
+{
+    for (int i = 0; i < EVENT_COUNT; ++i) {
+        scheduler->event_cycles[i] = EVENT_NOT_SCHEDULED;
+    }
+    scheduler->next_event_cycles = EVENT_NOT_SCHEDULED;
+}
+
+/**
+ * Schedules the event at the cycle, replacing the pending one of the same type (if any).
+ */
+static void
+schedule_event(Scheduler *scheduler, EventType type, u64 cycles)
+{
+    u64 previous_cycles = scheduler->event_cycles[type];
+    scheduler->event_cycles[type] = cycles;
+
+    if (cycles <= scheduler->next_event_cycles) {
+        scheduler->next_event_cycles = cycles;
+    } else if (previous_cycles == scheduler->next_event_cycles) {
+        update_next_event_cycles(scheduler);
+    }
+}
+
+static void
+cancel_event(Scheduler *scheduler, EventType type)
+{
+    schedule_event(scheduler, type, EVENT_NOT_SCHEDULED);
+}
+
+/**
+ * Removes the earliest event that is due at the cycle and returns its type, or EVENT_COUNT if there is
+ * none. Events due at the same cycle come out in the order of EventType.
+ */
+static EventType
+pop_due_event(Scheduler *scheduler, u64 cycles, u64 *event_cycles)
+{
+    if (cycles < scheduler->next_event_cycles) return EVENT_COUNT;
+
+    for (int i = 0; i < EVENT_COUNT; ++i) {
+        if (scheduler->event_cycles[i] == scheduler->next_event_cycles) {
+            *event_cycles = scheduler->event_cycles[i];
+            scheduler->event_cycles[i] = EVENT_NOT_SCHEDULED;
+            update_next_event_cycles(scheduler);
+
+            return (EventType)i;
+        }
+    }
+
+    return EVENT_COUNT;
+}
+
+#endif // SCHEDULER_H